@@ -0,0 +1,506 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Headless batch runner. Runs many independent emulator instances on a
+ * pool of worker threads and reports the final state of each one.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "chip8.h"
+#include "rom.h"
+#include "arena.h"
+#include "input.h"
+
+/* One emulator instance to run */
+struct job {
+    char *rom_file;                     /* Rom to load, or recording (-p) */
+    const struct rom_image *rom;        /* Its image, NULL if unloadable */
+    struct input_replay *replay;        /* Recording to play back (-p) */
+    int copy;                           /* Copy number of this rom */
+    uint32_t seed;                      /* Random generator seed */
+    enum eml_stat status;               /* Final state */
+    uint64_t hash;                      /* Final state hash */
+    uint64_t instr_count;               /* Run instructions, idle ones included */
+    uint64_t idle_count;                /* Of those, skipped in idle loops */
+    int frames;                         /* Frames run until the end/fault */
+    int screens;                        /* Distinct displays at frame ends */
+    bool load_failed;                   /* Rom could not be loaded */
+    bool mismatch;                      /* Replay ended in another state */
+};
+
+/*
+ * Job queue of a worker. The owner takes jobs from the tail, idle workers
+ * steal from the head.
+ */
+struct deque {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head;
+    int tail;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    struct emulator *eml;               /* Instance the jobs are run on */
+};
+
+static struct rom_pool pool;
+static struct arena arena;
+static struct job *jobs;
+static int job_n;
+static struct deque *queues;
+static struct worker *workers;
+static int worker_n;
+static int frames = 600;
+static int clock_speed = 1080;
+static uint32_t seed = 1;
+static enum eml_engine engine = ENGINE_THREADED;
+static int quirks = QUIRKS_DEFAULT;     /* Profile, -1: guessed per rom */
+static bool replaying = false;          /* Files are input recordings */
+static bool count_screens = false;      /* Fill in job screens (-S) */
+
+/* Take a job from the own queue, -1 if empty */
+static int deque_pop(struct deque *q) {
+    int job = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        job = q->jobs[--q->tail];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+/* Take a job from another worker's queue, -1 if empty */
+static int deque_steal(struct deque *q) {
+    int job = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        job = q->jobs[q->head++];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+/* Next job for a worker, -1 when all queues are empty */
+static int next_job(int id) {
+    int job = deque_pop(&queues[id]);
+    for (int i = 1; job < 0 && i < worker_n; i++) {
+        job = deque_steal(&queues[(id + i) % worker_n]);
+    }
+    return job;
+}
+
+/*
+ * Set of display hashes, open addressing. Hash 0 marks free slots; a
+ * display that hashes to 0 is not counted.
+ */
+struct screen_set {
+    uint64_t *slots;
+    size_t mask;                        /* Capacity - 1, a power of two */
+    int n;
+};
+
+static void screens_init(struct screen_set *set) {
+    set->slots = count_screens ? calloc(256, sizeof *set->slots) : NULL;
+    set->mask = 255;
+    set->n = 0;
+}
+
+/* Insert into slots, true if hash was new */
+static bool screens_insert(uint64_t *slots, size_t mask, uint64_t hash) {
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (slots[i] == hash) {
+            return false;
+        }
+        if (!slots[i]) {
+            slots[i] = hash;
+            return true;
+        }
+    }
+}
+
+static void screens_add(struct screen_set *set, uint64_t hash) {
+    if (!set->slots || !hash) {
+        return;
+    }
+    /* kept at most half full */
+    if ((size_t) set->n >= set->mask / 2) {
+        size_t mask = set->mask * 2 + 1;
+        uint64_t *slots = calloc(mask + 1, sizeof *slots);
+        if (!slots) {
+            return;
+        }
+        for (size_t i = 0; i <= set->mask; i++) {
+            if (set->slots[i]) {
+                screens_insert(slots, mask, set->slots[i]);
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->mask = mask;
+    }
+    set->n += screens_insert(set->slots, set->mask, hash);
+}
+
+/* Load the rom of a job into a fresh emulator */
+static bool load_job(struct emulator *eml, struct job *job) {
+    emulator_init(eml);
+    eml->engine = engine;
+    eml->clock_speed = clock_speed;
+    eml->rom_file = job->rom_file;
+    emulator_seed(eml, job->seed);
+    if (!job->rom) {
+        job->load_failed = true;
+        return false;
+    }
+    eml->quirks = quirks < 0 ? rom_quirks(job->rom) : (enum eml_quirks) quirks;
+    if (job->replay) {
+        input_replay_setup(job->replay, eml);
+    }
+    emulator_load_image(eml, job->rom);
+    return true;
+}
+
+/* Play back the recording of a job and compare the final state */
+static void replay_job(struct emulator *eml, struct job *job) {
+    if (!load_job(eml, job)) {
+        return;
+    }
+
+    struct screen_set set;
+    screens_init(&set);
+    enum eml_stat status = EML_OK;
+    int f;
+    for (f = 0; !input_replay_done(job->replay, eml); f++) {
+        status = input_replay_frame(job->replay, eml);
+        if (status != EML_OK && status != EML_REDRAW) {
+            break;
+        }
+        screens_add(&set, emulator_display_hash(eml));
+    }
+    job->screens = set.n;
+    free(set.slots);
+
+    job->status = status == EML_REDRAW ? EML_OK : status;
+    job->frames = f;
+    job->hash = emulator_hash(eml);
+    job->mismatch = job->hash != job->replay->hdr.final_hash;
+    job->idle_count = eml->idle_count;
+    job->instr_count = eml->instr_count;
+}
+
+/* Run one instance for the configured number of frames */
+static void run_job(struct emulator *eml, struct job *job) {
+    if (!load_job(eml, job)) {
+        return;
+    }
+
+    struct screen_set set;
+    screens_init(&set);
+    enum eml_stat status = EML_OK;
+    int f;
+    for (f = 0; f < frames; f++) {
+        status = emulator_frame(eml);
+        if (status != EML_OK && status != EML_REDRAW) {
+            break;
+        }
+        screens_add(&set, emulator_display_hash(eml));
+    }
+    job->screens = set.n;
+    free(set.slots);
+
+    job->status = status == EML_REDRAW ? EML_OK : status;
+    job->frames = f;
+    job->hash = emulator_hash(eml);
+    job->idle_count = eml->idle_count;
+    job->instr_count = eml->instr_count;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct emulator *eml = w->eml;
+
+    int job;
+    while ((job = next_job(w->id)) >= 0) {
+        if (replaying) {
+            replay_job(eml, &jobs[job]);
+        } else {
+            run_job(eml, &jobs[job]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * One job per recording: its rom is the recorded file or, with a rom
+ * directory, the indexed rom of the same hash.
+ */
+static void setup_replays(char **files, const char *rom_dir) {
+    struct rom_index_entry *index = NULL;
+    int index_n = 0;
+    if (rom_dir) {
+        index = rom_index_load(rom_dir, &index_n);
+    }
+    char path[4096];
+    for (int i = 0; i < job_n; i++) {
+        struct job *job = &jobs[i];
+        job->rom_file = files[i];
+        job->replay = input_replay_open(files[i]);
+        if (!job->replay) {
+            continue;
+        }
+        const struct input_hdr *hdr = &job->replay->hdr;
+        job->seed = hdr->seed;
+        snprintf(path, sizeof path, "%s", hdr->rom_file);
+        for (int k = 0; k < index_n; k++) {
+            if (index[k].hash == hdr->rom_hash) {
+                snprintf(path, sizeof path, "%s/%s", rom_dir, index[k].name);
+                break;
+            }
+        }
+        job->rom = rom_pool_get(&pool, path);
+        if (job->rom && job->rom->hash != hdr->rom_hash) {
+            fprintf(stderr, "%s: %s is not the recorded rom\n", files[i], path);
+            job->rom = NULL;
+        }
+    }
+    free(index);
+}
+
+static double elapsed_s(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void prt_usage() {
+    static const char *usage =
+        "Usage: chip8-batch [options] [file...]\n\n"
+        "  -h           Print this message and exit\n"
+        "  -D [dir]     Run all roms of dir (listed from its index file)\n"
+        "  -j [n]       Number of worker threads (default: online CPUs)\n"
+        "  -n [n]       Number of instances per rom (default 1)\n"
+        "  -f [n]       Number of frames to run (default 600)\n"
+        "  -c           Set the clock speed (in Hz, default 1080 Hz)\n"
+        "  -s [seed]    Random seed of the first copy, copy i gets seed+i\n"
+        "               (default 1)\n"
+        "  -e [engine]  Execution engine: interp or threaded (default)\n"
+        "  -q [quirks]  Quirks profile: default, vip, chip48, schip, or auto\n"
+        "               (guessed per rom)\n"
+        "  -S           Count the distinct screens each instance showed\n"
+        "               at frame ends (a novelty measure)\n"
+        "  -p           The files are input recordings (chip8-eml -i), play\n"
+        "               them back and compare the final states; with -D,\n"
+        "               their roms are looked up in dir by hash\n";
+    fprintf(stdout, "%s", usage);
+}
+
+int main(int argc, char **argv) {
+    worker_n = sysconf(_SC_NPROCESSORS_ONLN);
+    int copies = 1;
+    const char *rom_dir = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hD:j:n:f:c:s:e:q:pS")) != -1) {
+        switch (opt) {
+        case 'h':
+            prt_usage();
+            exit(EXIT_SUCCESS);
+            break;
+        case 'D':
+            rom_dir = optarg;
+            break;
+        case 'j':
+            worker_n = atoi(optarg);
+            break;
+        case 'n':
+            copies = atoi(optarg);
+            break;
+        case 'f':
+            frames = atoi(optarg);
+            break;
+        case 'c':
+            clock_speed = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'e':
+            if (strcmp(optarg, "interp") == 0) {
+                engine = ENGINE_INTERP;
+            } else if (strcmp(optarg, "threaded") == 0) {
+                engine = ENGINE_THREADED;
+            } else {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            quirks = strcmp(optarg, "auto") == 0 ? -1 : emulator_quirks_parse(optarg);
+            if (quirks < 0 && strcmp(optarg, "auto") != 0) {
+                fprintf(stderr, "Unknown quirks profile: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            replaying = true;
+            break;
+        case 'S':
+            count_screens = true;
+            break;
+        default:
+            prt_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (replaying && copies != 1) {
+        fprintf(stderr, "Error: -p plays each recording once\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the roms, given as files or as the index of a directory */
+    char **rom_files = argv + optind;
+    int rom_n = argc - optind;
+    if (rom_dir && !replaying) {
+        struct rom_index_entry *index = rom_index_load(rom_dir, &rom_n);
+        rom_files = malloc(rom_n * sizeof *rom_files);
+        if (rom_n && !rom_files) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < rom_n; i++) {
+            size_t len = strlen(rom_dir) + strlen(index[i].name) + 2;
+            rom_files[i] = malloc(len);
+            if (!rom_files[i]) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(rom_files[i], len, "%s/%s", rom_dir, index[i].name);
+        }
+        free(index);
+    }
+    if (rom_n < 1) {
+        prt_usage();
+        fprintf(stderr, "\nError: Expected file name argument\n");
+        exit(EXIT_FAILURE);
+    }
+    if (worker_n < 1 || copies < 1 || frames < 0 || clock_speed < 60) {
+        fprintf(stderr, "Error: Invalid argument\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* one job per rom copy, every rom is mapped once for all its copies */
+    job_n = rom_n * copies;
+    jobs = calloc(job_n, sizeof *jobs);
+    queues = calloc(worker_n, sizeof *queues);
+    workers = calloc(worker_n, sizeof *workers);
+    if (!jobs || !queues || !workers) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    if (replaying) {
+        setup_replays(rom_files, rom_dir);
+    }
+    for (int i = 0; i < job_n && !replaying; i++) {
+        jobs[i].rom_file = rom_files[i / copies];
+        jobs[i].copy = i % copies;
+        jobs[i].seed = seed + jobs[i].copy;
+        if (jobs[i].copy == 0) {
+            jobs[i].rom = rom_pool_get(&pool, jobs[i].rom_file);
+        } else {
+            jobs[i].rom = jobs[i - 1].rom;
+        }
+    }
+
+    /* deal the jobs out in contiguous chunks */
+    for (int w = 0; w < worker_n; w++) {
+        struct deque *q = &queues[w];
+        pthread_mutex_init(&q->lock, NULL);
+        q->jobs = malloc(job_n * sizeof *q->jobs);
+        if (!q->jobs) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = (long) job_n * w / worker_n;
+             i < (long) job_n * (w + 1) / worker_n; i++) {
+            q->jobs[q->tail++] = i;
+        }
+    }
+
+    /* the instances of all workers live in one arena, on separate lines */
+    if (!arena_init(&arena, worker_n * sizeof(struct emulator))) {
+        exit(EXIT_FAILURE);
+    }
+    for (int w = 0; w < worker_n; w++) {
+        workers[w].eml = arena_alloc_emulators(&arena, 1);
+    }
+
+    struct timespec t_start;
+    struct timespec t_end;
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (int w = 0; w < worker_n; w++) {
+        workers[w].id = w;
+        if (pthread_create(&workers[w].thread, NULL, worker_main, &workers[w])) {
+            fprintf(stderr, "Unable to start worker thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int w = 0; w < worker_n; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+    uint64_t instr_total = 0;
+    uint64_t idle_total = 0;
+    int faults = 0;
+    fprintf(stdout, "%-24s %5s %-16s %8s %12s %-16s%s\n",
+            "rom", "copy", "status", "frames", "instructions", "hash",
+            count_screens ? "  screens" : "");
+    for (int i = 0; i < job_n; i++) {
+        struct job *job = &jobs[i];
+        fprintf(stdout, "%-24s %5d %-16s %8d %12llu %016llx",
+                job->rom_file, job->copy,
+                job->load_failed ? "load-error" :
+                job->mismatch ? "mismatch" : emulator_stat_str(job->status),
+                job->frames, (unsigned long long) job->instr_count,
+                (unsigned long long) job->hash);
+        if (count_screens) {
+            fprintf(stdout, " %8d", job->screens);
+        }
+        fprintf(stdout, "\n");
+        instr_total += job->instr_count;
+        idle_total += job->idle_count;
+        faults += job->load_failed || job->mismatch ||
+                  (job->status != EML_OK && job->status != EML_EXIT);
+    }
+
+    double t = elapsed_s(&t_start, &t_end);
+    /* MIPS of the executed instructions, idle loops are fast-forwarded */
+    fprintf(stdout, "\n%d instances, %d faulted, %d threads, %.3f s, %.2f MIPS"
+            " (%.1f%% idle)\n", job_n, faults, worker_n, t,
+            (instr_total - idle_total) / t / 1e6,
+            instr_total ? 100.0 * idle_total / instr_total : 0.0);
+
+    for (int i = 0; i < job_n; i++) {
+        if (jobs[i].replay) {
+            input_replay_close(jobs[i].replay);
+        }
+    }
+    arena_free(&arena);
+    rom_pool_free(&pool);
+    return faults ? EXIT_FAILURE : EXIT_SUCCESS;
+}
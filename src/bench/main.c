@@ -0,0 +1,313 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Benchmark. Runs every rom headless with a scripted input sequence for a
+ * fixed number of emulated cycles, once per execution engine, and reports
+ * throughput and frame latency.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+
+#include "chip8.h"
+
+/* Scripted input: key (frame / KEY_PERIOD) % 16 is held for KEY_HOLD frames */
+#define KEY_PERIOD 20
+#define KEY_HOLD 4
+
+/* A run that stops executing (e.g. waits for a key) gives up after this */
+#define MAX_FRAMES_FACTOR 4
+
+struct result {
+    const char *rom_file;
+    const char *engine;
+    uint64_t instr;                     /* Executed instructions */
+    uint64_t idle;                      /* Fast-forwarded in idle loops, not
+                                           in instr */
+    uint64_t drw;                       /* Executed DRW instructions */
+    double seconds;                     /* Time of the untimed run */
+    double p50_us;                      /* Median frame step */
+    double p99_us;                      /* 99th percentile frame step */
+    enum eml_stat status;               /* Fault that ended the run early */
+};
+
+static const struct {
+    const char *name;
+    enum eml_engine engine;
+} engines[] = {
+    { "interp", ENGINE_INTERP },
+    { "threaded", ENGINE_THREADED },
+};
+
+static uint64_t cycles = 2000000;
+static int clock_speed = 1080;
+
+static int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Apply the input script for a frame */
+static void script_input(struct emulator *eml, int frame) {
+    enum chip8_key key = (frame / KEY_PERIOD) % 16;
+    if (frame % KEY_PERIOD == 0) {
+        emulator_key_down(eml, key);
+    } else if (frame % KEY_PERIOD == KEY_HOLD) {
+        emulator_key_up(eml, key);
+    }
+}
+
+static int cmp_i64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Run the configured number of cycles. With samples set, every frame step
+ * is timed; otherwise only the whole run is. Returns the number of frames.
+ */
+static int bench_run(struct emulator *eml, struct result *res, int64_t *samples,
+                     int max_frames) {
+    int f;
+    res->status = EML_OK;
+    for (f = 0; f < max_frames && eml->instr_count < cycles; f++) {
+        script_input(eml, f);
+        int64_t t = samples ? clock_ns() : 0;
+        enum eml_stat status = emulator_frame(eml);
+        if (samples) {
+            samples[f] = clock_ns() - t;
+        }
+        if (status != EML_OK && status != EML_REDRAW) {
+            res->status = status;
+            f++;
+            break;
+        }
+    }
+    return f;
+}
+
+static bool bench_rom(const char *rom_file, enum eml_engine engine,
+                      struct result *res) {
+    static struct emulator eml;
+    int max_frames = cycles * 60 / clock_speed * MAX_FRAMES_FACTOR + 1;
+    int64_t *samples = malloc(max_frames * sizeof *samples);
+    if (!samples) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* throughput, without timing inside the loop */
+    emulator_init(&eml);
+    eml.engine = engine;
+    eml.clock_speed = clock_speed;
+    if (!emulator_load_program(&eml, (char *) rom_file)) {
+        free(samples);
+        return false;
+    }
+    int64_t t_start = clock_ns();
+    bench_run(&eml, res, NULL, max_frames);
+    res->seconds = (clock_ns() - t_start) / 1e9;
+    res->instr = eml.instr_count - eml.idle_count;
+    res->idle = eml.idle_count;
+    res->drw = eml.drw_count;
+
+    /* frame latency, same run again with every frame timed */
+    emulator_init(&eml);
+    eml.engine = engine;
+    eml.clock_speed = clock_speed;
+    emulator_load_program(&eml, (char *) rom_file);
+    int n = bench_run(&eml, res, samples, max_frames);
+    qsort(samples, n, sizeof *samples, cmp_i64);
+    res->p50_us = n ? samples[n / 2] / 1e3 : 0;
+    res->p99_us = n ? samples[(int) (n * 0.99)] / 1e3 : 0;
+
+    res->rom_file = rom_file;
+    free(samples);
+    return true;
+}
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* All regular files of a directory, sorted by name */
+static char **list_roms(const char *dir, int *n) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Unable to open directory %s\n", dir);
+        exit(EXIT_FAILURE);
+    }
+    char **roms = NULL;
+    int cap = 0;
+    *n = 0;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 32;
+            roms = realloc(roms, cap * sizeof *roms);
+        }
+        size_t len = strlen(dir) + strlen(e->d_name) + 2;
+        if (!roms || !(roms[*n] = malloc(len))) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(roms[(*n)++], len, "%s/%s", dir, e->d_name);
+    }
+    closedir(d);
+    qsort(roms, *n, sizeof *roms, cmp_str);
+    return roms;
+}
+
+static double mips(const struct result *r) {
+    return r->seconds > 0 ? r->instr / r->seconds / 1e6 : 0;
+}
+
+static double ns_per_instr(const struct result *r) {
+    return r->instr ? r->seconds * 1e9 / r->instr : 0;
+}
+
+static double drw_per_s(const struct result *r) {
+    return r->seconds > 0 ? r->drw / r->seconds : 0;
+}
+
+/* Share of the emulated instructions that were fast-forwarded */
+static double idle_pct(const struct result *r) {
+    uint64_t total = r->instr + r->idle;
+    return total ? 100.0 * r->idle / total : 0;
+}
+
+static void prt_text(const struct result *res, int n) {
+    fprintf(stdout, "%-24s %-9s %9s %9s %11s %6s %9s %9s %s\n", "rom", "engine",
+            "MIPS", "ns/instr", "DRW/s", "idle %", "p50 us", "p99 us", "status");
+    for (int i = 0; i < n; i++) {
+        const struct result *r = &res[i];
+        fprintf(stdout, "%-24s %-9s %9.2f %9.2f %11.0f %6.1f %9.2f %9.2f %s\n",
+                r->rom_file, r->engine, mips(r), ns_per_instr(r), drw_per_s(r),
+                idle_pct(r), r->p50_us, r->p99_us, emulator_stat_str(r->status));
+    }
+}
+
+static void prt_json(const struct result *res, int n) {
+    fprintf(stdout, "{\n  \"cycles\": %llu,\n  \"clock_speed\": %d,\n"
+            "  \"results\": [\n", (unsigned long long) cycles, clock_speed);
+    for (int i = 0; i < n; i++) {
+        const struct result *r = &res[i];
+        fprintf(stdout, "    {\"rom\": \"%s\", \"engine\": \"%s\", "
+                "\"instructions\": %llu, \"idle_instructions\": %llu, "
+                "\"seconds\": %.6f, \"instr_per_s\": %.0f, "
+                "\"ns_per_instr\": %.3f, \"drw_per_s\": %.0f, "
+                "\"frame_p50_us\": %.3f, \"frame_p99_us\": %.3f, "
+                "\"status\": \"%s\"}%s\n",
+                r->rom_file, r->engine, (unsigned long long) r->instr,
+                (unsigned long long) r->idle,
+                r->seconds, mips(r) * 1e6, ns_per_instr(r), drw_per_s(r),
+                r->p50_us, r->p99_us, emulator_stat_str(r->status),
+                i + 1 < n ? "," : "");
+    }
+    fprintf(stdout, "  ]\n}\n");
+}
+
+static void prt_usage() {
+    static const char *usage =
+        "Usage: chip8-bench [options] [file...]\n\n"
+        "  -h           Print this message and exit\n"
+        "  -d [dir]     Benchmark all roms in dir if no files are given\n"
+        "               (default ../roms)\n"
+        "  -n [n]       Number of emulated cycles per rom (default 2000000)\n"
+        "  -c           Set the clock speed (in Hz, default 1080 Hz)\n"
+        "  -e [engine]  Only benchmark one engine: interp, threaded\n"
+        "  -J           Print the results as JSON\n";
+    fprintf(stdout, "%s", usage);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = "../roms";
+    const char *only = NULL;
+    bool json = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hd:n:c:e:J")) != -1) {
+        switch (opt) {
+        case 'h':
+            prt_usage();
+            exit(EXIT_SUCCESS);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'n':
+            cycles = strtoull(optarg, NULL, 0);
+            break;
+        case 'c':
+            clock_speed = atoi(optarg);
+            break;
+        case 'e':
+            only = optarg;
+            break;
+        case 'J':
+            json = true;
+            break;
+        default:
+            prt_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cycles < 1 || clock_speed < 60) {
+        fprintf(stderr, "Error: Invalid argument\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char **roms = argv + optind;
+    int rom_n = argc - optind;
+    if (rom_n == 0) {
+        roms = list_roms(dir, &rom_n);
+    }
+
+    int engine_n = sizeof engines / sizeof engines[0];
+    struct result *res = calloc(rom_n * engine_n, sizeof *res);
+    if (!res) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    int n = 0;
+    bool engine_found = false;
+    for (int e = 0; e < engine_n; e++) {
+        if (only && strcmp(only, engines[e].name) != 0) {
+            continue;
+        }
+        engine_found = true;
+        for (int i = 0; i < rom_n; i++) {
+            if (bench_rom(roms[i], engines[e].engine, &res[n])) {
+                res[n++].engine = engines[e].name;
+            }
+        }
+    }
+    if (!engine_found) {
+        fprintf(stderr, "Unknown engine: %s\n", only);
+        exit(EXIT_FAILURE);
+    }
+
+    if (json) {
+        prt_json(res, n);
+    } else {
+        prt_text(res, n);
+    }
+    return n == rom_n * (only ? 1 : engine_n) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,125 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Disassembler. Lists a rom as the static analysis sees it: reachable
+ * instructions with their block entries, and the bytes in between as
+ * data (read through I) or unreached.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "rom.h"
+
+/* Data bytes per listing line */
+#define DATA_PER_LINE 8
+
+static void prt_usage() {
+    static const char *usage =
+        "Usage: chip8-disasm [options] [file]\n\n"
+        "  -h           Print this message and exit\n"
+        "  -s           Only print the summary\n\n"
+        "Flags: E block entry, W stored to, * indirect jump (Bnnn)\n";
+    fprintf(stdout, "%s", usage);
+}
+
+static void prt_summary(const struct rom_image *rom) {
+    const struct rom_analysis *a = &rom->analysis;
+    int code = 0, data = 0;
+    for (size_t i = RESERVED_MEM; i < RESERVED_MEM + rom->size; i++) {
+        code += (a->mem[i] & AN_CODE) != 0;
+        data += (a->mem[i] & (AN_CODE | AN_DATA)) == AN_DATA;
+    }
+    fprintf(stdout, "; %s: %zu bytes, %d code, %d data, %zu unreached\n",
+            rom->path, rom->size, code, data, rom->size - code - data);
+    fprintf(stdout, "; indirect jumps:");
+    for (int i = 0; i < a->n_indirect && i < ANALYSIS_MAX_INDIRECT; i++) {
+        fprintf(stdout, " 0x%03X", a->indirect[i]);
+    }
+    fprintf(stdout, "%s\n", a->n_indirect == 0 ? " none" :
+            a->n_indirect > ANALYSIS_MAX_INDIRECT ? " ..." : "");
+    fprintf(stdout, "; stores: %s, %s\n",
+            a->store_unknown ? "some unresolved" : "all resolved",
+            a->self_modifying ? "self-modifying" :
+            a->store_unknown ? "may be self-modifying" : "no self-modifying code");
+}
+
+static void prt_listing(const struct rom_image *rom) {
+    const struct rom_analysis *a = &rom->analysis;
+    const uint8_t *mem = rom->init.cpu.memory;
+    int end = RESERVED_MEM + rom->size;
+
+    for (int addr = RESERVED_MEM; addr < end;) {
+        uint8_t f = a->mem[addr];
+        if (f & AN_INSTR) {
+            uint16_t opc = mem[addr] << 8 | mem[addr + 1];
+            char text[32];
+            rom_disasm(opc, text, sizeof text);
+            fprintf(stdout, "0x%03X  %04X  %c%c%c  %s\n", addr, opc,
+                    f & AN_ENTRY ? 'E' : ' ',
+                    (f | a->mem[addr + 1]) & AN_WRITTEN ? 'W' : ' ',
+                    f & AN_INDIRECT ? '*' : ' ', text);
+            addr += 2;
+            continue;
+        }
+
+        /* a run of data or unreached bytes, up to the next instruction */
+        bool data = f & AN_DATA;
+        fprintf(stdout, "0x%03X  ", addr);
+        int n = 0;
+        bool written = false;
+        do {
+            fprintf(stdout, "%s%02X", n ? " " : "", mem[addr]);
+            written |= a->mem[addr] & AN_WRITTEN;
+            addr++;
+            n++;
+        } while (n < DATA_PER_LINE && addr < end && !(a->mem[addr] & AN_INSTR) &&
+                 (bool) (a->mem[addr] & AN_DATA) == data);
+        fprintf(stdout, "%*s  ; %s%s\n", 3 * (DATA_PER_LINE - n), "",
+                data ? "data" : "unreached", written ? ", stored to" : "");
+    }
+}
+
+int main(int argc, char **argv) {
+    bool summary_only = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hs")) != -1) {
+        switch (opt) {
+        case 'h':
+            prt_usage();
+            exit(EXIT_SUCCESS);
+            break;
+        case 's':
+            summary_only = true;
+            break;
+        default:
+            prt_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        prt_usage();
+        fprintf(stderr, "\nError: Expected file name argument\n");
+        exit(EXIT_FAILURE);
+    }
+    struct rom_image rom;
+    if (!rom_image_load(&rom, argv[optind])) {
+        exit(EXIT_FAILURE);
+    }
+    prt_summary(&rom);
+    if (!summary_only) {
+        prt_listing(&rom);
+    }
+    rom_image_unload(&rom);
+    return 0;
+}
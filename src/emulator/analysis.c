@@ -0,0 +1,288 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Static analysis and disassembly of programs. The analysis runs once
+ * per rom image, the result tells which bytes are code, where basic
+ * blocks start and which memory the program may store to.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "analysis.h"
+
+/* A path to follow: its address and the value of I there, -1: unknown */
+struct path {
+    uint16_t pc;
+    int32_t I;
+};
+
+#define I_NONE (-2)                     /* Address not reached yet */
+
+/*
+ * Paths not followed yet, in the order they were found. Paths that reach
+ * an address with different values of I meet as unknown, so every address
+ * is queued and walked at most twice: with its first I, then with -1.
+ */
+struct walk {
+    struct rom_analysis *a;
+    const uint8_t *memory;
+    struct path queue[2 * MEM_SIZE];
+    int head;
+    int tail;
+    int32_t entry_I[MEM_SIZE];          /* I queued at each address */
+    int32_t walked_I[MEM_SIZE];         /* I each instruction was walked with */
+};
+
+/* The value of I where paths with I values old and I meet */
+static int32_t meet(int32_t old, int32_t I) {
+    return old == I_NONE || old == I ? I : -1;
+}
+
+/*
+ * Write the mnemonic of an opcode to buf (if size isn't 0). False if the
+ * opcode is no instruction, as emulator_cycle would fault on it.
+ */
+bool rom_disasm(uint16_t opcode, char *buf, size_t size) {
+    unsigned x = opcode >> 8 & 0xF;
+    unsigned y = opcode >> 4 & 0xF;
+    unsigned n = opcode & 0xF;
+    unsigned kk = opcode & 0xFF;
+    unsigned nnn = opcode & 0xFFF;
+    const char *alu[16] = {
+        [0x0] = "LD", [0x1] = "OR", [0x2] = "AND", [0x3] = "XOR", [0x4] = "ADD",
+        [0x5] = "SUB", [0x6] = "SHR", [0x7] = "SUBN", [0xE] = "SHL"
+    };
+    char tmp[32];
+
+    switch (opcode >> 12) {
+    case 0x0:
+        if ((opcode & 0xFFF0) == 0x00C0) {
+            snprintf(tmp, sizeof tmp, "SCD %u", n);
+            break;
+        }
+        switch (opcode) {
+        case 0x00E0: snprintf(tmp, sizeof tmp, "CLS"); break;
+        case 0x00EE: snprintf(tmp, sizeof tmp, "RET"); break;
+        case 0x00FB: snprintf(tmp, sizeof tmp, "SCR"); break;
+        case 0x00FC: snprintf(tmp, sizeof tmp, "SCL"); break;
+        case 0x00FD: snprintf(tmp, sizeof tmp, "EXIT"); break;
+        case 0x00FE: snprintf(tmp, sizeof tmp, "LOW"); break;
+        case 0x00FF: snprintf(tmp, sizeof tmp, "HIGH"); break;
+        default: return false;
+        }
+        break;
+    case 0x1: snprintf(tmp, sizeof tmp, "JP 0x%03X", nnn); break;
+    case 0x2: snprintf(tmp, sizeof tmp, "CALL 0x%03X", nnn); break;
+    case 0x3: snprintf(tmp, sizeof tmp, "SE V%X, 0x%02X", x, kk); break;
+    case 0x4: snprintf(tmp, sizeof tmp, "SNE V%X, 0x%02X", x, kk); break;
+    case 0x5: snprintf(tmp, sizeof tmp, "SE V%X, V%X", x, y); break;
+    case 0x6: snprintf(tmp, sizeof tmp, "LD V%X, 0x%02X", x, kk); break;
+    case 0x7: snprintf(tmp, sizeof tmp, "ADD V%X, 0x%02X", x, kk); break;
+    case 0x8:
+        if (!alu[n]) {
+            return false;
+        }
+        snprintf(tmp, sizeof tmp, "%s V%X, V%X", alu[n], x, y);
+        break;
+    case 0x9: snprintf(tmp, sizeof tmp, "SNE V%X, V%X", x, y); break;
+    case 0xA: snprintf(tmp, sizeof tmp, "LD I, 0x%03X", nnn); break;
+    case 0xB: snprintf(tmp, sizeof tmp, "JP V0, 0x%03X", nnn); break;
+    case 0xC: snprintf(tmp, sizeof tmp, "RND V%X, 0x%02X", x, kk); break;
+    case 0xD: snprintf(tmp, sizeof tmp, "DRW V%X, V%X, %u", x, y, n); break;
+    case 0xE:
+        switch (kk) {
+        case 0x9E: snprintf(tmp, sizeof tmp, "SKP V%X", x); break;
+        case 0xA1: snprintf(tmp, sizeof tmp, "SKNP V%X", x); break;
+        default: return false;
+        }
+        break;
+    case 0xF:
+        switch (kk) {
+        case 0x07: snprintf(tmp, sizeof tmp, "LD V%X, DT", x); break;
+        case 0x0A: snprintf(tmp, sizeof tmp, "LD V%X, K", x); break;
+        case 0x15: snprintf(tmp, sizeof tmp, "LD DT, V%X", x); break;
+        case 0x18: snprintf(tmp, sizeof tmp, "LD ST, V%X", x); break;
+        case 0x1E: snprintf(tmp, sizeof tmp, "ADD I, V%X", x); break;
+        case 0x29: snprintf(tmp, sizeof tmp, "LD F, V%X", x); break;
+        case 0x30: snprintf(tmp, sizeof tmp, "LD HF, V%X", x); break;
+        case 0x33: snprintf(tmp, sizeof tmp, "LD B, V%X", x); break;
+        case 0x55: snprintf(tmp, sizeof tmp, "LD [I], V%X", x); break;
+        case 0x65: snprintf(tmp, sizeof tmp, "LD V%X, [I]", x); break;
+        case 0x75: snprintf(tmp, sizeof tmp, "LD R, V%X", x); break;
+        case 0x85: snprintf(tmp, sizeof tmp, "LD V%X, R", x); break;
+        default: return false;
+        }
+        break;
+    }
+    if (size) {
+        snprintf(buf, size, "%s", tmp);
+    }
+    return true;
+}
+
+/* Flag len bytes from addr, wrapped like the emulator's I accesses */
+static void mark(struct rom_analysis *a, uint32_t addr, int len, uint8_t flag) {
+    for (int i = 0; i < len; i++) {
+        a->mem[(addr + i) & (MEM_SIZE - 1)] |= flag;
+    }
+}
+
+/* Control reaches pc as the start of a basic block */
+static void enter(struct walk *w, uint32_t pc, int32_t I) {
+    if (pc + 1 >= MEM_SIZE) {
+        return;
+    }
+    w->a->mem[pc] |= AN_ENTRY;
+    I = meet(w->entry_I[pc], I);
+    if (I != w->entry_I[pc]) {
+        w->entry_I[pc] = I;
+        w->queue[w->tail++] = (struct path) { pc, I };
+    }
+}
+
+static void store(struct walk *w, int32_t I, int len) {
+    if (I < 0) {
+        w->a->store_unknown = true;
+    } else {
+        mark(w->a, I, len, AN_WRITTEN);
+    }
+}
+
+static bool is_jump(const struct walk *w, uint32_t addr) {
+    return addr + 1 < MEM_SIZE && w->memory[addr] >> 4 == 0x1;
+}
+
+/*
+ * Bnnn at pc. V0 (or Vx) is unknown; the base is a target, and so is
+ * every jump of a table of jumps there.
+ */
+static void indirect(struct walk *w, uint16_t pc, uint16_t nnn) {
+    struct rom_analysis *a = w->a;
+    a->mem[pc] |= AN_INDIRECT;
+    if (a->n_indirect < ANALYSIS_MAX_INDIRECT) {
+        a->indirect[a->n_indirect] = pc;
+    }
+    a->n_indirect++;
+
+    enter(w, nnn, -1);
+    for (uint32_t t = nnn; t < nnn + 0x100u && is_jump(w, t) && is_jump(w, t + 2);
+         t += 2) {
+        enter(w, t + 2, -1);
+    }
+}
+
+/*
+ * Follow straight-line code from pc until it ends or joins code that was
+ * walked with the same I (or with I unknown)
+ */
+static void follow(struct walk *w, uint16_t pc, int32_t I) {
+    struct rom_analysis *a = w->a;
+    for (;;) {
+        if (pc + 1 >= MEM_SIZE) {
+            return;
+        }
+        I = meet(w->walked_I[pc], I);
+        if (I == w->walked_I[pc]) {
+            return;
+        }
+        w->walked_I[pc] = I;
+        uint16_t opc = w->memory[pc] << 8 | w->memory[pc + 1];
+        if (!rom_disasm(opc, NULL, 0)) {
+            /* ran into data, the program would fault here */
+            return;
+        }
+        a->mem[pc] |= AN_INSTR | AN_CODE;
+        a->mem[pc + 1] |= AN_CODE;
+
+        uint16_t nnn = opc & 0xFFF;
+        uint8_t x = opc >> 8 & 0xF;
+        uint16_t next = pc + 2;
+        switch (opc >> 12) {
+        case 0x0:
+            if (opc == 0x00EE || opc == 0x00FD) {
+                return;
+            }
+            break;
+        case 0x1:
+            enter(w, nnn, I);
+            return;
+        case 0x2:
+            /* the subroutine may change I */
+            enter(w, nnn, I);
+            enter(w, next, -1);
+            return;
+        case 0x3: case 0x4: case 0x5: case 0x9: case 0xE:
+            enter(w, pc + 4, I);
+            enter(w, next, I);
+            return;
+        case 0xA:
+            I = nnn;
+            mark(a, nnn, 1, AN_DATA);
+            break;
+        case 0xB:
+            indirect(w, pc, nnn);
+            return;
+        case 0xD:
+            if (I >= 0) {
+                /* n = 0: a 16x16 sprite if run as SCHIP */
+                mark(a, I, (opc & 0xF) ? (opc & 0xF) : 32, AN_DATA);
+            }
+            break;
+        case 0xF:
+            switch (opc & 0xFF) {
+            case 0x0A: case 0x18:
+                enter(w, next, I);
+                return;
+            case 0x33:
+                store(w, I, 3);
+                enter(w, next, I);
+                return;
+            case 0x55:
+                /* I advances by a quirks dependent amount */
+                store(w, I, x + 1);
+                enter(w, next, -1);
+                return;
+            case 0x65:
+                if (I >= 0) {
+                    mark(a, I, x + 1, AN_DATA);
+                }
+                I = -1;
+                break;
+            case 0x1E: case 0x29: case 0x30:
+                I = -1;
+                break;
+            }
+            break;
+        }
+        pc = next;
+    }
+}
+
+/* Analyze the program in memory, as loaded (see emulator_template) */
+void rom_analyze(struct rom_analysis *a, const uint8_t *memory) {
+    static __thread struct walk w;      /* 96 KiB, too large for the stack */
+    memset(a, 0, sizeof *a);
+    w.a = a;
+    w.memory = memory;
+    w.head = w.tail = 0;
+    for (int i = 0; i < MEM_SIZE; i++) {
+        w.entry_I[i] = I_NONE;
+        w.walked_I[i] = I_NONE;
+    }
+
+    enter(&w, 0x200, -1);
+    while (w.head < w.tail) {
+        struct path p = w.queue[w.head++];
+        follow(&w, p.pc, p.I);
+    }
+
+    for (int i = 0; i < MEM_SIZE; i++) {
+        a->self_modifying |= (a->mem[i] & (AN_CODE | AN_WRITTEN)) ==
+                             (AN_CODE | AN_WRITTEN);
+    }
+}
@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __ANALYSIS_H
+#define __ANALYSIS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/* Indirect jumps recorded by an analysis */
+#define ANALYSIS_MAX_INDIRECT 32
+
+/* What the analysis found about a byte of memory */
+enum analysis_flags {
+    AN_INSTR = 1 << 0,                  /* A reachable instruction starts here */
+    AN_CODE = 1 << 1,                   /* Part of a reachable instruction */
+    AN_ENTRY = 1 << 2,                  /* Basic block entry: jump or call
+                                           target, or after a block end */
+    AN_DATA = 1 << 3,                   /* Read through I, or I is set to it */
+    AN_WRITTEN = 1 << 4,                /* Written through I (LD B, LD [I]) */
+    AN_INDIRECT = 1 << 5                /* Jump to a register offset (Bnnn) */
+};
+
+/*
+ * Static analysis of a program. Instructions are followed from 0x200
+ * along jumps, calls, returns and both ways of every skip. I is tracked
+ * along straight-line code from LD I, nnn, so the sprites and stores it
+ * addresses can be marked. Code only reached through Bnnn is found if the
+ * jump lands on a table of jumps, as it usually does.
+ */
+struct rom_analysis {
+    uint8_t mem[MEM_SIZE];              /* enum analysis_flags by address */
+    uint16_t indirect[ANALYSIS_MAX_INDIRECT]; /* Addresses of Bnnn jumps */
+    int n_indirect;                     /* Bnnn jumps, may exceed the array */
+    bool store_unknown;                 /* A store through I the analysis
+                                           could not resolve, memory
+                                           anywhere may be written */
+    bool self_modifying;                /* Resolved stores hit code */
+};
+
+/* Analysis functions */
+void rom_analyze(struct rom_analysis *a, const uint8_t *memory);
+bool rom_disasm(uint16_t opcode, char *buf, size_t size);
+
+#endif
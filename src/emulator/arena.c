@@ -0,0 +1,50 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+/* Reserve size bytes of address space, false (with a message) on failure */
+bool arena_init(struct arena *a, size_t size) {
+    memset(a, 0, sizeof *a);
+    void *m = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "Unable to map %zu bytes for the arena\n", size);
+        return false;
+    }
+    a->base = m;
+    a->size = size;
+    return true;
+}
+
+void arena_free(struct arena *a) {
+    if (a->base) {
+        munmap(a->base, a->size);
+    }
+    memset(a, 0, sizeof *a);
+}
+
+/* Zeroed, cache line aligned memory, NULL when the arena is full */
+void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1);
+    if (size > a->size - a->used) {
+        return NULL;
+    }
+    void *p = a->base + a->used;
+    a->used += size;
+    return p;
+}
+
+/* Array of n emulators for emulator_init, NULL when the arena is full */
+struct emulator *arena_alloc_emulators(struct arena *a, int n) {
+    return arena_alloc(a, (size_t) n * sizeof(struct emulator));
+}
@@ -0,0 +1,35 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/*
+ * Bump allocator over one anonymous mapping. Allocations start on cache
+ * lines and are padded to whole lines, so objects handed to different
+ * threads never share one. Pages are backed on first touch, by the thread
+ * that initializes the object. Not thread safe; everything is freed at
+ * once.
+ */
+struct arena {
+    uint8_t *base;                      /* Mapping, page aligned */
+    size_t size;                        /* Size of the mapping */
+    size_t used;                        /* Bytes handed out */
+};
+
+/* Arena functions */
+bool arena_init(struct arena *a, size_t size);
+void arena_free(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+struct emulator *arena_alloc_emulators(struct arena *a, int n);
+
+#endif
@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "beeper.h"
+
+/* Beeper for output at rate Hz, NULL on failure */
+struct beeper *beeper_create(int rate) {
+    struct beeper *b = calloc(1, sizeof *b);
+    if (!b) {
+        return NULL;
+    }
+    if (!spsc_ring_init(&b->ring, sizeof(struct beep_frame), BEEP_RING_FRAMES)) {
+        free(b);
+        return NULL;
+    }
+    b->rate = rate;
+    b->frame_len = rate / 60;
+    b->pos = b->frame_len;
+    b->filling = true;
+    b->phase_inc = (uint32_t) (((uint64_t) BEEP_HZ << 32) / rate);
+    return b;
+}
+
+/* The audio thread must not render anymore */
+void beeper_destroy(struct beeper *b) {
+    if (b->overruns || b->skipped) {
+        fprintf(stderr, "Sound: %llu frames dropped, %llu skipped\n",
+                (unsigned long long) b->overruns, (unsigned long long) b->skipped);
+    }
+    spsc_ring_free(&b->ring);
+    free(b);
+}
+
+/* Start recording the sound of the frame the emulator runs next */
+void beeper_begin(struct beeper *b, const struct emulator *eml) {
+    b->open = true;
+    b->count0 = eml->instr_count;
+    b->cycles0 = eml->cycles;
+    b->frame.on = eml->cpu.ST > 0;
+    b->frame.n_edges = 0;
+}
+
+/*
+ * The program set ST. Called by the emulator after the instruction, which
+ * ends its basic block so instr_count is exact in both engines.
+ */
+void beeper_st(struct beeper *b, const struct emulator *eml) {
+    struct beep_frame *f = &b->frame;
+    bool on = eml->cpu.ST > 0;
+    if (!b->open || f->n_edges == BEEP_MAX_EDGES) {
+        return;
+    }
+    if (on == (f->n_edges ? f->edges[f->n_edges - 1].on : f->on)) {
+        return;
+    }
+    b->edge_count[f->n_edges] = eml->instr_count;
+    f->edges[f->n_edges++].on = on;
+}
+
+/*
+ * Queue the recorded frame. An edge is placed at the share of the frame's
+ * cycles that ran before it; the cycles a wait for a key or a stop left
+ * unused count as the end of the frame.
+ */
+void beeper_end(struct beeper *b, const struct emulator *eml) {
+    struct beep_frame *f = &b->frame;
+    uint64_t cycles = eml->cycles - b->cycles0;
+    uint64_t last = b->frame_len - 1;
+    for (int i = 0; i < f->n_edges; i++) {
+        uint64_t done = b->edge_count[i] - b->count0;
+        uint64_t pos = cycles ? done * b->frame_len / cycles : 0;
+        f->edges[i].pos = pos < last ? pos : last;
+    }
+    b->open = false;
+    if (!spsc_ring_push(&b->ring, f)) {
+        b->overruns++;
+    }
+}
+
+/* Take the next frame to play, none while the queue fills up */
+static void next_frame(struct beeper *b) {
+    size_t queued = spsc_ring_count(&b->ring);
+    if (b->filling && queued < BEEP_PREFILL) {
+        b->on = false;
+        return;
+    }
+    b->filling = false;
+
+    /* the emulator got ahead of the audio clock, keep the latency low */
+    for (; queued > BEEP_MAX_QUEUE; queued--) {
+        spsc_ring_pop(&b->ring, &b->cur);
+        b->skipped++;
+    }
+    if (!spsc_ring_pop(&b->ring, &b->cur)) {
+        b->filling = true;
+        b->on = false;
+        return;
+    }
+    b->pos = 0;
+    b->edge = 0;
+    b->on = b->cur.on;
+}
+
+/* Audio thread: n samples of the queued frames */
+void beeper_render(struct beeper *b, int16_t *out, int n) {
+    for (int i = 0; i < n; i++) {
+        if (b->pos == b->frame_len) {
+            next_frame(b);
+        }
+        if (b->pos < b->frame_len) {
+            while (b->edge < b->cur.n_edges && b->cur.edges[b->edge].pos <= b->pos) {
+                b->on = b->cur.edges[b->edge++].on;
+            }
+            b->pos++;
+        }
+
+        int32_t target = b->on ? BEEP_VOLUME : 0;
+        if (b->amp < target) {
+            b->amp = b->amp + BEEP_RAMP < target ? b->amp + BEEP_RAMP : target;
+        } else if (b->amp > target) {
+            b->amp = b->amp - BEEP_RAMP > target ? b->amp - BEEP_RAMP : target;
+        }
+        b->phase += b->phase_inc;
+        out[i] = b->phase < 0x80000000u ? b->amp : -b->amp;
+    }
+}
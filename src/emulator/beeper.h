@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __BEEPER_H
+#define __BEEPER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+#include "ring.h"
+
+#define BEEP_HZ 440                     /* Pitch of the tone */
+#define BEEP_VOLUME 6000                /* Amplitude of the square wave */
+#define BEEP_RAMP 100                   /* Amplitude change per sample, so
+                                           edges don't click */
+#define BEEP_MAX_EDGES 16               /* Sound changes kept per frame */
+#define BEEP_RING_FRAMES 16             /* Frames the ring holds */
+#define BEEP_PREFILL 2                  /* Frames queued before playing */
+#define BEEP_MAX_QUEUE 6                /* More queued frames are skipped */
+
+/* The sound turns on or off at sample pos of a frame */
+struct beep_edge {
+    uint16_t pos;
+    bool on;
+};
+
+/* Sound of one 60 Hz frame, handed from the emulator to the audio thread */
+struct beep_frame {
+    bool on;                            /* Sound at the start of the frame */
+    uint8_t n_edges;
+    struct beep_edge edges[BEEP_MAX_EDGES]; /* In order of pos */
+};
+
+/*
+ * Beeper for the sound timer: a tone plays while ST is not 0. The
+ * emulator thread records each frame it runs between beeper_begin and
+ * beeper_end, with an edge at every instruction that switches the sound
+ * (placed by its share of the frame's cycles), and queues it. Ends of the
+ * sound by the timer fall on frame ends. The audio thread plays the
+ * frames back at its own rate from beeper_render, keeping BEEP_PREFILL to
+ * BEEP_MAX_QUEUE of them queued. Neither side waits for the other: a
+ * full ring drops frames, an empty one is silence, so frames that aren't
+ * recorded (turbo mode, pauses) are muted.
+ */
+struct beeper {
+    struct spsc_ring ring;              /* Frames not played yet */
+    int rate;                           /* Sample rate */
+    int frame_len;                      /* Samples per frame */
+
+    /* owned by the emulator thread */
+    bool open;                          /* Recording a frame */
+    uint64_t count0;                    /* instr_count at its start */
+    uint64_t cycles0;                   /* cycles at its start */
+    struct beep_frame frame;            /* Being recorded */
+    uint64_t edge_count[BEEP_MAX_EDGES]; /* instr_count of its edges */
+    uint64_t overruns;                  /* Frames dropped, the ring was full */
+
+    /* owned by the audio thread */
+    struct beep_frame cur;              /* Playing */
+    int pos;                            /* Next sample of cur, frame_len: none */
+    int edge;                           /* Next edge of cur */
+    bool on;                            /* The tone plays */
+    bool filling;                       /* Waiting for BEEP_PREFILL frames */
+    uint32_t phase;                     /* Of the square wave, 2^32: one period */
+    uint32_t phase_inc;
+    int32_t amp;                        /* Current amplitude */
+    uint64_t skipped;                   /* Frames skipped to catch up */
+};
+
+/* Beeper functions */
+struct beeper *beeper_create(int rate);
+void beeper_destroy(struct beeper *b);
+void beeper_begin(struct beeper *b, const struct emulator *eml);
+void beeper_end(struct beeper *b, const struct emulator *eml);
+void beeper_render(struct beeper *b, int16_t *out, int n);
+
+/* Used by the emulator */
+void beeper_st(struct beeper *b, const struct emulator *eml);
+
+#endif
@@ -5,11 +5,16 @@
  */
 
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
-#include <SDL2/SDL.h>
 
 #include "chip8.h"
+#include "trace.h"
+#include "rom.h"
+#include "debug.h"
+#include "beeper.h"
+#ifdef CHIP8_PROFILE
+#include "profile.h"
+#endif
 
 /* Chip8 font. Digits 0-F, 5 bytes each. */
 static const uint8_t chip8_fontset[80] = {
@@ -23,6 +28,26 @@ static const uint8_t chip8_fontset[80] = {
     0xF0, 0x80, 0xF0, 0x80, 0xF0, 0xF0, 0x80, 0xF0, 0x80, 0x80
 };
 
+/* SCHIP big font. Digits 0-F, 8x10 pixels, 10 bytes each. */
+static const uint8_t chip8_big_fontset[160] = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, /* 0 */
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, /* 1 */
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, /* 2 */
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, /* 3 */
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, /* 4 */
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, /* 5 */
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, /* 6 */
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, /* 7 */
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, /* 8 */
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, /* 9 */
+    0x18, 0x3C, 0x66, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, /* A */
+    0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, /* B */
+    0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, /* C */
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, /* D */
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF, /* E */
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0  /* F */
+};
+
 /* Test if a key is pressed */
 static bool keypad_is_pressed(struct emulator *eml, enum chip8_key key) {
     return eml->keypad & (1 << key);
@@ -40,16 +65,258 @@ static uint8_t op_kk(uint16_t opcode) { return opcode & 0xFF; }
 /* Extract the nnn 12-bit number from an opcode */
 static uint16_t op_nnn(uint16_t opcode) { return opcode & 0xFFF; }
 
+/*
+ * All instructions as X(name, ends_block). A basic block ends at every
+ * instruction that may change the PC, stop the emulator, write memory or
+ * switch the sound (the beeper needs its exact instr_count).
+ * The last rows are the variants of the quirks profiles, see predecode,
+ * and the debugger's patch (instr_DBG).
+ */
+#define INSTR_LIST(X) \
+    X(UNK, true)            X(CLS, false)           X(RET, true) \
+    X(JP_nnn, true)         X(CALL_nnn, true)       X(SE_Vx_kk, true) \
+    X(SNE_Vx_kk, true)      X(SE_Vx_Vy, true)       X(LD_Vx_kk, false) \
+    X(ADD_Vx_kk, false)     X(LD_Vx_Vy, false)      X(OR_Vx_Vy, false) \
+    X(AND_Vx_Vy, false)     X(XOR_Vx_Vy, false)     X(ADD_Vx_Vy, false) \
+    X(SUB_Vx_Vy, false)     X(SHR_Vx_Vy, false)     X(SUBN_Vx_Vy, false) \
+    X(SHL_Vx_Vy, false)     X(SNE_Vx_Vy, true)      X(LD_I_nnn, false) \
+    X(JP_V0_nnn, true)      X(RND_Vx_kk, false)     X(DRW_Vx_Vy_n, false) \
+    X(SKP_Vx, true)         X(SKNP_Vx, true)        X(LD_Vx_DT, false) \
+    X(LD_Vx_K, true)        X(LD_DT_Vx, false)      X(LD_ST_Vx, true) \
+    X(ADD_I_Vx, false)      X(LD_F_Vx, false)       X(LD_B_Vx, true) \
+    X(LD_I_Vx_multi, true)  X(LD_Vx_I_multi, false) \
+    X(OR_Vx_Vy_vf0, false)  X(AND_Vx_Vy_vf0, false) X(XOR_Vx_Vy_vf0, false) \
+    X(SHR_Vx_Vy_vy, false)  X(SHL_Vx_Vy_vy, false)  X(JP_Vx_xnn, true) \
+    X(ADD_I_Vx_noflag, false) X(DRW_Vx_Vy_n_clip, false) \
+    X(LD_I_Vx_multi_x, true) X(LD_Vx_I_multi_x, false) \
+    X(LD_I_Vx_multi_x1, true) X(LD_Vx_I_multi_x1, false) \
+    X(SCD_n, false)         X(SCR, false)           X(SCL, false) \
+    X(EXIT, true)           X(LOW, false)           X(HIGH, false) \
+    X(DRW_Vx_Vy_16, false)  X(DRW_Vx_Vy_16_clip, false) \
+    X(LD_HF_Vx, false)      X(LD_R_Vx, false)       X(LD_Vx_R, false) \
+    X(DBG, true)
+
+#define INSTR_OP(name, ends_block) OP_##name,
+enum instr_op { INSTR_LIST(INSTR_OP) OP_COUNT };
+#undef INSTR_OP
+
+#define INSTR_ENDS_BLOCK(name, ends_block) ends_block,
+static const bool op_ends_block[OP_COUNT] = { INSTR_LIST(INSTR_ENDS_BLOCK) };
+#undef INSTR_ENDS_BLOCK
+
+#define INSTR_NAME(name, ends_block) #name,
+static const char *op_names[OP_COUNT] = { INSTR_LIST(INSTR_NAME) };
+#undef INSTR_NAME
+
+/* Memory address, wrapped to the 4K address space */
+static uint16_t mem_addr(uint32_t addr) { return addr & (MEM_SIZE - 1); }
+
+static void predecode(struct chip8_instr *in, uint16_t opcode,
+                      enum eml_quirks quirks);
+static void debug_patch(struct emulator *eml, struct chip8_instr *in,
+                        uint16_t addr);
+
+/* Quirks profiles, indexed by enum eml_quirks */
+static const struct chip8_quirks quirk_table[QUIRKS_COUNT] = {
+    /*      shift_vy logic_vf mem_i add_i_vf jump_vx draw_clip sprite16 */
+    [QUIRKS_DEFAULT] = { "default", false, false, 0, true,  false, false, false },
+    [QUIRKS_VIP]     = { "vip",     true,  true,  2, false, false, true,  false },
+    [QUIRKS_CHIP48]  = { "chip48",  false, false, 1, false, true,  true,  false },
+    [QUIRKS_SCHIP]   = { "schip",   false, false, 0, false, true,  true,  true },
+};
+
+/* Fetch the opcode at an address */
+static uint16_t fetch(struct emulator *eml, uint16_t addr) {
+    return eml->cpu.memory[addr] << 8 | eml->cpu.memory[mem_addr(addr + 1)];
+}
+
+/*
+ * Forget the length of every basic block that runs through a slot. Those
+ * blocks start after the closest preceding block end.
+ */
+static void block_invalidate(struct emulator *eml, uint16_t slot) {
+    eml->blk_len[slot] = 0;
+    for (int s = slot - 1; s >= 0 && !op_ends_block[eml->decoded[s].op]; s--) {
+        eml->blk_len[s] = 0;
+    }
+}
+
+/*
+ * Memory in [addr, addr+len) was written. Re-decode the instruction slots
+ * that overlap it, so self-modifying code sees its own writes, and mark
+ * the memory blocks as changed for snapshots.
+ */
+static void mem_written(struct emulator *eml, uint16_t addr, uint16_t len) {
+    for (uint32_t s = addr >> 1; s <= (uint32_t) (addr + len - 1) >> 1; s++) {
+        uint16_t slot = s % INSTR_SLOTS;
+        eml->mem_dirty |= 1ULL << ((slot << 1) / MEM_BLOCK);
+        block_invalidate(eml, slot);
+        predecode(&eml->decoded[slot], fetch(eml, slot << 1), eml->quirks);
+        if (eml->debug) {
+            debug_patch(eml, &eml->decoded[slot], slot << 1);
+        }
+        block_invalidate(eml, slot);
+    }
+}
+
+/*
+ * Display hash: the sum of the display words, each multiplied by an odd
+ * key of its index. Changing a word by d changes the sum by d times its
+ * key, so drawing updates it in O(1) per row, and it depends only on the
+ * contents: pixels drawn and erased again leave it as it was. The keys
+ * are splitmix64-style mixes of the word index.
+ */
+static const uint64_t disp_key[DISP_WORDS] = {
+    0xca009717327d1f6fULL, 0x6c3247d381df2495ULL, 0xeab1569b7ed4837dULL,
+    0x97bcd71420a32ee3ULL, 0xff05892438052b83ULL, 0x7be2226c1a8decb1ULL,
+    0x6328ff6bc4f4a401ULL, 0xeed1f5955e2b437fULL, 0x558da6f3b127fa67ULL,
+    0xbd6359b58cef3cbdULL, 0xf77ab350374ff905ULL, 0xcff55e7d5200bf1bULL,
+    0xd1ec960dcdc6357bULL, 0x85aa4644a6ce2db9ULL, 0x24665c33d79cab89ULL,
+    0xb5d504cfd93b6cb7ULL, 0xcc8d735dc407b0ffULL, 0x519ac31c7f34da85ULL,
+    0xfd37a4d1f7fb734dULL, 0x3a1efad836c35f33ULL, 0x84e11a9b3dbc3773ULL,
+    0xc72680458b84d7c1ULL, 0xe84252b459d38731ULL, 0x5f430467c0e663efULL,
+    0xba02ac70a151ba37ULL, 0x63317388b87150adULL, 0x4954169c047d9815ULL,
+    0xb1d401be6a81412bULL, 0xba33cfdbc775682bULL, 0x0824ffd4cc1e3cc9ULL,
+    0x7f69cc4f4eb68579ULL, 0x12297ed4cf5bbf27ULL, 0x229e24232cfc5e8fULL,
+    0x714c0060a4f447b5ULL, 0xd82beff7348e0b5dULL, 0x628dcda61b4e9ac3ULL,
+    0xd14c1e3c418cd563ULL, 0xa0eebed90cdbcc51ULL, 0x7ecfe821bada4c21ULL,
+    0x33963d1d8a6ba41fULL, 0x45dced152c3319c7ULL, 0xb041aa6b985d549dULL,
+    0xf175d4852c9177a5ULL, 0x667e1a3033ee953bULL, 0xc88f480f8eee299bULL,
+    0xd084a568b3a70e61ULL, 0x0e21e8b80c377e21ULL, 0xd75edb0781ccc7dfULL,
+    0xea8e1e0e05eef9d7ULL, 0x740558e142a3746dULL, 0x6056e085e5cfd5e5ULL,
+    0xc662e71170e2a15bULL, 0x2533d938fdd4e98bULL, 0xab80ff7008fb3029ULL,
+    0x10047ef5cd85dd89ULL, 0x63a8037cd5028257ULL, 0x7e2ccea66c17f4cfULL,
+    0x8d4071ef8eead055ULL, 0x206a0119d004e8edULL, 0xf7712d71983c7993ULL,
+    0xacc6d7c182c3ef03ULL, 0xfed3989e9d6d0af1ULL, 0x1a27d5c43e613b11ULL,
+    0x0b7a2b719eb77e4fULL, 0x99dd8774bcf126e7ULL, 0x453c484659f8bd1dULL,
+    0x3692d0f4399642f5ULL, 0xe29800c149e88f6bULL, 0xc11fd31d6a7dd0fbULL,
+    0x977f0db6691c16b9ULL, 0xb4db5ab980e67df9ULL, 0xc51b9b4c369d3587ULL,
+    0x1420cc1d7647cc5fULL, 0x89bf6a408319aac5ULL, 0x3099c715ed7c0e7dULL,
+    0x41dd7db219b798a3ULL, 0x8480a4de85def2f3ULL, 0xfd9fd04375b49841ULL,
+    0x286e5b094d70a301ULL, 0x80054c7314d7483fULL, 0xaccd84ed311ad3f7ULL,
+    0x8bb9da2a5866338dULL, 0x630c89bc72d35745ULL, 0x47aa829f30baa93bULL,
+    0x6aeaf695c54fd56bULL, 0xfbc47b425922ef49ULL, 0x8a62a7867d80a9a9ULL,
+    0xccfc346067dd2a77ULL, 0xe29bd259938a43afULL, 0xa9f762571ddc5335ULL,
+    0x9a2c25bf48c41bc7ULL, 0x6061923e84330279ULL, 0x41bf6606eb316cf9ULL,
+    0xdb9c18dd3553e1fbULL, 0xb6bba7e3e588e72bULL, 0x553d2b44207e7575ULL,
+    0x371ea411e7d2a4ddULL, 0x9474838928c2d967ULL, 0x15c38b610f19ce8fULL,
+    0xc03bcb67a22bce91ULL, 0x1ae90b0078dc6fb1ULL, 0x672d3640e8849183ULL,
+    0x2189789113f4c9d3ULL, 0x4c1e158ffeaa286dULL, 0x05e6474e8292d595ULL,
+    0xf0e727a7188eb8cfULL, 0xa3e46a48b09256d7ULL, 0x165a464d2edb4609ULL,
+    0xfe36c4e46f5117e9ULL, 0xf83a1790b7f0a0cbULL, 0x2219b588b843e49bULL,
+    0x9f81209ec6e9ea65ULL, 0x3307a0d0e4b834edULL, 0xbbb1e4b9f514cf57ULL,
+    0x4fcac0a4ebd971dfULL, 0xc10059143aba8661ULL, 0x6adf6e203e04b6a1ULL,
+    0x002c49a0bceeb793ULL, 0x9cdb7794802a0b03ULL, 0xae3aa2504d5dd8ddULL,
+    0x28cacab9df785365ULL, 0x31bec928226cc3bfULL, 0x883387e1978484e7ULL,
+    0xbcff78aa57befb99ULL, 0xa03f1b583e61ee19ULL, 0xdacf20bd99a75bdbULL,
+    0xb20f2c675c2b290bULL, 0xbd73cc185a53e255ULL,
+};
+
+static uint64_t disp_sum(const struct chip8 *cpu) {
+    uint64_t h = 0;
+    int words = cpu->hires ? DISP_WORDS : DISP_H;
+    for (int i = 0; i < words; i++) {
+        h += cpu->display[i] * disp_key[i];
+    }
+    return h;
+}
+
 /* 00E0 - CLS: Clear the display. */
-static enum eml_stat instr_CLS(uint16_t opcode, struct emulator *eml) {
-    (void) opcode;
-    memset(&eml->cpu.display, 0, DISP_SIZE);
+static enum eml_stat instr_CLS(const struct chip8_instr *in, struct emulator *eml) {
+    (void) in;
+    memset(&eml->cpu.display, 0, sizeof eml->cpu.display);
+    eml->dirty_rows = ~0ULL;
+    eml->disp_hash = 0;
+    return EML_REDRAW;
+}
+
+/*
+ * SCHIP display instructions. Scrolling moves whole packed rows, or
+ * shifts the words of each row, by pixels of the current mode.
+ */
+
+/* 00Cn - SCD n: Scroll the display down by n rows. */
+static enum eml_stat instr_SCD_n(const struct chip8_instr *in, struct emulator *eml) {
+    uint64_t *d = eml->cpu.display;
+    size_t row = eml->cpu.hires ? 2 : 1;
+    size_t rows = eml->cpu.hires ? DISP_HI_H : DISP_H;
+    size_t n = in->kk & 0xF;
+    memmove(d + n * row, d, (rows - n) * row * sizeof *d);
+    memset(d, 0, n * row * sizeof *d);
+    eml->dirty_rows = ~0ULL;
+    eml->disp_hash = disp_sum(&eml->cpu);
     return EML_REDRAW;
 }
 
+/* 00FB - SCR: Scroll the display right by 4 pixels. */
+static enum eml_stat instr_SCR(const struct chip8_instr *in, struct emulator *eml) {
+    (void) in;
+    uint64_t *d = eml->cpu.display;
+    if (eml->cpu.hires) {
+        for (int r = 0; r < DISP_HI_H; r++) {
+            d[2*r + 1] = d[2*r + 1] >> 4 | d[2*r] << 60;
+            d[2*r] >>= 4;
+        }
+    } else {
+        for (int r = 0; r < DISP_H; r++) {
+            d[r] >>= 4;
+        }
+    }
+    eml->dirty_rows = ~0ULL;
+    eml->disp_hash = disp_sum(&eml->cpu);
+    return EML_REDRAW;
+}
+
+/* 00FC - SCL: Scroll the display left by 4 pixels. */
+static enum eml_stat instr_SCL(const struct chip8_instr *in, struct emulator *eml) {
+    (void) in;
+    uint64_t *d = eml->cpu.display;
+    if (eml->cpu.hires) {
+        for (int r = 0; r < DISP_HI_H; r++) {
+            d[2*r] = d[2*r] << 4 | d[2*r + 1] >> 60;
+            d[2*r + 1] <<= 4;
+        }
+    } else {
+        for (int r = 0; r < DISP_H; r++) {
+            d[r] <<= 4;
+        }
+    }
+    eml->dirty_rows = ~0ULL;
+    eml->disp_hash = disp_sum(&eml->cpu);
+    return EML_REDRAW;
+}
+
+/* 00FD - EXIT: Stop the program. The PC stays on the instruction. */
+static enum eml_stat instr_EXIT(const struct chip8_instr *in, struct emulator *eml) {
+    (void) in;
+    eml->cpu.PC -= 2;
+    return EML_EXIT;
+}
+
+/* Switch the display mode, the display is cleared */
+static enum eml_stat set_hires(struct emulator *eml, bool hires) {
+    eml->cpu.hires = hires;
+    memset(&eml->cpu.display, 0, sizeof eml->cpu.display);
+    eml->dirty_rows = ~0ULL;
+    eml->disp_hash = 0;
+    return EML_REDRAW;
+}
+
+/* 00FE - LOW: Switch to the 64x32 display mode. */
+static enum eml_stat instr_LOW(const struct chip8_instr *in, struct emulator *eml) {
+    (void) in;
+    return set_hires(eml, false);
+}
+
+/* 00FF - HIGH: Switch to the 128x64 display mode. */
+static enum eml_stat instr_HIGH(const struct chip8_instr *in, struct emulator *eml) {
+    (void) in;
+    return set_hires(eml, true);
+}
+
 /* 00EE - RET: Return from a subroutine. */
-static enum eml_stat instr_RET(uint16_t opcode, struct emulator *eml) {
-    (void) opcode;
+static enum eml_stat instr_RET(const struct chip8_instr *in, struct emulator *eml) {
+    (void) in;
     if (eml->cpu.SP == 0) {
         return EML_STACK_UNDERFL;
     }
@@ -58,175 +325,319 @@ static enum eml_stat instr_RET(uint16_t opcode, struct emulator *eml) {
 }
 
 /* 00EE - RET: Return from a subroutine. */
-static enum eml_stat instr_JP_nnn(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.PC = op_nnn(opcode);
+static enum eml_stat instr_JP_nnn(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.PC = in->nnn;
     return EML_OK;
 }
 
 /* 2nnn - CALL addr: Call subroutine at nnn. */
-static enum eml_stat instr_CALL_nnn(uint16_t opcode, struct emulator *eml) {
+static enum eml_stat instr_CALL_nnn(const struct chip8_instr *in, struct emulator *eml) {
     if (eml->cpu.SP == STACK_SIZE) {
         return EML_STACK_OVERFL;
     }
     eml->cpu.stack[eml->cpu.SP++] = eml->cpu.PC;
-    eml->cpu.PC = op_nnn(opcode);
+    eml->cpu.PC = in->nnn;
     return EML_OK;
 }
 
 /* 3xkk - SE Vx, byte: Skip next instruction if Vx = kk. */
-static enum eml_stat instr_SE_Vx_kk(uint16_t opcode, struct emulator *eml) {
-    if (eml->cpu.V[op_x(opcode)] == op_kk(opcode)) {
+static enum eml_stat instr_SE_Vx_kk(const struct chip8_instr *in, struct emulator *eml) {
+    if (eml->cpu.V[in->x] == in->kk) {
         eml->cpu.PC += 2;
     }
     return EML_OK;
 }
 
 /* 4xkk - SNE Vx, byte: Skip next instruction if Vx != kk. */
-static enum eml_stat instr_SNE_Vx_kk(uint16_t opcode, struct emulator *eml) {
-    if (eml->cpu.V[op_x(opcode)] != op_kk(opcode)) {
+static enum eml_stat instr_SNE_Vx_kk(const struct chip8_instr *in, struct emulator *eml) {
+    if (eml->cpu.V[in->x] != in->kk) {
         eml->cpu.PC += 2;
     }
     return EML_OK;
 }
 
 /* 5xy0 - SE Vx, Vy: Skip next instruction if Vx = Vy. */
-static enum eml_stat instr_SE_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    if (eml->cpu.V[op_x(opcode)] == eml->cpu.V[op_y(opcode)]) {
+static enum eml_stat instr_SE_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    if (eml->cpu.V[in->x] == eml->cpu.V[in->y]) {
         eml->cpu.PC += 2;
     }
     return EML_OK;
 }
 
 /* 6xkk - LD Vx, byte: Set Vx = kk. */
-static enum eml_stat instr_LD_Vx_kk(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[op_x(opcode)] = op_kk(opcode);
+static enum eml_stat instr_LD_Vx_kk(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[in->x] = in->kk;
     return EML_OK;
 }
 
 /* 7xkk - ADD Vx, byte: Set Vx = Vx + kk. */
-static enum eml_stat instr_ADD_Vx_kk(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[op_x(opcode)] += op_kk(opcode);
+static enum eml_stat instr_ADD_Vx_kk(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[in->x] += in->kk;
     return EML_OK;
 }
 
 /* 8xy0 - LD Vx, Vy: Set Vx = Vy. */
-static enum eml_stat instr_LD_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[op_x(opcode)] = eml->cpu.V[op_y(opcode)];
+static enum eml_stat instr_LD_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[in->x] = eml->cpu.V[in->y];
     return EML_OK;
 }
 
 /* 8xy1 - OR Vx, Vy: Set Vx = Vx OR Vy. */
-static enum eml_stat instr_OR_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[op_x(opcode)] |= eml->cpu.V[op_y(opcode)];
+static enum eml_stat instr_OR_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[in->x] |= eml->cpu.V[in->y];
     return EML_OK;
 }
 
 /* 8xy2 - AND Vx, Vy: Set Vx = Vx AND Vy. */
-static enum eml_stat instr_AND_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[op_x(opcode)] &= eml->cpu.V[op_y(opcode)];
+static enum eml_stat instr_AND_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[in->x] &= eml->cpu.V[in->y];
     return EML_OK;
 }
 
 /* 8xy3 - XOR Vx, Vy: Set Vx = Vx XOR Vy. */
-static enum eml_stat instr_XOR_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[op_x(opcode)] ^= eml->cpu.V[op_y(opcode)];
+static enum eml_stat instr_XOR_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[in->x] ^= eml->cpu.V[in->y];
     return EML_OK;
 }
 
 /* 8xy4 - ADD Vx, Vy: Set Vx = Vx + Vy, set eml->cpu.V[0xF] = carry. */
-static enum eml_stat instr_ADD_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    uint16_t s = (uint16_t) eml->cpu.V[op_x(opcode)] + (uint16_t) eml->cpu.V[op_y(opcode)];
+static enum eml_stat instr_ADD_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    uint16_t s = (uint16_t) eml->cpu.V[in->x] + (uint16_t) eml->cpu.V[in->y];
     eml->cpu.V[0xF] = (s > 0xFF) ? 1 : 0;
-    eml->cpu.V[op_x(opcode)] = s & 0xFF;
+    eml->cpu.V[in->x] = s & 0xFF;
     return EML_OK;
 }
 
 /* 8xy5 - SUB Vx, Vy: Set Vx = Vx - Vy, set eml->cpu.V[0xF] = NOT borrow. */
-static enum eml_stat instr_SUB_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[0xF] = (eml->cpu.V[op_x(opcode)] > eml->cpu.V[op_y(opcode)]) ? 1 : 0;
-    eml->cpu.V[op_x(opcode)] -= eml->cpu.V[op_y(opcode)];
+static enum eml_stat instr_SUB_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[0xF] = (eml->cpu.V[in->x] > eml->cpu.V[in->y]) ? 1 : 0;
+    eml->cpu.V[in->x] -= eml->cpu.V[in->y];
     return EML_OK;
 }
 
 /* 8xy6 - SHR Vx {, Vy}: Set Vx = Vx SHR 1. */
-static enum eml_stat instr_SHR_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[0xF] = eml->cpu.V[op_x(opcode)] & 0x01;
-    eml->cpu.V[op_x(opcode)] = eml->cpu.V[op_x(opcode)] >> 1;
+static enum eml_stat instr_SHR_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[0xF] = eml->cpu.V[in->x] & 0x01;
+    eml->cpu.V[in->x] = eml->cpu.V[in->x] >> 1;
     return EML_OK;
 }
 
 /* 8xy7 - SUBN Vx, Vy: Set Vx = Vy - Vx, set eml->cpu.V[0xF] = NOT borrow. */
-static enum eml_stat instr_SUBN_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[0xF] = (eml->cpu.V[op_x(opcode)] < eml->cpu.V[op_y(opcode)]) ? 1 : 0;
-    eml->cpu.V[op_x(opcode)] = eml->cpu.V[op_y(opcode)] - eml->cpu.V[op_x(opcode)];
+static enum eml_stat instr_SUBN_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[0xF] = (eml->cpu.V[in->x] < eml->cpu.V[in->y]) ? 1 : 0;
+    eml->cpu.V[in->x] = eml->cpu.V[in->y] - eml->cpu.V[in->x];
     return EML_OK;
 }
 
 /* 8xyE - SHL Vx {, Vy}: Set Vx = Vx SHL 1. */
-static enum eml_stat instr_SHL_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[0xF] = (eml->cpu.V[op_x(opcode)] & 0x80) >> 7;
-    eml->cpu.V[op_x(opcode)] = eml->cpu.V[op_x(opcode)] << 1;
+static enum eml_stat instr_SHL_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[0xF] = (eml->cpu.V[in->x] & 0x80) >> 7;
+    eml->cpu.V[in->x] = eml->cpu.V[in->x] << 1;
+    return EML_OK;
+}
+
+/*
+ * Quirk variants of 8xy1-8xy3 (VIP): the logic instructions also clear
+ * VF, a side effect of how the VIP interpreter computed them.
+ */
+#define INSTR_LOGIC_VF0(name, op) \
+    static enum eml_stat instr_##name##_vf0(const struct chip8_instr *in, \
+                                            struct emulator *eml) { \
+        eml->cpu.V[in->x] op eml->cpu.V[in->y]; \
+        eml->cpu.V[0xF] = 0; \
+        return EML_OK; \
+    }
+INSTR_LOGIC_VF0(OR_Vx_Vy, |=)
+INSTR_LOGIC_VF0(AND_Vx_Vy, &=)
+INSTR_LOGIC_VF0(XOR_Vx_Vy, ^=)
+#undef INSTR_LOGIC_VF0
+
+/* 8xy6 - SHR Vx, Vy (VIP): Set Vx = Vy SHR 1. */
+static enum eml_stat instr_SHR_Vx_Vy_vy(const struct chip8_instr *in, struct emulator *eml) {
+    uint8_t vy = eml->cpu.V[in->y];
+    eml->cpu.V[0xF] = vy & 0x01;
+    eml->cpu.V[in->x] = vy >> 1;
+    return EML_OK;
+}
+
+/* 8xyE - SHL Vx, Vy (VIP): Set Vx = Vy SHL 1. */
+static enum eml_stat instr_SHL_Vx_Vy_vy(const struct chip8_instr *in, struct emulator *eml) {
+    uint8_t vy = eml->cpu.V[in->y];
+    eml->cpu.V[0xF] = (vy & 0x80) >> 7;
+    eml->cpu.V[in->x] = vy << 1;
     return EML_OK;
 }
 
 /* 9xy0 - SNE Vx, Vy: Skip next instruction if Vx != Vy. */
-static enum eml_stat instr_SNE_Vx_Vy(uint16_t opcode, struct emulator *eml) {
-    if (eml->cpu.V[op_x(opcode)] != eml->cpu.V[op_y(opcode)]) {
+static enum eml_stat instr_SNE_Vx_Vy(const struct chip8_instr *in, struct emulator *eml) {
+    if (eml->cpu.V[in->x] != eml->cpu.V[in->y]) {
         eml->cpu.PC += 2;
     }
     return EML_OK;
 }
 
 /* Annn - LD I, addr: Set I = nnn. */
-static enum eml_stat instr_LD_I_nnn(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.I = op_nnn(opcode);
+static enum eml_stat instr_LD_I_nnn(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.I = in->nnn;
     return EML_OK;
 }
 
 /* Bnnn - JP V0, addr: Jump to location nnn + V0. */
-static enum eml_stat instr_JP_V0_nnn(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.PC = op_nnn(opcode) + eml->cpu.V[0];
+static enum eml_stat instr_JP_V0_nnn(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.PC = in->nnn + eml->cpu.V[0];
+    return EML_OK;
+}
+
+/* Bxnn - JP Vx, addr (CHIP-48, SCHIP): Jump to location xnn + Vx. */
+static enum eml_stat instr_JP_Vx_xnn(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.PC = in->nnn + eml->cpu.V[in->x];
     return EML_OK;
 }
 
+/* Next byte of the emulator's xorshift32 generator */
+static uint8_t rng_next(struct emulator *eml) {
+    uint32_t r = eml->rng;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    eml->rng = r;
+    return r >> 24;
+}
+
 /* Cxkk - RND Vx, byte: Set Vx = random byte AND kk. */
-static enum eml_stat instr_RND_Vx_kk(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[op_x(opcode)] = rand() & op_kk(opcode);
+static enum eml_stat instr_RND_Vx_kk(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[in->x] = rng_next(eml) & in->kk;
     return EML_OK;
 }
 
+/* Rotate a display row right, pixels leaving at the right wrap around */
+static uint64_t row_rotr(uint64_t row, uint8_t n) {
+    return (row >> n) | (row << (-n & (DISP_W - 1)));
+}
+
 /*
  * Dxyn - DRW Vx, Vy, nibble:
  * Display n-byte sprite starting at memory location I at (Vx, Vy),
  * set eml->cpu.V[0xF] = collision.
+ *
+ * Every sprite row is XORed onto a display row in one go. The sprite byte
+ * is moved to the top of a row word and rotated into position. Rows the
+ * sprite touches are marked in dirty_rows for the renderer.
+ *
+ * The start position always wraps around the display. With clip, the
+ * parts of the sprite past the right and bottom edges are cut off instead
+ * of wrapping. Both handlers inline this with clip constant, so neither
+ * tests it at run time. The 64x32 mode with 8-pixel sprites is handled
+ * here, everything else by draw_wide.
  */
-static enum eml_stat instr_DRW_Vx_Vy_n(uint16_t opcode, struct emulator *eml) {
-    uint8_t n = opcode & 0xF;
-    uint8_t x = eml->cpu.V[op_x(opcode)];
-    uint8_t y = eml->cpu.V[op_y(opcode)];
-    uint8_t collide = 0;
+
+/*
+ * Sprite drawing of the SCHIP cases: 16x16 sprites (Dxy0) and anything in
+ * the 128x64 mode, where a row spans two words. The sprite row is placed
+ * at the top of a 128-bit row and rotated (or shifted when clipping) into
+ * position across both words.
+ */
+static enum eml_stat draw_wide(const struct chip8_instr *in, struct emulator *eml,
+                               bool clip) {
+    struct chip8 *cpu = &eml->cpu;
+    int words = cpu->hires ? 2 : 1;
+    int w = words * 64;
+    int h = cpu->hires ? DISP_HI_H : DISP_H;
+    int n = in->kk & 0xF;
+    int bytes = n ? 1 : 2;
+    n = n ? n : 16;
+    int x = cpu->V[in->x] % w;
+    int y = cpu->V[in->y] % h;
+    if (clip && n > h - y) {
+        n = h - y;
+    }
+    uint64_t collide = 0;
     for (int i = 0; i < n; i++) {
-        uint8_t sprite_mask = eml->cpu.memory[eml->cpu.I + i];
-        for (int j = 0; j < 8; j++) {
-            uint32_t pixel_idx = (i + y) % DISP_H * DISP_W + (x + j) % DISP_W;
-            uint8_t sprite_xor = (sprite_mask >> (7 - j)) & 0x1;
-            if (eml->cpu.display[pixel_idx] && sprite_xor) {
-                collide = 1;
-            }
-            eml->cpu.display[pixel_idx] ^= sprite_xor;
+        uint16_t addr = cpu->I + i * bytes;
+        uint64_t bits = bytes == 2
+            ? (uint64_t) (cpu->memory[mem_addr(addr)] << 8 | cpu->memory[mem_addr(addr + 1)]) << 48
+            : (uint64_t) cpu->memory[mem_addr(addr)] << 56;
+        uint64_t part[2];
+        if (words == 1) {
+            part[0] = clip ? bits >> x : row_rotr(bits, x);
+            part[1] = 0;
+        } else if (x < 64) {
+            part[0] = bits >> x;
+            part[1] = x ? bits << (64 - x) : 0;
+        } else {
+            part[1] = bits >> (x - 64);
+            part[0] = clip || x == 64 ? 0 : bits << (128 - x);
+        }
+        int r = (i + y) % h;
+        uint64_t *row = &cpu->display[r * words];
+        for (int k = 0; k < words; k++) {
+            uint64_t old = row[k];
+            collide |= old & part[k];
+            row[k] ^= part[k];
+            eml->disp_hash += (row[k] - old) * disp_key[r * words + k];
         }
+        eml->dirty_rows |= (uint64_t) ((part[0] | part[1]) != 0) << r;
     }
 
-    eml->cpu.V[0xF] = collide;
+    cpu->V[0xF] = collide ? 1 : 0;
+    eml->drw_count++;
     return EML_REDRAW;
 }
 
+static inline __attribute__((always_inline))
+enum eml_stat draw(const struct chip8_instr *in, struct emulator *eml, bool clip) {
+    if (eml->cpu.hires) {
+        return draw_wide(in, eml, clip);
+    }
+    uint8_t n = in->kk & 0xF;
+    uint8_t x = eml->cpu.V[in->x] % DISP_W;
+    uint8_t y = eml->cpu.V[in->y] % DISP_H;
+    if (clip && n > DISP_H - y) {
+        n = DISP_H - y;
+    }
+    uint64_t collide = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t sprite_row = (uint64_t) eml->cpu.memory[mem_addr(eml->cpu.I + i)]
+                              << (DISP_W - 8);
+        uint8_t r = (i + y) % DISP_H;
+        uint64_t *row = &eml->cpu.display[r];
+        sprite_row = clip ? sprite_row >> x : row_rotr(sprite_row, x);
+        uint64_t old = *row;
+        collide |= old & sprite_row;
+        *row ^= sprite_row;
+        eml->disp_hash += (*row - old) * disp_key[r];
+        eml->dirty_rows |= (uint64_t) (sprite_row != 0) << r;
+    }
+
+    eml->cpu.V[0xF] = collide ? 1 : 0;
+    eml->drw_count++;
+    return EML_REDRAW;
+}
+
+static enum eml_stat instr_DRW_Vx_Vy_n(const struct chip8_instr *in, struct emulator *eml) {
+    return draw(in, eml, false);
+}
+
+/* Dxyn, clipped (VIP, CHIP-48, SCHIP) */
+static enum eml_stat instr_DRW_Vx_Vy_n_clip(const struct chip8_instr *in, struct emulator *eml) {
+    return draw(in, eml, true);
+}
+
+/* Dxy0 - DRW Vx, Vy, 0 (SCHIP): Display a 16x16 sprite, 2 bytes per row. */
+static enum eml_stat instr_DRW_Vx_Vy_16(const struct chip8_instr *in, struct emulator *eml) {
+    return draw_wide(in, eml, false);
+}
+
+static enum eml_stat instr_DRW_Vx_Vy_16_clip(const struct chip8_instr *in, struct emulator *eml) {
+    return draw_wide(in, eml, true);
+}
+
 /*
  * Ex9E - SKP Vx:
  * Skip next instruction if key with the value of Vx is pressed.
  */
-static enum eml_stat instr_SKP_Vx(uint16_t opcode, struct emulator *eml) {
-    if (keypad_is_pressed(eml, eml->cpu.V[op_x(opcode)])) {
+static enum eml_stat instr_SKP_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    if (keypad_is_pressed(eml, eml->cpu.V[in->x])) {
         eml->cpu.PC += 2;
     }
     return EML_OK;
@@ -236,53 +647,84 @@ static enum eml_stat instr_SKP_Vx(uint16_t opcode, struct emulator *eml) {
  * ExA1 - SKNP Vx:
  * Skip next instruction if key with the value of Vx is not pressed.
  */
-static enum eml_stat instr_SKNP_Vx(uint16_t opcode, struct emulator *eml) {
-    if (!keypad_is_pressed(eml, eml->cpu.V[op_x(opcode)])) {
+static enum eml_stat instr_SKNP_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    if (!keypad_is_pressed(eml, eml->cpu.V[in->x])) {
         eml->cpu.PC += 2;
     }
     return EML_OK;
 }
 
 /* Fx07 - LD Vx, DT: Set Vx = delay timer value. */
-static enum eml_stat instr_LD_Vx_DT(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.V[op_x(opcode)] = eml->cpu.DT;
+static enum eml_stat instr_LD_Vx_DT(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.V[in->x] = eml->cpu.DT;
     return EML_OK;
 }
 
 /* Fx0A - LD Vx, K: Wait for a key press, store the value of the key in Vx. */
-static enum eml_stat instr_LD_Vx_K(uint16_t opcode, struct emulator *eml) {
+static enum eml_stat instr_LD_Vx_K(const struct chip8_instr *in, struct emulator *eml) {
     if (eml->last_key == C8K_NONE) { /* start waiting-for-key process */
         eml->key_waiting = true;
         return EML_OK;
     } else { /* stop waiting */
-        eml->cpu.V[op_x(opcode)] = eml->last_key;
+        eml->cpu.V[in->x] = eml->last_key;
         eml->last_key = C8K_NONE;
         return EML_OK;
     }
 }
 
 /* Fx15 - LD DT, Vx: Set delay timer = Vx. */
-static enum eml_stat instr_LD_DT_Vx(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.DT = eml->cpu.V[op_x(opcode)];
+static enum eml_stat instr_LD_DT_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.DT = eml->cpu.V[in->x];
     return EML_OK;
 }
 
 /* Fx18 - LD ST, Vx: Set sound timer = Vx. */
-static enum eml_stat instr_LD_ST_Vx(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.ST = eml->cpu.V[op_x(opcode)];
+static enum eml_stat instr_LD_ST_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.ST = eml->cpu.V[in->x];
+    if (eml->beeper) {
+        beeper_st(eml->beeper, eml);
+    }
     return EML_OK;
 }
 
 /* Fx1E - ADD I, Vx: Set I = I + Vx. */
-static enum eml_stat instr_ADD_I_Vx(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.I += eml->cpu.V[op_x(opcode)];
+static enum eml_stat instr_ADD_I_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.I += eml->cpu.V[in->x];
     eml->cpu.V[0xF] = (eml->cpu.I > 0xFFF) ? 1 : 0; /* undocumented feature */
     return EML_OK;
 }
 
+/* Fx1E - ADD I, Vx (VIP, CHIP-48, SCHIP): Set I = I + Vx, VF is kept. */
+static enum eml_stat instr_ADD_I_Vx_noflag(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.I += eml->cpu.V[in->x];
+    return EML_OK;
+}
+
 /* Fx29 - LD F, Vx: Set I = location of sprite for digit Vx. */
-static enum eml_stat instr_LD_F_Vx(uint16_t opcode, struct emulator *eml) {
-    eml->cpu.I = eml->cpu.V[op_x(opcode)] * 5;
+static enum eml_stat instr_LD_F_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.I = eml->cpu.V[in->x] * 5;
+    return EML_OK;
+}
+
+/* Fx30 - LD HF, Vx (SCHIP): Set I = location of the big sprite for digit Vx. */
+static enum eml_stat instr_LD_HF_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    eml->cpu.I = BIG_FONT_ADDR + (eml->cpu.V[in->x] & 0xF) * 10;
+    return EML_OK;
+}
+
+/* Fx75 - LD R, Vx (SCHIP): Store V0 through Vx in the RPL flags, x < 8. */
+static enum eml_stat instr_LD_R_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    for (int i = 0; i <= (in->x & 7); i++) {
+        eml->cpu.rpl[i] = eml->cpu.V[i];
+    }
+    return EML_OK;
+}
+
+/* Fx85 - LD Vx, R (SCHIP): Read V0 through Vx from the RPL flags, x < 8. */
+static enum eml_stat instr_LD_Vx_R(const struct chip8_instr *in, struct emulator *eml) {
+    for (int i = 0; i <= (in->x & 7); i++) {
+        eml->cpu.V[i] = eml->cpu.rpl[i];
+    }
     return EML_OK;
 }
 
@@ -290,42 +732,439 @@ static enum eml_stat instr_LD_F_Vx(uint16_t opcode, struct emulator *eml) {
  * Fx33 - LD B, Vx:
  * Store BCD representation of Vx in memory locations I, I+1, and I+2.
  */
-static enum eml_stat instr_LD_B_Vx(uint16_t opcode, struct emulator *eml) {
-    uint8_t vx = eml->cpu.V[op_x(opcode)];
-    eml->cpu.memory[eml->cpu.I] = vx / 100;
-    eml->cpu.memory[eml->cpu.I+1] = (vx / 10) % 10;
-    eml->cpu.memory[eml->cpu.I+2] = vx % 10;
+static enum eml_stat instr_LD_B_Vx(const struct chip8_instr *in, struct emulator *eml) {
+    uint8_t vx = eml->cpu.V[in->x];
+    eml->cpu.memory[mem_addr(eml->cpu.I)] = vx / 100;
+    eml->cpu.memory[mem_addr(eml->cpu.I+1)] = (vx / 10) % 10;
+    eml->cpu.memory[mem_addr(eml->cpu.I+2)] = vx % 10;
+    mem_written(eml, mem_addr(eml->cpu.I), 3);
     return EML_OK;
 }
 
 /*
  * Fx55 - LD [I], Vx:
  * Store registers V0 through Vx in memory starting at location I.
+ *
+ * Fx65 - LD Vx, [I]:
+ * Read registers V0 through Vx from memory starting at location I.
+ *
+ * Instantiated once per way of advancing I afterwards: not at all, by x
+ * (CHIP-48) and by x+1 (VIP).
  */
-static enum eml_stat instr_LD_I_Vx_multi(uint16_t opcode, struct emulator *eml) {
-    for (int i = 0; i <= op_x(opcode); i++) {
-        eml->cpu.memory[eml->cpu.I+i] = eml->cpu.V[i];
+#define INSTR_LD_MULTI(suffix, inc) \
+    static enum eml_stat instr_LD_I_Vx_multi##suffix(const struct chip8_instr *in, \
+                                                     struct emulator *eml) { \
+        for (int i = 0; i <= in->x; i++) { \
+            eml->cpu.memory[mem_addr(eml->cpu.I+i)] = eml->cpu.V[i]; \
+        } \
+        mem_written(eml, mem_addr(eml->cpu.I), in->x + 1); \
+        eml->cpu.I += (inc); \
+        return EML_OK; \
+    } \
+    static enum eml_stat instr_LD_Vx_I_multi##suffix(const struct chip8_instr *in, \
+                                                     struct emulator *eml) { \
+        for (int i = 0; i <= in->x; i++) { \
+            eml->cpu.V[i] = eml->cpu.memory[mem_addr(eml->cpu.I+i)]; \
+        } \
+        eml->cpu.I += (inc); \
+        return EML_OK; \
     }
-    return EML_OK;
+INSTR_LD_MULTI(, 0)
+INSTR_LD_MULTI(_x, in->x)
+INSTR_LD_MULTI(_x1, in->x + 1)
+#undef INSTR_LD_MULTI
+
+/*
+ * Unknown opcode. Decoding never fails, the fault is raised when the
+ * instruction is actually executed.
+ */
+static enum eml_stat instr_UNK(const struct chip8_instr *in, struct emulator *eml) {
+    (void) in;
+    (void) eml;
+    return EML_UNK_OPC;
 }
 
 /*
- * Fx65 - LD Vx, [I]:
- * Read registers V0 through Vx from memory starting at location I.
+ * An instruction the debugger watches. It stops before the instruction,
+ * undoing the PC advance and the count, or runs it as decoded.
  */
-static enum eml_stat instr_LD_Vx_I_multi(uint16_t opcode, struct emulator *eml) {
-    for (int i = 0; i <= op_x(opcode); i++) {
-        eml->cpu.V[i] = eml->cpu.memory[eml->cpu.I+i];
+static enum eml_stat instr_DBG(const struct chip8_instr *in, struct emulator *eml) {
+    uint16_t pc = eml->cpu.PC - 2;
+    if (debug_stop(eml->debug, eml, pc, in->opcode)) {
+        eml->cpu.PC = pc;
+        eml->instr_count--;
+        return EML_BRK_REACHED;
     }
-    return EML_OK;
+    struct chip8_instr orig;
+    predecode(&orig, in->opcode, eml->quirks);
+    return orig.fn(&orig, eml);
+}
+
+/* Patch a decoded instruction at addr into DBG if the debugger wants it */
+static void debug_patch(struct emulator *eml, struct chip8_instr *in,
+                        uint16_t addr) {
+    if (debug_wants(eml->debug, addr, in->opcode)) {
+        in->op = OP_DBG;
+        in->fn = instr_DBG;
+    }
+}
+
+#define DECODE(name) \
+    do { in->op = OP_##name; in->fn = instr_##name; return; } while (0)
+
+/*
+ * Decode an opcode into an instruction slot. Where the quirks profile
+ * changes an instruction, the slot gets that profile's variant, so the
+ * engines never look at the quirks.
+ */
+static void predecode(struct chip8_instr *in, uint16_t opcode,
+                      enum eml_quirks quirks) {
+    const struct chip8_quirks *q = &quirk_table[quirks];
+    in->opcode = opcode;
+    in->x = op_x(opcode);
+    in->y = op_y(opcode);
+    in->kk = op_kk(opcode);
+    in->nnn = op_nnn(opcode);
+    in->op = OP_UNK;
+    in->fn = instr_UNK;
+
+    switch ((opcode & 0xF000) >> 12) {
+    case 0x0:
+        switch (opcode & 0xFF) {
+        case 0xE0: DECODE(CLS);
+        case 0xEE: DECODE(RET);
+        case 0xFB: DECODE(SCR);
+        case 0xFC: DECODE(SCL);
+        case 0xFD: DECODE(EXIT);
+        case 0xFE: DECODE(LOW);
+        case 0xFF: DECODE(HIGH);
+        }
+        if ((opcode & 0xFFF0) == 0x00C0) {
+            DECODE(SCD_n);
+        }
+        break;
+    case 0x1: DECODE(JP_nnn);
+    case 0x2: DECODE(CALL_nnn);
+    case 0x3: DECODE(SE_Vx_kk);
+    case 0x4: DECODE(SNE_Vx_kk);
+    case 0x5: DECODE(SE_Vx_Vy);
+    case 0x6: DECODE(LD_Vx_kk);
+    case 0x7: DECODE(ADD_Vx_kk);
+    case 0x8:
+        switch (opcode & 0xF) {
+        case 0x0: DECODE(LD_Vx_Vy);
+        case 0x1: if (q->logic_vf_reset) DECODE(OR_Vx_Vy_vf0); DECODE(OR_Vx_Vy);
+        case 0x2: if (q->logic_vf_reset) DECODE(AND_Vx_Vy_vf0); DECODE(AND_Vx_Vy);
+        case 0x3: if (q->logic_vf_reset) DECODE(XOR_Vx_Vy_vf0); DECODE(XOR_Vx_Vy);
+        case 0x4: DECODE(ADD_Vx_Vy);
+        case 0x5: DECODE(SUB_Vx_Vy);
+        case 0x6: if (q->shift_vy) DECODE(SHR_Vx_Vy_vy); DECODE(SHR_Vx_Vy);
+        case 0x7: DECODE(SUBN_Vx_Vy);
+        case 0xE: if (q->shift_vy) DECODE(SHL_Vx_Vy_vy); DECODE(SHL_Vx_Vy);
+        }
+        break;
+    case 0x9: DECODE(SNE_Vx_Vy);
+    case 0xA: DECODE(LD_I_nnn);
+    case 0xB: if (q->jump_vx) DECODE(JP_Vx_xnn); DECODE(JP_V0_nnn);
+    case 0xC: DECODE(RND_Vx_kk);
+    case 0xD:
+        /* Dxy0 is an empty sprite before SCHIP */
+        if ((opcode & 0xF) == 0 && q->sprite16) {
+            if (q->draw_clip) DECODE(DRW_Vx_Vy_16_clip);
+            DECODE(DRW_Vx_Vy_16);
+        }
+        if (q->draw_clip) DECODE(DRW_Vx_Vy_n_clip);
+        DECODE(DRW_Vx_Vy_n);
+    case 0xE:
+        switch (opcode & 0xFF) {
+        case 0x9E: DECODE(SKP_Vx);
+        case 0xA1: DECODE(SKNP_Vx);
+        }
+        break;
+    case 0xF:
+        switch (opcode & 0xFF) {
+        case 0x07: DECODE(LD_Vx_DT);
+        case 0x0A: DECODE(LD_Vx_K);
+        case 0x15: DECODE(LD_DT_Vx);
+        case 0x18: DECODE(LD_ST_Vx);
+        case 0x1E: if (!q->add_i_vf) DECODE(ADD_I_Vx_noflag); DECODE(ADD_I_Vx);
+        case 0x29: DECODE(LD_F_Vx);
+        case 0x30: DECODE(LD_HF_Vx);
+        case 0x33: DECODE(LD_B_Vx);
+        case 0x55:
+            if (q->mem_i_inc == 1) DECODE(LD_I_Vx_multi_x);
+            if (q->mem_i_inc == 2) DECODE(LD_I_Vx_multi_x1);
+            DECODE(LD_I_Vx_multi);
+        case 0x65:
+            if (q->mem_i_inc == 1) DECODE(LD_Vx_I_multi_x);
+            if (q->mem_i_inc == 2) DECODE(LD_Vx_I_multi_x1);
+            DECODE(LD_Vx_I_multi);
+        case 0x75: DECODE(LD_R_Vx);
+        case 0x85: DECODE(LD_Vx_R);
+        }
+        break;
+    }
+}
+
+#undef DECODE
+
+/*
+ * Decode all of memory, drops all basic blocks. Memory may have changed
+ * anywhere, so the snapshot base is dropped as well.
+ */
+void emulator_predecode(struct emulator *eml) {
+    eml->snap_id = 0;
+    eml->mem_dirty = 0;
+    for (int i = 0; i < INSTR_SLOTS; i++) {
+        predecode(&eml->decoded[i], fetch(eml, i << 1), eml->quirks);
+        if (eml->debug) {
+            debug_patch(eml, &eml->decoded[i], i << 1);
+        }
+    }
+    memset(eml->blk_len, 0, sizeof eml->blk_len);
+}
+
+/*
+ * Select the quirks profile. Memory is decoded again, its contents and
+ * the snapshot base stay.
+ */
+void emulator_set_quirks(struct emulator *eml, enum eml_quirks quirks) {
+    uint64_t snap_id = eml->snap_id;
+    uint64_t mem_dirty = eml->mem_dirty;
+    eml->quirks = quirks;
+    emulator_predecode(eml);
+    eml->snap_id = snap_id;
+    eml->mem_dirty = mem_dirty;
+}
+
+/*
+ * Apply a change of the debugger (set, changed or NULL) to the decoded
+ * instructions. Memory and the snapshot base stay.
+ */
+void emulator_debug_sync(struct emulator *eml) {
+    emulator_set_quirks(eml, eml->quirks);
+}
+
+/* Write memory from outside the program, as if it had stored it */
+void emulator_write_mem(struct emulator *eml, uint16_t addr,
+                        const uint8_t *data, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+        eml->cpu.memory[mem_addr(addr + i)] = data[i];
+    }
+    if (len) {
+        mem_written(eml, addr, len);
+    }
+}
+
+const struct chip8_quirks *emulator_quirks(enum eml_quirks quirks) {
+    return &quirk_table[quirks];
+}
+
+/* Profile of a name as in struct chip8_quirks, -1 if there is none */
+int emulator_quirks_parse(const char *name) {
+    for (int i = 0; i < QUIRKS_COUNT; i++) {
+        if (strcmp(name, quirk_table[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Length of the basic block starting at a slot, up to and including the
+ * instruction that ends it. Computed when the block is first entered.
+ */
+static uint8_t block_len(struct emulator *eml, uint16_t slot) {
+    if (eml->blk_len[slot] == 0) {
+        int n = 1;
+        while (!op_ends_block[eml->decoded[slot + n - 1].op] &&
+               slot + n < INSTR_SLOTS && n < UINT8_MAX) {
+            n++;
+        }
+        eml->blk_len[slot] = n;
+    }
+    return eml->blk_len[slot];
+}
+
+/*
+ * Length of the loop at PC if it can't exit before the next timer tick or
+ * key event, 0 if there is none. Recognized are a jump to itself and a
+ * delay timer wait (LD Vx, DT; SE/SNE Vx, kk; JP back) whose exit test
+ * fails for the current timer value. Every iteration of such a loop ends
+ * in the same state.
+ */
+static int idle_loop_len(const struct emulator *eml) {
+    uint16_t pc = eml->cpu.PC;
+    if ((pc & 1) || pc + 6 > MEM_SIZE) {
+        return 0;
+    }
+    const struct chip8_instr *in = &eml->decoded[pc >> 1];
+    if (in[0].op == OP_JP_nnn && in[0].nnn == pc) {
+        return 1;
+    }
+    if (in[0].op != OP_LD_Vx_DT || in[2].op != OP_JP_nnn || in[2].nnn != pc ||
+        in[1].x != in[0].x) {
+        return 0;
+    }
+    if ((in[1].op == OP_SE_Vx_kk && eml->cpu.DT != in[1].kk) ||
+        (in[1].op == OP_SNE_Vx_kk && eml->cpu.DT == in[1].kk)) {
+        return 3;
+    }
+    return 0;
+}
+
+/*
+ * Fast-forward through whole iterations of an idle loop at PC, taking
+ * them from the n cycles left. The state ends up exactly as if they had
+ * run, less than one iteration is left for the caller to execute.
+ */
+static void idle_skip(struct emulator *eml, int *n) {
+    int len = idle_loop_len(eml);
+    if (len == 0 || *n < len) {
+        return;
+    }
+    int skip = *n - *n % len;
+    const struct chip8_instr *last = &eml->decoded[(eml->cpu.PC >> 1) + len - 1];
+    if (len == 3) {
+        eml->cpu.V[last[-2].x] = eml->cpu.DT;
+    }
+    eml->opcode = last->opcode;
+    eml->prev_PC = (last - eml->decoded) << 1;
+    eml->instr_count += skip;
+    eml->idle_count += skip;
+    *n -= skip;
+}
+
+/* Run up to n instructions with emulator_cycle */
+static enum eml_stat run_interp(struct emulator *eml, int n) {
+    enum eml_stat status = EML_OK;
+    /* traces must see every instruction */
+    bool skip = !eml->trace;
+#ifdef CHIP8_PROFILE
+    skip &= !eml->profile;
+#endif
+    for (; n > 0 && !eml->key_waiting; n--) {
+        if (skip) {
+            idle_skip(eml, &n);
+            if (n == 0) {
+                break;
+            }
+        }
+        enum eml_stat s = emulator_cycle(eml);
+        if (s == EML_REDRAW) {
+            status = EML_REDRAW;
+        } else if (s != EML_OK) {
+            return s;
+        }
+    }
+    return status;
+}
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic" /* computed goto */
+
+/*
+ * Direct-threaded execution. Whole basic blocks are run from the decoded
+ * slots, every instruction jumps straight to the code of the next one. The
+ * handlers are inlined into the labels, so they only cost their own work.
+ */
+static enum eml_stat run_threaded(struct emulator *eml, int n) {
+#define INSTR_LABEL(name, ends_block) &&L_##name,
+    static const void *labels[OP_COUNT] = { INSTR_LIST(INSTR_LABEL) };
+#undef INSTR_LABEL
+
+    struct chip8 *cpu = &eml->cpu;
+    enum eml_stat redraw = EML_OK;
+    enum eml_stat status;
+    const struct chip8_instr *in;
+    const struct chip8_instr *end;
+
+    while (n > 0 && !eml->key_waiting) {
+        if (cpu->PC+1 >= MEM_SIZE) {
+            return EML_PC_OVERFL;
+        }
+        idle_skip(eml, &n);
+        if (n == 0) {
+            break;
+        }
+        uint16_t slot = cpu->PC >> 1;
+        int len = (cpu->PC & 1) ? 0 : block_len(eml, slot);
+        if (len == 0 || len > n) {
+            /* odd PC or not enough cycles left for the whole block */
+            status = emulator_cycle(eml);
+            n--;
+            goto check;
+        }
+
+        in = &eml->decoded[slot];
+        end = in + len;
+        n -= len;
+        eml->instr_count += len;
+        goto *labels[in->op];
+
+#define INSTR_BODY(name, ends_block) \
+L_##name: \
+        cpu->PC += 2; \
+        status = instr_##name(in, eml); \
+        if (status != EML_OK) { \
+            goto block_stat; \
+        } \
+        if (++in != end) { \
+            goto *labels[in->op]; \
+        } \
+        goto block_end;
+        INSTR_LIST(INSTR_BODY)
+#undef INSTR_BODY
+
+block_stat:
+        if (status != EML_REDRAW) {
+            goto block_end;
+        }
+        redraw = EML_REDRAW;
+        if (++in != end) {
+            goto *labels[in->op];
+        }
+block_end:
+        /* The last executed instruction, as emulator_cycle leaves it */
+        if (in == end) {
+            in--;
+        }
+        eml->opcode = in->opcode;
+        eml->prev_PC = (in - eml->decoded) << 1;
+        status = status == EML_REDRAW ? EML_OK : status;
+check:
+        if (status == EML_REDRAW) {
+            redraw = EML_REDRAW;
+        } else if (status != EML_OK) {
+            return status;
+        }
+    }
+    return redraw;
 }
 
+#pragma GCC diagnostic pop
+#else
+static enum eml_stat run_threaded(struct emulator *eml, int n) {
+    return run_interp(eml, n);
+}
+#endif
+
 void emulator_init(struct emulator *eml) {
     memset(eml, 0, sizeof *eml);
     memcpy(&eml->cpu.memory, chip8_fontset, sizeof chip8_fontset * sizeof(uint8_t));
+    memcpy(&eml->cpu.memory[BIG_FONT_ADDR], chip8_big_fontset, sizeof chip8_big_fontset);
     eml->last_key = C8K_NONE;
     eml->clock_speed = 1080;
+    eml->dirty_rows = ~0ULL;
     eml->cpu.PC = 0x200;
+    emulator_seed(eml, 1);
+    emulator_predecode(eml);
+}
+
+/* Seed the random generator, runs with the same seed are reproducible */
+void emulator_seed(struct emulator *eml, uint32_t seed) {
+    eml->rng = seed ? seed : 1; /* xorshift state must not be 0 */
 }
 
 void emulator_timer_dec(struct emulator *eml) {
@@ -337,6 +1176,20 @@ void emulator_timer_dec(struct emulator *eml) {
     }
 }
 
+/* Press a key, ends a wait of Fx0A */
+void emulator_key_down(struct emulator *eml, enum chip8_key key) {
+    eml->keypad |= 1 << key;
+    if (eml->key_waiting) {
+        eml->last_key = key;
+        eml->key_waiting = false;
+    }
+}
+
+/* Release a key */
+void emulator_key_up(struct emulator *eml, enum chip8_key key) {
+    eml->keypad &= ~(1 << key);
+}
+
 enum eml_stat emulator_cycle(struct emulator *eml) {
     struct chip8 *cpu = &eml->cpu;
 
@@ -347,106 +1200,308 @@ enum eml_stat emulator_cycle(struct emulator *eml) {
         return EML_PC_OVERFL;
     }
 
-    /* Fetch instruction */
-    eml->opcode = cpu->memory[cpu->PC] << 8 | cpu->memory[cpu->PC + 1];
+    /*
+     * Fetch the decoded instruction. Programs normally keep code aligned,
+     * odd addresses are decoded on the fly.
+     */
+    struct chip8_instr odd;
+    const struct chip8_instr *in = &eml->decoded[cpu->PC >> 1];
+    if (cpu->PC & 1) {
+        predecode(&odd, fetch(eml, cpu->PC), eml->quirks);
+        if (eml->debug) {
+            debug_patch(eml, &odd, cpu->PC);
+        }
+        in = &odd;
+    }
+    eml->opcode = in->opcode;
 
     /* Keep the old PC. (Instructions like JP change it) */
     eml->prev_PC = cpu->PC;
 
     /* PC points to next instruction during instruction execution */
     cpu->PC += 2;
+    eml->instr_count++;
 
-    /* Interpret next instruction */
-    enum eml_stat status = EML_UNK_OPC;
-    switch ((eml->opcode & 0xF000) >> 12) {
-    case 0x0:
-        switch (eml->opcode & 0xFF) {
-        case 0xE0: status = instr_CLS(eml->opcode, eml); goto endcase;
-        case 0xEE: status = instr_RET(eml->opcode, eml); goto endcase;
-        }
-        break;
-    case 0x1: status = instr_JP_nnn(eml->opcode, eml); goto endcase;
-    case 0x2: status = instr_CALL_nnn(eml->opcode, eml); goto endcase;
-    case 0x3: status = instr_SE_Vx_kk(eml->opcode, eml); goto endcase;
-    case 0x4: status = instr_SNE_Vx_kk(eml->opcode, eml); goto endcase;
-    case 0x5: status = instr_SE_Vx_Vy(eml->opcode, eml); goto endcase;
-    case 0x6: status = instr_LD_Vx_kk(eml->opcode, eml); goto endcase;
-    case 0x7: status = instr_ADD_Vx_kk(eml->opcode, eml); goto endcase;
-    case 0x8:
-        switch (eml->opcode & 0xF) {
-        case 0x0: status = instr_LD_Vx_Vy(eml->opcode, eml); goto endcase;
-        case 0x1: status = instr_OR_Vx_Vy(eml->opcode, eml); goto endcase;
-        case 0x2: status = instr_AND_Vx_Vy(eml->opcode, eml); goto endcase;
-        case 0x3: status = instr_XOR_Vx_Vy(eml->opcode, eml); goto endcase;
-        case 0x4: status = instr_ADD_Vx_Vy(eml->opcode, eml); goto endcase;
-        case 0x5: status = instr_SUB_Vx_Vy(eml->opcode, eml); goto endcase;
-        case 0x6: status = instr_SHR_Vx_Vy(eml->opcode, eml); goto endcase;
-        case 0x7: status = instr_SUBN_Vx_Vy(eml->opcode, eml); goto endcase;
-        case 0xE: status = instr_SHL_Vx_Vy(eml->opcode, eml); goto endcase;
-        }
-        break;
-    case 0x9: status = instr_SNE_Vx_Vy(eml->opcode, eml); goto endcase;
-    case 0xA: status = instr_LD_I_nnn(eml->opcode, eml); goto endcase;
-    case 0xB: status = instr_JP_V0_nnn(eml->opcode, eml); goto endcase;
-    case 0xC: status = instr_RND_Vx_kk(eml->opcode, eml); goto endcase;
-    case 0xD: status = instr_DRW_Vx_Vy_n(eml->opcode, eml); goto endcase;
-    case 0xE:
-        switch (eml->opcode & 0xFF) {
-        case 0x9E: status = instr_SKP_Vx(eml->opcode, eml); goto endcase;
-        case 0xA1: status = instr_SKNP_Vx(eml->opcode, eml); goto endcase;
-        }
-        break;
-    case 0xF:
-        switch (eml->opcode & 0xFF) {
-        case 0x07: status = instr_LD_Vx_DT(eml->opcode, eml); goto endcase;
-        case 0x0A: status = instr_LD_Vx_K(eml->opcode, eml); goto endcase;
-        case 0x15: status = instr_LD_DT_Vx(eml->opcode, eml); goto endcase;
-        case 0x18: status = instr_LD_ST_Vx(eml->opcode, eml); goto endcase;
-        case 0x1E: status = instr_ADD_I_Vx(eml->opcode, eml); goto endcase;
-        case 0x29: status = instr_LD_F_Vx(eml->opcode, eml); goto endcase;
-        case 0x33: status = instr_LD_B_Vx(eml->opcode, eml); goto endcase;
-        case 0x55: status = instr_LD_I_Vx_multi(eml->opcode, eml); goto endcase;
-        case 0x65: status = instr_LD_Vx_I_multi(eml->opcode, eml); goto endcase;
-        }
-        break;
+    /* Execute the predecoded instruction */
+#ifdef CHIP8_PROFILE
+    uint64_t t_start = eml->profile ? profile_ticks() : 0;
+    enum eml_stat status = in->fn(in, eml);
+    if (eml->profile) {
+        profile_instr(eml->profile, eml, in, profile_ticks() - t_start);
     }
-endcase:
+#else
+    enum eml_stat status = in->fn(in, eml);
+#endif
 
-    if (eml->dbg_output) {
-        fprintf(stdout, "PC=%04u, SP=%02u, opcode=0x%04X\n",
-                eml->prev_PC, cpu->SP, eml->opcode);
+    /* a debugger stop didn't execute anything */
+    if (eml->trace && status != EML_BRK_REACHED) {
+        trace_instr(eml->trace, eml);
     }
 
-    /* Check if breakpoint reached */
-    if (eml->brk_point_set && eml->prev_PC == eml->brk_point) {
-        return EML_BRK_REACHED;
+    return status;
+}
+
+enum eml_stat emulator_run(struct emulator *eml, int n) {
+    eml->cycles += n;
+    /* Tracing needs the interpreter, breakpoints are in the decoded code */
+    if (eml->engine == ENGINE_INTERP || eml->trace) {
+        return run_interp(eml, n);
     }
+#ifdef CHIP8_PROFILE
+    /* so does profiling, only emulator_cycle is instrumented */
+    if (eml->profile) {
+        return run_interp(eml, n);
+    }
+#endif
+    return run_threaded(eml, n);
+}
+
+/*
+ * Run one 60 Hz frame: the cycles of 1/60 s at the clock speed, then a
+ * timer tick unless the run faulted. Cycles that don't divide evenly are
+ * carried over, so clock_speed is reached exactly on average.
+ */
+enum eml_stat emulator_frame(struct emulator *eml) {
+    eml->cycle_frac += eml->clock_speed;
+    int n = eml->cycle_frac / 60;
+    eml->cycle_frac %= 60;
 
+    enum eml_stat status = emulator_run(eml, n);
+    if (status == EML_OK || status == EML_REDRAW) {
+        emulator_timer_dec(eml);
+    }
     return status;
 }
 
-bool emulator_load_program(struct emulator *eml, char *path) {
-    FILE *f = fopen(path, "rb");
-    if (!f) {
-        fprintf(stderr, "Unable to read file %s\n", path);
-        return false;
+/* Source of snapshot ids, shared by all emulators */
+static uint64_t snap_next_id;
+
+/*
+ * Load a rom image: the memory of its post-load state is copied as a whole
+ * and becomes the snapshot base, the registers are left alone. The blocks
+ * the analysis found are measured up front instead of on first entry.
+ */
+void emulator_load_image(struct emulator *eml, const struct rom_image *rom) {
+    memcpy(eml->cpu.memory, rom->init.cpu.memory, sizeof eml->cpu.memory);
+    emulator_predecode(eml);
+    eml->snap_id = rom->init.id;
+    for (int addr = RESERVED_MEM; addr < MEM_SIZE; addr += 2) {
+        if (rom->analysis.mem[addr] & AN_ENTRY) {
+            block_len(eml, addr >> 1);
+        }
+    }
+}
+
+/*
+ * Put an emulator back into the state right after loading rom. If rom was
+ * the last one loaded or reset to, only the memory blocks written since
+ * (by LD B, Vx and LD [I], Vx) are copied and re-decoded. Settings,
+ * counters and the random generator are kept.
+ */
+void emulator_reset(struct emulator *eml, const struct rom_image *rom) {
+    uint32_t rng = eml->rng;
+    emulator_restore(eml, &rom->init);
+    eml->rng = rng;
+    eml->opcode = 0;
+    eml->prev_PC = 0;
+}
+
+/*
+ * Build the post-load state of a program, as emulator_init and
+ * emulator_load_image leave it, for emulator_reset.
+ */
+void emulator_template(struct emulator_snapshot *snap, const uint8_t *data,
+                       size_t size) {
+    memset(snap, 0, sizeof *snap);
+    memcpy(snap->cpu.memory, chip8_fontset, sizeof chip8_fontset);
+    memcpy(&snap->cpu.memory[BIG_FONT_ADDR], chip8_big_fontset, sizeof chip8_big_fontset);
+    if (size) {
+        memcpy(snap->cpu.memory + RESERVED_MEM, data, size);
     }
-    fseek(f, 0, SEEK_END);
-    long fsize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    int max_prg_size = MEM_SIZE - RESERVED_MEM;
-    if (fsize > max_prg_size) {
-        fprintf(stderr,
-                "Unable to load program %s: Too large (%ld, max: %db)\n",
-                path, fsize, max_prg_size);
-        fclose(f);
+    snap->cpu.PC = 0x200;
+    snap->last_key = C8K_NONE;
+    snap->rng = 1;
+    snap->id = __atomic_add_fetch(&snap_next_id, 1, __ATOMIC_RELAXED);
+}
+
+bool emulator_load_program(struct emulator *eml, const char *path) {
+    struct rom_image rom;
+    if (!rom_image_load(&rom, path)) {
         return false;
     }
-    fread(eml->cpu.memory + RESERVED_MEM, fsize, 1, f);
-    fclose(f);
+    emulator_load_image(eml, &rom);
+    rom_image_unload(&rom);
     return true;
 }
 
+/*
+ * Save the state of an emulator. If snap is already the base of eml, only
+ * the memory blocks written since are copied.
+ */
+void emulator_snapshot(struct emulator *eml, struct emulator_snapshot *snap) {
+    bool base = snap->id != 0 && snap->id == eml->snap_id;
+    uint64_t blocks = base ? eml->mem_dirty : ~0ULL;
+    for (; blocks; blocks &= blocks - 1) {
+        int b = __builtin_ctzll(blocks);
+        memcpy(&snap->cpu.memory[b * MEM_BLOCK],
+               &eml->cpu.memory[b * MEM_BLOCK], MEM_BLOCK);
+    }
+    /*
+     * In the 64x32 mode, the words after its rows are all 0. Only the base
+     * is known to hold those zeros already, any other snap may hold garbage.
+     */
+    bool all = !base || eml->cpu.hires || snap->cpu.hires;
+    int words = all ? DISP_WORDS : DISP_H;
+    memcpy(&snap->cpu.display, &eml->cpu.display, words * sizeof *eml->cpu.display);
+    memcpy(&snap->cpu.V, &eml->cpu.V, sizeof eml->cpu.V);
+    memcpy(&snap->cpu.stack, &eml->cpu.stack, sizeof eml->cpu.stack);
+    memcpy(&snap->cpu.rpl, &eml->cpu.rpl, sizeof eml->cpu.rpl);
+    snap->cpu.hires = eml->cpu.hires;
+    snap->cpu.SP = eml->cpu.SP;
+    snap->cpu.DT = eml->cpu.DT;
+    snap->cpu.ST = eml->cpu.ST;
+    snap->cpu.PC = eml->cpu.PC;
+    snap->cpu.I = eml->cpu.I;
+    snap->keypad = eml->keypad;
+    snap->last_key = eml->last_key;
+    snap->key_waiting = eml->key_waiting;
+    snap->rng = eml->rng;
+    snap->cycle_frac = eml->cycle_frac;
+    snap->cycles = eml->cycles;
+
+    /* a new id, emulators based on the old contents must not match */
+    snap->id = __atomic_add_fetch(&snap_next_id, 1, __ATOMIC_RELAXED);
+    eml->snap_id = snap->id;
+    eml->mem_dirty = 0;
+}
+
+/*
+ * Load a saved state into an emulator. Restoring its base copies the
+ * blocks written since; any other snapshot is compared block by block.
+ * Either way only changed memory is written and re-decoded, and only
+ * changed display rows are marked dirty.
+ */
+void emulator_restore(struct emulator *eml, const struct emulator_snapshot *snap) {
+    uint64_t blocks = 0;
+    if (snap->id != 0 && snap->id == eml->snap_id) {
+        blocks = eml->mem_dirty;
+    } else {
+        for (int b = 0; b < MEM_SIZE / MEM_BLOCK; b++) {
+            if (memcmp(&snap->cpu.memory[b * MEM_BLOCK],
+                       &eml->cpu.memory[b * MEM_BLOCK], MEM_BLOCK)) {
+                blocks |= 1ULL << b;
+            }
+        }
+    }
+    for (; blocks; blocks &= blocks - 1) {
+        int b = __builtin_ctzll(blocks);
+        memcpy(&eml->cpu.memory[b * MEM_BLOCK],
+               &snap->cpu.memory[b * MEM_BLOCK], MEM_BLOCK);
+        mem_written(eml, b * MEM_BLOCK, MEM_BLOCK);
+    }
+    /* in the 64x32 mode, the words after its rows are all 0 */
+    int row_words = eml->cpu.hires ? 2 : 1;
+    int words = eml->cpu.hires || snap->cpu.hires ? DISP_WORDS : DISP_H;
+    if (eml->cpu.hires != snap->cpu.hires) {
+        eml->dirty_rows = ~0ULL;
+    }
+    for (int i = 0; i < words; i++) {
+        uint64_t old = eml->cpu.display[i];
+        eml->dirty_rows |= (uint64_t) (old != snap->cpu.display[i])
+                           << (i / row_words % 64);
+        eml->disp_hash += (snap->cpu.display[i] - old) * disp_key[i];
+        eml->cpu.display[i] = snap->cpu.display[i];
+    }
+    memcpy(&eml->cpu.V, &snap->cpu.V, sizeof eml->cpu.V);
+    memcpy(&eml->cpu.stack, &snap->cpu.stack, sizeof eml->cpu.stack);
+    memcpy(&eml->cpu.rpl, &snap->cpu.rpl, sizeof eml->cpu.rpl);
+    eml->cpu.hires = snap->cpu.hires;
+    eml->cpu.SP = snap->cpu.SP;
+    eml->cpu.DT = snap->cpu.DT;
+    eml->cpu.ST = snap->cpu.ST;
+    eml->cpu.PC = snap->cpu.PC;
+    eml->cpu.I = snap->cpu.I;
+    eml->keypad = snap->keypad;
+    eml->last_key = snap->last_key;
+    eml->key_waiting = snap->key_waiting;
+    eml->rng = snap->rng;
+    eml->cycle_frac = snap->cycle_frac;
+    eml->cycles = snap->cycles;
+
+    eml->snap_id = snap->id;
+    eml->mem_dirty = 0;
+}
+
+/*
+ * Fingerprint of the display contents, maintained as pixels are drawn.
+ * Equal displays have equal hashes, in every history that leads to them.
+ */
+uint64_t emulator_display_hash(const struct emulator *eml) {
+    uint64_t h = eml->disp_hash ^ eml->cpu.hires;
+    h = (h ^ h >> 31) * 0x7FB5D329728EA185ULL; /* final mix */
+    h = (h ^ h >> 27) * 0x81DADEF4BC2DD44DULL;
+    return h ^ h >> 33;
+}
+
+/*
+ * Whether the display changed since the last call (or since loading). A
+ * CLS and redraw of the same picture within a frame is no change.
+ */
+bool emulator_frame_changed(struct emulator *eml) {
+    bool changed = eml->disp_hash != eml->disp_seen ||
+                   eml->cpu.hires != eml->disp_seen_hires;
+    eml->disp_seen = eml->disp_hash;
+    eml->disp_seen_hires = eml->cpu.hires;
+    return changed;
+}
+
+/* Recompute the display hash after the display was written directly */
+void emulator_display_rehash(struct emulator *eml) {
+    eml->disp_hash = disp_sum(&eml->cpu);
+}
+
+uint64_t emulator_hash(const struct emulator *eml) {
+    const struct chip8 *cpu = &eml->cpu;
+    uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+#define HASH(p, n) \
+    for (size_t i = 0; i < (n); i++) { \
+        h = (h ^ ((const uint8_t *) (p))[i]) * 0x100000001b3ULL; \
+    }
+    HASH(cpu->memory, sizeof cpu->memory);
+    HASH(cpu->display, sizeof cpu->display);
+    HASH(cpu->V, sizeof cpu->V);
+    HASH(cpu->stack, sizeof cpu->stack);
+    HASH(cpu->rpl, sizeof cpu->rpl);
+    HASH(&cpu->hires, 1);
+    HASH(&cpu->SP, 1);
+    HASH(&cpu->DT, 1);
+    HASH(&cpu->ST, 1);
+    HASH(&cpu->PC, 2);
+    HASH(&cpu->I, 2);
+    HASH(&eml->rng, sizeof eml->rng);
+#undef HASH
+    return h;
+}
+
+/* Name of an instruction handler by its index (chip8_instr.op) */
+const char *emulator_op_name(uint8_t op) {
+    return op < OP_COUNT ? op_names[op] : "?";
+}
+
+const char *emulator_stat_str(enum eml_stat stat) {
+    switch (stat) {
+    case EML_OK: return "ok";
+    case EML_REDRAW: return "redraw";
+    case EML_BRK_REACHED: return "breakpoint";
+    case EML_EXIT: return "exit";
+    case EML_UNK_OPC: return "unknown-opcode";
+    case EML_STACK_OVERFL: return "stack-overflow";
+    case EML_STACK_UNDERFL: return "stack-underflow";
+    case EML_PC_OVERFL: return "pc-overflow";
+    }
+    return "?";
+}
+
 void emulator_dump(struct emulator *eml) {
     fprintf(stdout, "PC: 0x%02X\n", eml->cpu.PC);
     fprintf(stdout, "ST: 0x%02X\n", eml->cpu.ST);
@@ -7,6 +7,7 @@
 #ifndef __CHIP8_H
 #define __CHIP8_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -15,8 +16,14 @@
 #define RESERVED_MEM 512
 #define DISP_W 64
 #define DISP_H 32
-#define DISP_SIZE DISP_W*DISP_H
+#define DISP_HI_W 128                   /* SCHIP high resolution mode */
+#define DISP_HI_H 64
+#define DISP_WORDS (DISP_HI_W / 64 * DISP_HI_H) /* Display words of both modes */
+#define BIG_FONT_ADDR 0x50              /* SCHIP 8x10 digits, after the font */
 #define STACK_SIZE 16
+#define INSTR_SLOTS (MEM_SIZE/2)        /* One decoded slot per 2-byte word */
+#define MEM_BLOCK 64                    /* Memory write tracking granularity */
+#define CACHE_LINE 64
 #define _60HZ 16666667L /* (1/60) seconds in ns */
 
 enum chip8_key {
@@ -27,32 +34,27 @@ enum chip8_key {
     C8K_NONE = -1
 };
 
-/* Chip8 machine state */
+/*
+ * Chip8 machine state. The registers share the first cache line, display
+ * rows and memory blocks start on line boundaries.
+ *
+ * The monochrome display is packed, MSB first. In the 64x32 mode row r is
+ * display[r]; in SCHIP's 128x64 mode it is display[2r] (x 0-63) and
+ * display[2r+1] (x 64-127). Switching modes clears it.
+ */
 struct chip8 {
-    uint8_t memory[MEM_SIZE];           /* 4096 bytes of memory */
-    uint8_t display[DISP_SIZE];         /* 64x32 pixel monochrome display */
-    uint8_t V[16];                      /* V0 to VF data registers */
+    uint8_t V[16] __attribute__((aligned(CACHE_LINE))); /* V0 to VF data
+                                           registers */
+    uint16_t PC;                        /* Program counter. Start at 0x200 */
+    uint16_t I;                         /* Address register */
     uint8_t SP;                         /* Stack pointer (next free slot) */
     uint8_t DT;                         /* Delay timer */
     uint8_t ST;                         /* Sound timer */
-    uint16_t PC;                        /* Program counter. Start at 0x200 */
-    uint16_t I;                         /* Address register */
+    uint8_t hires;                      /* 128x64 mode (SCHIP) */
     uint16_t stack[STACK_SIZE];         /* Stack */
-};
-
-struct emulator {
-    struct chip8 cpu;
-    uint16_t opcode;                    /* Last read opcode */
-    uint16_t prev_PC;                   /* Previous PC (for error output) */
-    uint16_t keypad;                    /* Bitmap for pressed keys, 0-F */
-    enum chip8_key last_key;            /* The last pressed key */
-    int32_t brk_point;                  /* Curent breakpoint */
-    int32_t clock_speed;                /* Clock speed in Hz */
-    char *rom_file;                     /* File name of loaded rom */
-    bool key_waiting;                   /* Emulator is wating for a key */
-    bool dbg_output;                    /* Debug output flag */
-    bool brk_point_set;                 /* Breakpoint enable flag */
-    bool paused;                        /* Paused emulator state */
+    uint8_t rpl[8];                     /* SCHIP RPL user flags */
+    uint64_t display[DISP_WORDS] __attribute__((aligned(CACHE_LINE))); /* Pixels */
+    uint8_t memory[MEM_SIZE];           /* 4096 bytes of memory */
 };
 
 /* Emulator state after executing an instruction */
@@ -60,18 +62,160 @@ enum eml_stat {
     EML_OK,                             /* No errors during cycle */
     EML_REDRAW,                         /* Display redraw required */
     EML_BRK_REACHED,                    /* Breakpoint reached */
+    EML_EXIT,                           /* Program exited (SCHIP 00FD) */
     EML_UNK_OPC,                        /* Error: Unknown opcode */
     EML_STACK_OVERFL,                   /* Error: Stack overflow */
     EML_STACK_UNDERFL,                  /* Error: Stack is empty */
     EML_PC_OVERFL                       /* Error: PC outside memory */
 };
 
+/* Execution engines for emulator_run */
+enum eml_engine {
+    ENGINE_INTERP,                      /* emulator_cycle per instruction */
+    ENGINE_THREADED                     /* Direct-threaded basic blocks */
+};
+
+/*
+ * Quirks profiles: the behaviors in which Chip8 implementations differ.
+ * Programs written for one often misbehave on another.
+ */
+enum eml_quirks {
+    QUIRKS_DEFAULT,                     /* This emulator's original behavior */
+    QUIRKS_VIP,                         /* COSMAC VIP interpreter */
+    QUIRKS_CHIP48,                      /* CHIP-48 on the HP-48 */
+    QUIRKS_SCHIP,                       /* SUPER-CHIP 1.1 */
+    QUIRKS_COUNT
+};
+
+/* What a quirks profile changes */
+struct chip8_quirks {
+    const char *name;                   /* Profile name for the command line */
+    bool shift_vy;                      /* 8xy6/8xyE shift Vy, not Vx */
+    bool logic_vf_reset;                /* 8xy1/8xy2/8xy3 clear VF */
+    uint8_t mem_i_inc;                  /* Fx55/Fx65 advance I by: 0 nothing,
+                                           1 x, 2 x+1 */
+    bool add_i_vf;                      /* Fx1E sets VF when I passes 0xFFF */
+    bool jump_vx;                       /* Bxnn jumps to xnn + Vx, not V0 */
+    bool draw_clip;                     /* Sprites are clipped at the display
+                                           edges instead of wrapping */
+    bool sprite16;                      /* Dxy0 draws a 16x16 sprite, else
+                                           nothing */
+};
+
+struct emulator;
+struct chip8_instr;
+struct profile;
+struct trace;
+struct beeper;
+struct rom_image;
+struct debugger;
+
+/* Instruction handler, gets the operands from the predecoded slot */
+typedef enum eml_stat (*instr_fn)(const struct chip8_instr *in,
+                                  struct emulator *eml);
+
+/* Predecoded instruction */
+struct chip8_instr {
+    instr_fn fn;                        /* Handler for this instruction */
+    uint16_t opcode;                    /* Raw opcode */
+    uint16_t nnn;                       /* 12-bit address operand */
+    uint8_t x;                          /* x nibble */
+    uint8_t y;                          /* y nibble */
+    uint8_t kk;                         /* kk byte (n is the low nibble) */
+    uint8_t op;                         /* Instruction index of the handler */
+};
+
+/*
+ * Emulator instance. The fields used by nearly every instruction fill the
+ * first cache line, the machine state follows on its own lines; settings
+ * and bookkeeping of the frontends come last. Instances are a multiple of
+ * CACHE_LINE in size, arrays of them never share lines.
+ */
+struct emulator {
+    uint16_t opcode __attribute__((aligned(CACHE_LINE))); /* Last read
+                                           opcode */
+    uint16_t prev_PC;                   /* Previous PC (for error output) */
+    uint16_t keypad;                    /* Bitmap for pressed keys, 0-F */
+    bool key_waiting;                   /* Emulator is wating for a key */
+    enum eml_engine engine;             /* Engine used by emulator_run */
+    uint32_t rng;                       /* Random generator state (Cxkk) */
+    uint64_t dirty_rows;                /* Display rows changed since redraw */
+    uint64_t instr_count;               /* Instructions run, including the
+                                           fast-forwarded ones of idle_count */
+    uint64_t drw_count;                 /* Executed DRW instructions */
+    uint64_t mem_dirty;                 /* Memory blocks written since snap_id */
+    struct trace *trace;                /* Instruction trace, NULL: off */
+    struct profile *profile;            /* Counters if built with CHIP8_PROFILE */
+    struct beeper *beeper;              /* Sound timer output, NULL: off */
+    struct chip8 cpu;
+    struct chip8_instr decoded[INSTR_SLOTS]; /* Predecoded memory words */
+    uint8_t blk_len[INSTR_SLOTS];       /* Basic block lengths, 0: unknown */
+    enum chip8_key last_key;            /* The last pressed key */
+    struct debugger *debug;             /* Breakpoints and watchpoints,
+                                           NULL: off */
+    int32_t clock_speed;                /* Clock speed in Hz */
+    uint32_t cycle_frac;                /* Cycles carried to the next frame,
+                                           in 1/60 cycles */
+    uint64_t cycles;                    /* Cycles given to emulator_run since
+                                           loading, positions inputs */
+    uint64_t disp_hash;                 /* Display words times their keys */
+    uint64_t disp_seen;                 /* disp_hash at the last
+                                           emulator_frame_changed */
+    bool disp_seen_hires;
+    bool paused;                        /* Paused emulator state */
+    enum eml_quirks quirks;             /* Profile instructions decode to */
+    char *rom_file;                     /* File name of loaded rom */
+    uint64_t idle_count;                /* Instructions of idle loops skipped */
+    uint64_t snap_id;                   /* Snapshot memory was last synced with */
+};
+
+/*
+ * Saved machine state. A snapshot taken from or restored into an emulator
+ * becomes its base: until memory is replaced as a whole, the emulator
+ * knows which memory blocks differ from the base, so taking or restoring
+ * the base again only copies those blocks.
+ */
+struct emulator_snapshot {
+    uint64_t id;                        /* Unique per taken snapshot, 0: none */
+    uint16_t keypad;
+    enum chip8_key last_key;
+    bool key_waiting;
+    uint32_t rng;
+    uint32_t cycle_frac;
+    uint64_t cycles;
+    struct chip8 cpu;
+};
+
 /* Emulator functions */
 void emulator_init(struct emulator *eml);
 enum eml_stat emulator_cycle(struct emulator *eml);
+enum eml_stat emulator_run(struct emulator *eml, int n);
+enum eml_stat emulator_frame(struct emulator *eml);
+void emulator_seed(struct emulator *eml, uint32_t seed);
 void emulator_timer_dec(struct emulator *eml);
-bool emulator_load_program(struct emulator *eml, char *path);
+void emulator_key_down(struct emulator *eml, enum chip8_key key);
+void emulator_key_up(struct emulator *eml, enum chip8_key key);
+bool emulator_load_program(struct emulator *eml, const char *path);
+void emulator_load_image(struct emulator *eml, const struct rom_image *rom);
+void emulator_reset(struct emulator *eml, const struct rom_image *rom);
+void emulator_template(struct emulator_snapshot *snap, const uint8_t *data,
+                       size_t size);
+void emulator_predecode(struct emulator *eml);
+void emulator_set_quirks(struct emulator *eml, enum eml_quirks quirks);
+void emulator_debug_sync(struct emulator *eml);
+void emulator_write_mem(struct emulator *eml, uint16_t addr,
+                        const uint8_t *data, uint16_t len);
+const struct chip8_quirks *emulator_quirks(enum eml_quirks quirks);
+int emulator_quirks_parse(const char *name);
+void emulator_snapshot(struct emulator *eml, struct emulator_snapshot *snap);
+void emulator_restore(struct emulator *eml, const struct emulator_snapshot *snap);
 void emulator_dump(struct emulator *eml);
+uint64_t emulator_hash(const struct emulator *eml);
+uint64_t emulator_display_hash(const struct emulator *eml);
+bool emulator_frame_changed(struct emulator *eml);
+void emulator_display_rehash(struct emulator *eml);
+const char *emulator_op_name(uint8_t op);
+const char *emulator_stat_str(enum eml_stat stat);
 
 #endif
 
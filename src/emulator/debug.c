@@ -0,0 +1,296 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Breakpoints, watchpoints and stepping. The debugger decides which
+ * instruction slots need a check and whether a check stops; the emulator
+ * patches those slots (see instr_DBG), so code without breakpoints and
+ * without watched accesses runs at full speed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "debug.h"
+
+static bool bit(const uint64_t *map, uint32_t addr) {
+    return map[addr / 64] >> (addr % 64) & 1;
+}
+
+static void set_bit(uint64_t *map, uint32_t addr, bool on) {
+    if (on) {
+        map[addr / 64] |= 1ULL << (addr % 64);
+    } else {
+        map[addr / 64] &= ~(1ULL << (addr % 64));
+    }
+}
+
+struct debugger *debug_create(void) {
+    struct debugger *d = calloc(1, sizeof *d);
+    if (d) {
+        d->resume_pc = -1;
+    }
+    return d;
+}
+
+void debug_destroy(struct debugger *d) {
+    free(d);
+}
+
+/* Break at addr, on every pass or only while cond holds. False if full */
+bool debug_break(struct emulator *eml, uint16_t addr,
+                 const struct debug_cond *cond) {
+    struct debugger *d = eml->debug;
+    if (d->n_brk == DEBUG_MAX_BRK || addr >= MEM_SIZE) {
+        return false;
+    }
+    struct debug_brk *b = &d->brk[d->n_brk++];
+    b->addr = addr;
+    b->has_cond = cond != NULL;
+    if (cond) {
+        b->cond = *cond;
+    }
+    set_bit(d->brk_map, addr, true);
+    emulator_debug_sync(eml);
+    return true;
+}
+
+/* Remove the breakpoints at addr */
+void debug_unbreak(struct emulator *eml, uint16_t addr) {
+    struct debugger *d = eml->debug;
+    int n = 0;
+    for (int i = 0; i < d->n_brk; i++) {
+        if (d->brk[i].addr != addr) {
+            d->brk[n++] = d->brk[i];
+        }
+    }
+    d->n_brk = n;
+    set_bit(d->brk_map, addr % MEM_SIZE, false);
+    emulator_debug_sync(eml);
+}
+
+/* Watch [addr, addr+len) for the kinds of accesses through I */
+void debug_watch(struct emulator *eml, uint16_t addr, uint16_t len, int kinds) {
+    struct debugger *d = eml->debug;
+    for (uint32_t a = addr; a < (uint32_t) addr + len && a < MEM_SIZE; a++) {
+        d->watched -= bit(d->watch_r, a) || bit(d->watch_w, a);
+        if (kinds & DEBUG_WATCH_READ) {
+            set_bit(d->watch_r, a, true);
+        }
+        if (kinds & DEBUG_WATCH_WRITE) {
+            set_bit(d->watch_w, a, true);
+        }
+        d->watched += bit(d->watch_r, a) || bit(d->watch_w, a);
+    }
+    emulator_debug_sync(eml);
+}
+
+void debug_unwatch(struct emulator *eml, uint16_t addr, uint16_t len, int kinds) {
+    struct debugger *d = eml->debug;
+    for (uint32_t a = addr; a < (uint32_t) addr + len && a < MEM_SIZE; a++) {
+        d->watched -= bit(d->watch_r, a) || bit(d->watch_w, a);
+        if (kinds & DEBUG_WATCH_READ) {
+            set_bit(d->watch_r, a, false);
+        }
+        if (kinds & DEBUG_WATCH_WRITE) {
+            set_bit(d->watch_w, a, false);
+        }
+        d->watched += bit(d->watch_r, a) || bit(d->watch_w, a);
+    }
+    emulator_debug_sync(eml);
+}
+
+/*
+ * Parse a condition such as "V3==5", "I>=0x300" or "DT!=0". False if it
+ * isn't one.
+ */
+bool debug_parse_cond(const char *s, struct debug_cond *cond) {
+    static const struct { const char *name; int reg; } regs[] = {
+        { "DT", DEBUG_REG_DT }, { "ST", DEBUG_REG_ST }, { "SP", DEBUG_REG_SP },
+        { "I", DEBUG_REG_I }
+    };
+    static const char *cmps[] = {
+        [DEBUG_EQ] = "==", [DEBUG_NE] = "!=", [DEBUG_LE] = "<=",
+        [DEBUG_GE] = ">=", [DEBUG_LT] = "<", [DEBUG_GT] = ">"
+    };
+
+    if ((s[0] == 'V' || s[0] == 'v') && isxdigit((unsigned char) s[1])) {
+        cond->reg = isdigit((unsigned char) s[1]) ? s[1] - '0'
+                                                  : (s[1] | 0x20) - 'a' + 10;
+        s += 2;
+    } else {
+        size_t i;
+        for (i = 0; i < sizeof regs / sizeof *regs; i++) {
+            size_t len = strlen(regs[i].name);
+            if (strncmp(s, regs[i].name, len) == 0) {
+                cond->reg = regs[i].reg;
+                s += len;
+                break;
+            }
+        }
+        if (i == sizeof regs / sizeof *regs) {
+            return false;
+        }
+    }
+
+    /* two character operators are tried before their prefixes */
+    const int order[] = { DEBUG_EQ, DEBUG_NE, DEBUG_LE, DEBUG_GE, DEBUG_LT, DEBUG_GT };
+    int i;
+    for (i = 0; i < 6; i++) {
+        size_t len = strlen(cmps[order[i]]);
+        if (strncmp(s, cmps[order[i]], len) == 0) {
+            cond->cmp = order[i];
+            s += len;
+            break;
+        }
+    }
+    if (i == 6 || !*s) {
+        return false;
+    }
+    char *end;
+    long v = strtol(s, &end, 0);
+    if (*end || v < 0 || v > 0xFFFF) {
+        return false;
+    }
+    cond->value = v;
+    return true;
+}
+
+static bool cond_holds(const struct debug_cond *c, const struct emulator *eml) {
+    unsigned v;
+    switch (c->reg) {
+    case DEBUG_REG_I: v = eml->cpu.I; break;
+    case DEBUG_REG_DT: v = eml->cpu.DT; break;
+    case DEBUG_REG_ST: v = eml->cpu.ST; break;
+    case DEBUG_REG_SP: v = eml->cpu.SP; break;
+    default: v = eml->cpu.V[c->reg & 0xF]; break;
+    }
+    switch (c->cmp) {
+    case DEBUG_EQ: return v == c->value;
+    case DEBUG_NE: return v != c->value;
+    case DEBUG_LT: return v < c->value;
+    case DEBUG_LE: return v <= c->value;
+    case DEBUG_GT: return v > c->value;
+    case DEBUG_GE: return v >= c->value;
+    }
+    return false;
+}
+
+/*
+ * Accesses of an instruction through I: *len bytes, write or read. Dxy0
+ * reads a 16x16 sprite if sprite16, else nothing.
+ */
+static bool mem_access(uint16_t opcode, bool sprite16, int *len, bool *write) {
+    uint8_t x = opcode >> 8 & 0xF;
+    if ((opcode & 0xF000) == 0xD000) {
+        *len = (opcode & 0xF) ? (opcode & 0xF) : sprite16 ? 32 : 0;
+        *write = false;
+        return true;
+    }
+    if ((opcode & 0xF000) != 0xF000) {
+        return false;
+    }
+    switch (opcode & 0xFF) {
+    case 0x33: *len = 3; *write = true; return true;
+    case 0x55: *len = x + 1; *write = true; return true;
+    case 0x65: *len = x + 1; *write = false; return true;
+    }
+    return false;
+}
+
+/* Whether the instruction at addr has to be checked by debug_stop */
+bool debug_wants(const struct debugger *d, uint16_t addr, uint16_t opcode) {
+    int len;
+    bool write;
+    return bit(d->brk_map, addr) ||
+           (d->watched && mem_access(opcode, true, &len, &write));
+}
+
+/* Whether opcode accesses a watched address through I, kept as the reason */
+static bool watch_hit(struct debugger *d, const struct emulator *eml,
+                      uint16_t opcode) {
+    int len;
+    bool write;
+    bool sprite16 = emulator_quirks(eml->quirks)->sprite16;
+    if (!d->watched || !mem_access(opcode, sprite16, &len, &write)) {
+        return false;
+    }
+    const uint64_t *map = write ? d->watch_w : d->watch_r;
+    for (int i = 0; i < len; i++) {
+        uint16_t a = (eml->cpu.I + i) & (MEM_SIZE - 1);
+        if (bit(map, a)) {
+            d->reason = write ? DEBUG_STOP_WRITE : DEBUG_STOP_READ;
+            d->stop_addr = a;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Whether the instruction at pc stops the emulator before it runs. The
+ * reason is kept in the debugger.
+ */
+bool debug_stop(struct debugger *d, const struct emulator *eml, uint16_t pc,
+                uint16_t opcode) {
+    if (d->resume_pc == pc) {
+        d->resume_pc = -1;
+        return false;
+    }
+    d->resume_pc = -1;
+
+    if (bit(d->brk_map, pc)) {
+        for (int i = 0; i < d->n_brk; i++) {
+            const struct debug_brk *b = &d->brk[i];
+            if (b->addr == pc && (!b->has_cond || cond_holds(&b->cond, eml))) {
+                d->reason = DEBUG_STOP_BREAK;
+                d->stop_addr = pc;
+                return true;
+            }
+        }
+    }
+    return watch_hit(d, eml, opcode);
+}
+
+/* Let the instruction at PC run the next time, after a stop there */
+void debug_resume(struct emulator *eml) {
+    eml->debug->resume_pc = eml->cpu.PC;
+    eml->debug->reason = DEBUG_STOP_NONE;
+}
+
+/* Execute the instruction at PC, even if it has a breakpoint */
+enum eml_stat debug_step(struct emulator *eml) {
+    debug_resume(eml);
+    enum eml_stat status = emulator_run(eml, 1);
+    eml->debug->resume_pc = -1;
+    return status;
+}
+
+/*
+ * Execute the instruction at PC as debug_step does. If it accessed a
+ * watched address, the emulator stops after it with EML_BRK_REACHED and
+ * the watchpoint as the reason, as debuggers that report watchpoints
+ * after the access (GDB) expect.
+ */
+enum eml_stat debug_step_watched(struct emulator *eml) {
+    struct debugger *d = eml->debug;
+    uint16_t pc = eml->cpu.PC;
+    uint16_t opcode = pc + 1 < MEM_SIZE
+        ? eml->cpu.memory[pc] << 8 | eml->cpu.memory[pc + 1] : 0;
+    bool hit = watch_hit(d, eml, opcode);
+    enum debug_reason reason = d->reason;
+    uint16_t addr = d->stop_addr;
+
+    enum eml_stat status = debug_step(eml);
+    if (hit && (status == EML_OK || status == EML_REDRAW)) {
+        d->reason = reason;
+        d->stop_addr = addr;
+        status = EML_BRK_REACHED;
+    }
+    return status;
+}
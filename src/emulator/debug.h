@@ -0,0 +1,92 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __DEBUG_H
+#define __DEBUG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+#define DEBUG_MAX_BRK 64                /* Breakpoints (with conditions) */
+
+/* Registers a condition can test, besides V0 to VF (0-15) */
+enum debug_reg {
+    DEBUG_REG_I = 16,
+    DEBUG_REG_DT,
+    DEBUG_REG_ST,
+    DEBUG_REG_SP
+};
+
+enum debug_cmp {
+    DEBUG_EQ, DEBUG_NE, DEBUG_LT, DEBUG_LE, DEBUG_GT, DEBUG_GE
+};
+
+/* Register condition of a breakpoint: reg cmp value */
+struct debug_cond {
+    uint8_t reg;                        /* 0-15: Vx, else enum debug_reg */
+    uint8_t cmp;                        /* enum debug_cmp */
+    uint16_t value;
+};
+
+struct debug_brk {
+    uint16_t addr;
+    bool has_cond;                      /* Else it always stops */
+    struct debug_cond cond;
+};
+
+/* What stopped the emulator */
+enum debug_reason {
+    DEBUG_STOP_NONE,
+    DEBUG_STOP_BREAK,                   /* Breakpoint at stop_addr */
+    DEBUG_STOP_READ,                    /* Read of watched stop_addr */
+    DEBUG_STOP_WRITE                    /* Write of watched stop_addr */
+};
+
+/* Watchpoint kinds */
+#define DEBUG_WATCH_READ 1
+#define DEBUG_WATCH_WRITE 2
+
+/*
+ * Breakpoints and watchpoints of an emulator (struct emulator debug).
+ * The instruction slots they concern are patched into a debug
+ * instruction, see emulator_debug_sync; all others run as without a
+ * debugger. The emulator stops before the instruction with
+ * EML_BRK_REACHED, PC pointing at it; debug_step_watched runs a watched
+ * access and stops after it.
+ */
+struct debugger {
+    uint64_t brk_map[MEM_SIZE / 64];    /* Addresses with breakpoints */
+    uint64_t watch_r[MEM_SIZE / 64];    /* Watched for reads through I */
+    uint64_t watch_w[MEM_SIZE / 64];    /* Watched for writes through I */
+    int watched;                        /* Bytes set in either watch map */
+    struct debug_brk brk[DEBUG_MAX_BRK];
+    int n_brk;
+    int32_t resume_pc;                  /* Don't stop here once, -1: none */
+    enum debug_reason reason;           /* Why it stopped last */
+    uint16_t stop_addr;                 /* Breakpoint or watched address */
+};
+
+/* Debugger functions */
+struct debugger *debug_create(void);
+void debug_destroy(struct debugger *d);
+bool debug_break(struct emulator *eml, uint16_t addr,
+                 const struct debug_cond *cond);
+void debug_unbreak(struct emulator *eml, uint16_t addr);
+void debug_watch(struct emulator *eml, uint16_t addr, uint16_t len, int kinds);
+void debug_unwatch(struct emulator *eml, uint16_t addr, uint16_t len, int kinds);
+bool debug_parse_cond(const char *s, struct debug_cond *cond);
+void debug_resume(struct emulator *eml);
+enum eml_stat debug_step(struct emulator *eml);
+enum eml_stat debug_step_watched(struct emulator *eml);
+
+/* Used by the emulator */
+bool debug_wants(const struct debugger *d, uint16_t addr, uint16_t opcode);
+bool debug_stop(struct debugger *d, const struct emulator *eml, uint16_t pc,
+                uint16_t opcode);
+
+#endif
@@ -0,0 +1,479 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * GDB remote protocol stub. The frontend polls it once per tick; it never
+ * blocks the emulator. While a client is attached it decides whether the
+ * emulator runs: it is halted on attach, runs after continue, and halts
+ * again on a debugger stop, a fault or an interrupt from the client.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "gdb.h"
+#include "debug.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Size of the register file in g packets */
+#define GDB_REG_BYTES 23
+
+static const char hex[] = "0123456789abcdef";
+
+static int unhex(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* Decode n bytes of hex, false if there aren't that many */
+static bool get_hex(const char *s, uint8_t *b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int hi = unhex(s[2 * i]);
+        int lo = hi < 0 ? -1 : unhex(s[2 * i + 1]);
+        if (lo < 0) {
+            return false;
+        }
+        b[i] = hi << 4 | lo;
+    }
+    return true;
+}
+
+static void put_hex(char *s, const uint8_t *b, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        s[2 * i] = hex[b[i] >> 4];
+        s[2 * i + 1] = hex[b[i] & 0xF];
+    }
+    s[2 * n] = '\0';
+}
+
+static void send_raw(struct gdb_stub *g, const char *data, size_t n) {
+    while (n && g->fd >= 0) {
+        ssize_t w = send(g->fd, data, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return;
+        }
+        data += w;
+        n -= w;
+    }
+}
+
+static void send_packet(struct gdb_stub *g, const char *data) {
+    char buf[GDB_PACKET + 4];
+    size_t n = strlen(data);
+    uint8_t sum = 0;
+    buf[0] = '$';
+    for (size_t i = 0; i < n; i++) {
+        buf[1 + i] = data[i];
+        sum += (uint8_t) data[i];
+    }
+    buf[n + 1] = '#';
+    buf[n + 2] = hex[sum >> 4];
+    buf[n + 3] = hex[sum & 0xF];
+    send_raw(g, buf, n + 4);
+}
+
+static void drop_client(struct gdb_stub *g) {
+    close(g->fd);
+    g->fd = -1;
+    g->in_len = 0;
+    g->running = true;
+}
+
+/* Stop reply for the status the emulator stopped with */
+static void reply_stop(struct gdb_stub *g, const struct emulator *eml,
+                       enum eml_stat status) {
+    char buf[64];
+    const struct debugger *d = eml->debug;
+    switch (status) {
+    case EML_BRK_REACHED:
+        if (d->reason == DEBUG_STOP_READ || d->reason == DEBUG_STOP_WRITE) {
+            snprintf(buf, sizeof buf, "T05%s:%x;",
+                     d->reason == DEBUG_STOP_READ ? "rwatch" : "watch",
+                     d->stop_addr);
+        } else {
+            snprintf(buf, sizeof buf, "S05");
+        }
+        break;
+    case EML_EXIT:
+        snprintf(buf, sizeof buf, "W00");
+        break;
+    case EML_UNK_OPC:
+        snprintf(buf, sizeof buf, "S04");   /* SIGILL */
+        break;
+    case EML_STACK_OVERFL:
+    case EML_STACK_UNDERFL:
+    case EML_PC_OVERFL:
+        snprintf(buf, sizeof buf, "S0b");   /* SIGSEGV */
+        break;
+    default:
+        snprintf(buf, sizeof buf, "S05");   /* SIGTRAP */
+        break;
+    }
+    send_packet(g, buf);
+}
+
+static int regs_read(const struct emulator *eml, uint8_t *b) {
+    const struct chip8 *cpu = &eml->cpu;
+    memcpy(b, cpu->V, 16);
+    b[16] = cpu->I;
+    b[17] = cpu->I >> 8;
+    b[18] = cpu->PC;
+    b[19] = cpu->PC >> 8;
+    b[20] = cpu->SP;
+    b[21] = cpu->DT;
+    b[22] = cpu->ST;
+    return GDB_REG_BYTES;
+}
+
+static void regs_write(struct emulator *eml, const uint8_t *b) {
+    struct chip8 *cpu = &eml->cpu;
+    memcpy(cpu->V, b, 16);
+    cpu->I = b[16] | b[17] << 8;
+    cpu->PC = (b[18] | b[19] << 8) & (MEM_SIZE - 1);
+    cpu->SP = b[20] % (STACK_SIZE + 1);
+    cpu->DT = b[21];
+    cpu->ST = b[22];
+}
+
+/* Offset and size of register n in the register file, false if none */
+static bool reg_pos(unsigned n, int *off, int *size) {
+    static const uint8_t offs[] = { 16, 18, 20, 21, 22 };
+    if (n < 16) {
+        *off = n;
+        *size = 1;
+    } else if (n < 21) {
+        *off = offs[n - 16];
+        *size = n < 18 ? 2 : 1;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* Z and z packets: type,addr,kind */
+static const char *set_point(struct emulator *eml, const char *p, bool insert) {
+    char *end;
+    unsigned long type = strtoul(p, &end, 16);
+    if (*end != ',') {
+        return "E01";
+    }
+    unsigned long addr = strtoul(end + 1, &end, 16);
+    if (*end != ',' || addr >= MEM_SIZE) {
+        return "E01";
+    }
+    unsigned long len = strtoul(end + 1, &end, 16);
+    static const int kinds[] = {
+        [2] = DEBUG_WATCH_WRITE, [3] = DEBUG_WATCH_READ,
+        [4] = DEBUG_WATCH_READ | DEBUG_WATCH_WRITE
+    };
+    switch (type) {
+    case 0: case 1:
+        if (!insert) {
+            debug_unbreak(eml, addr);
+        } else if (!debug_break(eml, addr, NULL)) {
+            return "E02";
+        }
+        return "OK";
+    case 2: case 3: case 4:
+        if (insert) {
+            debug_watch(eml, addr, len, kinds[type]);
+        } else {
+            debug_unwatch(eml, addr, len, kinds[type]);
+        }
+        return "OK";
+    }
+    return "";
+}
+
+static void handle_packet(struct gdb_stub *g, struct emulator *eml, char *p) {
+    char out[GDB_PACKET];
+    uint8_t buf[GDB_PACKET / 2];
+    unsigned long addr, len;
+    char *end;
+    out[0] = '\0';
+
+    switch (p[0]) {
+    case '?':
+        snprintf(out, sizeof out, "S05");
+        break;
+    case 'g':
+        put_hex(out, buf, regs_read(eml, buf));
+        break;
+    case 'G':
+        if (get_hex(p + 1, buf, GDB_REG_BYTES)) {
+            regs_write(eml, buf);
+            snprintf(out, sizeof out, "OK");
+        } else {
+            snprintf(out, sizeof out, "E01");
+        }
+        break;
+    case 'p': {
+        int off, size;
+        if (!reg_pos(strtoul(p + 1, NULL, 16), &off, &size)) {
+            snprintf(out, sizeof out, "E01");
+            break;
+        }
+        regs_read(eml, buf);
+        put_hex(out, buf + off, size);
+        break;
+    }
+    case 'P': {
+        int off, size;
+        uint8_t regs[GDB_REG_BYTES];
+        unsigned long n = strtoul(p + 1, &end, 16);
+        if (*end != '=' || !reg_pos(n, &off, &size) ||
+            !get_hex(end + 1, buf, size)) {
+            snprintf(out, sizeof out, "E01");
+            break;
+        }
+        regs_read(eml, regs);
+        memcpy(regs + off, buf, size);
+        regs_write(eml, regs);
+        snprintf(out, sizeof out, "OK");
+        break;
+    }
+    case 'm':
+        addr = strtoul(p + 1, &end, 16);
+        len = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+        if (addr >= MEM_SIZE || len > sizeof buf - 1) {
+            snprintf(out, sizeof out, "E01");
+            break;
+        }
+        len = addr + len > MEM_SIZE ? MEM_SIZE - addr : len;
+        put_hex(out, &eml->cpu.memory[addr], len);
+        break;
+    case 'M':
+        addr = strtoul(p + 1, &end, 16);
+        len = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+        if (*end != ':' || addr + len > MEM_SIZE || len > sizeof buf ||
+            !get_hex(end + 1, buf, len)) {
+            snprintf(out, sizeof out, "E01");
+            break;
+        }
+        emulator_write_mem(eml, addr, buf, len);
+        snprintf(out, sizeof out, "OK");
+        break;
+    case 'c':
+        if (p[1]) {
+            eml->cpu.PC = strtoul(p + 1, NULL, 16) & (MEM_SIZE - 1);
+        }
+        debug_resume(eml);
+        g->running = true;
+        return;                         /* the reply comes with the stop */
+    case 's':
+        if (p[1]) {
+            eml->cpu.PC = strtoul(p + 1, NULL, 16) & (MEM_SIZE - 1);
+        }
+        reply_stop(g, eml, debug_step_watched(eml));
+        return;
+    case 'Z':
+    case 'z':
+        snprintf(out, sizeof out, "%s", set_point(eml, p + 1, p[0] == 'Z'));
+        break;
+    case 'k':
+        g->kill = true;
+        drop_client(g);
+        return;
+    case 'D':
+        send_packet(g, "OK");
+        drop_client(g);
+        return;
+    case 'H':
+    case 'T':
+        snprintf(out, sizeof out, "OK");
+        break;
+    case 'q':
+        if (strncmp(p, "qSupported", 10) == 0) {
+            snprintf(out, sizeof out, "PacketSize=%x;QStartNoAckMode+", GDB_PACKET);
+        } else if (strcmp(p, "qAttached") == 0) {
+            snprintf(out, sizeof out, "1");
+        } else if (strcmp(p, "qC") == 0) {
+            snprintf(out, sizeof out, "QC1");
+        } else if (strcmp(p, "qfThreadInfo") == 0) {
+            snprintf(out, sizeof out, "m1");
+        } else if (strcmp(p, "qsThreadInfo") == 0) {
+            snprintf(out, sizeof out, "l");
+        } else if (strncmp(p, "qSymbol", 7) == 0) {
+            snprintf(out, sizeof out, "OK");
+        }
+        break;
+    case 'Q':
+        if (strcmp(p, "QStartNoAckMode") == 0) {
+            send_packet(g, "OK");
+            g->no_ack = true;
+            return;
+        }
+        break;
+    }
+    send_packet(g, out);
+}
+
+/* Handle the complete packets and interrupts received so far */
+static void handle_input(struct gdb_stub *g, struct emulator *eml) {
+    size_t i = 0;
+    while (i < g->in_len && g->fd >= 0) {
+        char c = g->in[i];
+        if (c == 0x03) {
+            /* interrupt */
+            if (g->running) {
+                g->running = false;
+                send_packet(g, "S02");
+            }
+            i++;
+            continue;
+        }
+        if (c != '$') {
+            /* acks, and anything between packets */
+            i++;
+            continue;
+        }
+        char *hash = memchr(g->in + i, '#', g->in_len - i);
+        if (!hash || (size_t) (hash - g->in) + 3 > g->in_len) {
+            break;                      /* incomplete */
+        }
+        *hash = '\0';
+        char *p = g->in + i + 1;
+        uint8_t sum = 0;
+        for (char *s = p; *s; s++) {
+            sum += (uint8_t) *s;
+        }
+        uint8_t want;
+        bool ok = get_hex(hash + 1, &want, 1) && want == sum;
+        i = hash - g->in + 3;
+        if (!g->no_ack) {
+            send_raw(g, ok ? "+" : "-", 1);
+        }
+        if (ok) {
+            handle_packet(g, eml, p);
+        }
+    }
+    if (g->fd < 0) {
+        return;
+    }
+    if (i == 0 && g->in_len == sizeof g->in) {
+        i = g->in_len;                  /* no packet fits, drop it */
+    }
+    memmove(g->in, g->in + i, g->in_len - i);
+    g->in_len -= i;
+}
+
+/* Listen on localhost:port, NULL (with a message) on failure */
+struct gdb_stub *gdb_open(int port) {
+    struct gdb_stub *g = calloc(1, sizeof *g);
+    if (!g) {
+        return NULL;
+    }
+    g->fd = -1;
+    g->running = true;
+    g->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (g->listen_fd < 0 ||
+        setsockopt(g->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) != 0 ||
+        bind(g->listen_fd, (struct sockaddr *) &sa, sizeof sa) != 0 ||
+        listen(g->listen_fd, 1) != 0 ||
+        fcntl(g->listen_fd, F_SETFL, O_NONBLOCK) != 0) {
+        fprintf(stderr, "Unable to listen on port %d: %s\n", port, strerror(errno));
+        if (g->listen_fd >= 0) {
+            close(g->listen_fd);
+        }
+        free(g);
+        return NULL;
+    }
+    return g;
+}
+
+void gdb_close(struct gdb_stub *g) {
+    if (g->fd >= 0) {
+        close(g->fd);
+    }
+    close(g->listen_fd);
+    free(g);
+}
+
+/*
+ * Accept a client and serve what it sent. Returns whether the emulator
+ * may run: always without a client, after continue with one.
+ */
+bool gdb_poll(struct gdb_stub *g, struct emulator *eml) {
+    if (g->fd < 0) {
+        int fd = accept(g->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            return true;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        g->fd = fd;
+        g->running = false;
+        g->no_ack = false;
+        g->in_len = 0;
+    }
+    for (;;) {
+        ssize_t n = recv(g->fd, g->in + g->in_len, sizeof g->in - g->in_len,
+                         MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            drop_client(g);
+            break;
+        }
+        g->in_len += n;
+        handle_input(g, eml);
+        if (g->fd < 0) {
+            break;
+        }
+    }
+    return g->fd < 0 || g->running;
+}
+
+bool gdb_attached(const struct gdb_stub *g) {
+    return g->fd >= 0;
+}
+
+/*
+ * The emulator stopped with status, report it if a client let it run.
+ * It stops before a watched access; GDB expects watchpoints reported
+ * after it, so that instruction runs first.
+ */
+void gdb_stopped(struct gdb_stub *g, struct emulator *eml,
+                 enum eml_stat status) {
+    if (g->fd >= 0 && g->running) {
+        g->running = false;
+        if (status == EML_BRK_REACHED &&
+            (eml->debug->reason == DEBUG_STOP_READ ||
+             eml->debug->reason == DEBUG_STOP_WRITE)) {
+            status = debug_step_watched(eml);
+        }
+        reply_stop(g, eml, status);
+    }
+}
@@ -0,0 +1,45 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __GDB_H
+#define __GDB_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/* Largest packet, in and out */
+#define GDB_PACKET 1024
+
+/*
+ * GDB remote protocol stub on a TCP port of localhost. It serves one
+ * client at a time, with the emulator's debugger (eml->debug) for its
+ * breakpoints and watchpoints.
+ *
+ * Registers, as in g packets (all little endian): V0 to VF (0-15, 8 bit),
+ * I (16), PC (17, 16 bit), SP (18), DT (19), ST (20, 8 bit). Addresses
+ * are Chip8 addresses.
+ */
+struct gdb_stub {
+    int listen_fd;
+    int fd;                             /* Client connection, -1: none */
+    bool running;                       /* The client let the emulator run */
+    bool no_ack;                        /* Client turned acknowledgments off */
+    bool kill;                          /* Client asked to end the emulator */
+    char in[GDB_PACKET * 2];            /* Received, not yet handled */
+    size_t in_len;
+};
+
+/* Stub functions */
+struct gdb_stub *gdb_open(int port);
+void gdb_close(struct gdb_stub *g);
+bool gdb_poll(struct gdb_stub *g, struct emulator *eml);
+bool gdb_attached(const struct gdb_stub *g);
+void gdb_stopped(struct gdb_stub *g, struct emulator *eml,
+                 enum eml_stat status);
+
+#endif
@@ -0,0 +1,229 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Input recordings. A run is reproduced by its rom, seed, clock speed,
+ * quirks and the key events at their cycle positions; replaying those
+ * needs no keyboard and no real time, and ends with the state hash of the
+ * recorded run for comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "input.h"
+
+/* Largest encoded event: 10 varint bytes and the key byte */
+#define EVENT_MAX 11
+
+/* Start recording a run of rom, right after it was loaded into eml */
+struct input_recorder *input_record_start(const struct emulator *eml,
+                                          const struct rom_image *rom,
+                                          uint32_t seed) {
+    struct input_recorder *r = calloc(1, sizeof *r);
+    if (!r) {
+        return NULL;
+    }
+    memcpy(r->hdr.magic, INPUT_MAGIC, sizeof r->hdr.magic);
+    r->hdr.rom_hash = rom->hash;
+    r->hdr.seed = seed;
+    r->hdr.clock_speed = eml->clock_speed;
+    r->hdr.quirks = eml->quirks;
+    snprintf(r->hdr.rom_file, sizeof r->hdr.rom_file, "%s", rom->path);
+    return r;
+}
+
+/* Record a key event the emulator just got */
+void input_record_key(struct input_recorder *r, const struct emulator *eml,
+                      enum chip8_key key, bool down) {
+    if (key > C8K_F) {
+        return;
+    }
+    /* events after the position were undone, by a rewind */
+    while (r->n && r->ev[r->n - 1].cycles > eml->cycles) {
+        r->n--;
+    }
+    if (r->n == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 1024;
+        struct input_event *ev = realloc(r->ev, cap * sizeof *ev);
+        if (!ev) {
+            return;
+        }
+        r->ev = ev;
+        r->cap = cap;
+    }
+    r->ev[r->n++] = (struct input_event) { eml->cycles, key, down };
+}
+
+/*
+ * Forget the events at or after the position of eml, which was rewound
+ * to a state from before them.
+ */
+void input_record_rewind(struct input_recorder *r, const struct emulator *eml) {
+    while (r->n && r->ev[r->n - 1].cycles >= eml->cycles) {
+        r->n--;
+    }
+}
+
+/* End the recording at the state of eml and write it, false on failure */
+bool input_record_finish(struct input_recorder *r, const struct emulator *eml,
+                         const char *path) {
+    r->hdr.end_cycles = eml->cycles;
+    r->hdr.final_hash = emulator_hash(eml);
+    r->hdr.events = r->n;
+
+    bool ok = false;
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        ok = fwrite(&r->hdr, sizeof r->hdr, 1, f) == 1;
+        uint64_t prev = 0;
+        for (size_t i = 0; i < r->n && ok; i++) {
+            uint8_t buf[EVENT_MAX];
+            int len = 0;
+            uint64_t delta = r->ev[i].cycles - prev;
+            do {
+                buf[len++] = (delta & 0x7F) | (delta > 0x7F) << 7;
+                delta >>= 7;
+            } while (delta);
+            buf[len++] = r->ev[i].key | r->ev[i].down << 4;
+            ok = fwrite(buf, len, 1, f) == 1;
+            prev = r->ev[i].cycles;
+        }
+        ok &= fclose(f) == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "Unable to write file %s\n", path);
+    }
+    free(r->ev);
+    free(r);
+    return ok;
+}
+
+/* Read a recording, NULL (with a message) if it can't be used */
+struct input_replay *input_replay_open(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Unable to read file %s\n", path);
+        return NULL;
+    }
+    struct input_replay *p = calloc(1, sizeof *p);
+    if (!p) {
+        fclose(f);
+        return NULL;
+    }
+    if (fread(&p->hdr, sizeof p->hdr, 1, f) != 1 ||
+        memcmp(p->hdr.magic, INPUT_MAGIC, sizeof p->hdr.magic) != 0) {
+        fprintf(stderr, "%s is no input recording\n", path);
+        goto fail;
+    }
+    if (p->hdr.quirks >= QUIRKS_COUNT || p->hdr.clock_speed <= 0) {
+        fprintf(stderr, "%s has an invalid header\n", path);
+        goto fail;
+    }
+    p->hdr.rom_file[sizeof p->hdr.rom_file - 1] = '\0';
+    p->ev = malloc((p->hdr.events ? p->hdr.events : 1) * sizeof *p->ev);
+    if (!p->ev) {
+        goto fail;
+    }
+    uint64_t cycles = 0;
+    for (p->n = 0; p->n < p->hdr.events; p->n++) {
+        uint64_t delta = 0;
+        int c;
+        for (int shift = 0; (c = getc(f)) != EOF; shift += 7) {
+            delta |= (uint64_t) (c & 0x7F) << shift;
+            if (!(c & 0x80) || shift > 63) {
+                break;
+            }
+        }
+        int key = getc(f);
+        if (c == EOF || key == EOF) {
+            fprintf(stderr, "%s is truncated\n", path);
+            goto fail;
+        }
+        cycles += delta;
+        p->ev[p->n] = (struct input_event) { cycles, key & 0xF, key >> 4 & 1 };
+    }
+    fclose(f);
+    return p;
+
+fail:
+    fclose(f);
+    free(p->ev);
+    free(p);
+    return NULL;
+}
+
+void input_replay_close(struct input_replay *p) {
+    free(p->ev);
+    free(p);
+}
+
+/*
+ * Give a fresh emulator the settings of the recorded run. Loading the rom
+ * comes after, instructions are decoded to the quirks.
+ */
+void input_replay_setup(const struct input_replay *p, struct emulator *eml) {
+    eml->clock_speed = p->hdr.clock_speed;
+    eml->quirks = p->hdr.quirks;
+    emulator_seed(eml, p->hdr.seed);
+}
+
+/* Continue with the events from the position of eml, after a restore */
+void input_replay_seek(struct input_replay *p, const struct emulator *eml) {
+    p->next = 0;
+    while (p->next < p->n && p->ev[p->next].cycles < eml->cycles) {
+        p->next++;
+    }
+}
+
+/* Apply the events that are due at the position of eml */
+static void apply_due(struct input_replay *p, struct emulator *eml) {
+    for (; p->next < p->n && p->ev[p->next].cycles <= eml->cycles; p->next++) {
+        const struct input_event *e = &p->ev[p->next];
+        if (e->down) {
+            emulator_key_down(eml, e->key);
+        } else {
+            emulator_key_up(eml, e->key);
+        }
+    }
+}
+
+/*
+ * Run a frame like emulator_frame, with the recorded events applied at
+ * their exact cycles. The run is split at each event.
+ */
+enum eml_stat input_replay_frame(struct input_replay *p, struct emulator *eml) {
+    eml->cycle_frac += eml->clock_speed;
+    int n = eml->cycle_frac / 60;
+    eml->cycle_frac %= 60;
+
+    enum eml_stat status = EML_OK;
+    for (;;) {
+        apply_due(p, eml);
+        int len = n;
+        if (p->next < p->n && p->ev[p->next].cycles - eml->cycles < (uint64_t) n) {
+            len = p->ev[p->next].cycles - eml->cycles;
+        }
+        enum eml_stat s = emulator_run(eml, len);
+        if (s == EML_REDRAW) {
+            status = EML_REDRAW;
+        } else if (s != EML_OK) {
+            return s;
+        }
+        n -= len;
+        if (n == 0) {
+            break;
+        }
+    }
+    emulator_timer_dec(eml);
+    return status;
+}
+
+/* Whether eml reached the end of the recording */
+bool input_replay_done(const struct input_replay *p, const struct emulator *eml) {
+    return eml->cycles >= p->hdr.end_cycles;
+}
@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __INPUT_H
+#define __INPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+#include "rom.h"
+
+/*
+ * Input recording: struct input_hdr, then one event per key press or
+ * release: the cycles since the previous event (from 0) as a LEB128
+ * varint and a byte with the key in bits 0-3 and bit 4 set for a press.
+ * Header fields are in host byte order.
+ */
+#define INPUT_MAGIC "C8INPUT1"
+
+struct input_hdr {
+    char magic[8];                      /* INPUT_MAGIC */
+    uint64_t rom_hash;                  /* FNV-1a of the rom (rom_hash) */
+    uint64_t end_cycles;                /* Position the recording ends at */
+    uint64_t final_hash;                /* emulator_hash at the end */
+    uint32_t seed;                      /* Random generator seed */
+    int32_t clock_speed;                /* Clock speed in Hz */
+    uint32_t quirks;                    /* enum eml_quirks */
+    uint32_t events;                    /* Number of events */
+    char rom_file[256];                 /* Rom as it was loaded */
+};
+
+/* A key press or release at a cycle position (struct emulator cycles) */
+struct input_event {
+    uint64_t cycles;
+    uint8_t key;
+    bool down;
+};
+
+/* Events of a run being recorded, written out when it ends */
+struct input_recorder {
+    struct input_hdr hdr;
+    struct input_event *ev;
+    size_t n;
+    size_t cap;
+};
+
+/* A recording being played back */
+struct input_replay {
+    struct input_hdr hdr;
+    struct input_event *ev;
+    size_t n;
+    size_t next;                        /* First event not applied yet */
+};
+
+/* Recorder functions */
+struct input_recorder *input_record_start(const struct emulator *eml,
+                                          const struct rom_image *rom,
+                                          uint32_t seed);
+void input_record_key(struct input_recorder *r, const struct emulator *eml,
+                      enum chip8_key key, bool down);
+void input_record_rewind(struct input_recorder *r, const struct emulator *eml);
+bool input_record_finish(struct input_recorder *r, const struct emulator *eml,
+                         const char *path);
+
+/* Replay functions */
+struct input_replay *input_replay_open(const char *path);
+void input_replay_close(struct input_replay *p);
+void input_replay_setup(const struct input_replay *p, struct emulator *eml);
+void input_replay_seek(struct input_replay *p, const struct emulator *eml);
+enum eml_stat input_replay_frame(struct input_replay *p, struct emulator *eml);
+bool input_replay_done(const struct input_replay *p, const struct emulator *eml);
+
+#endif
@@ -12,11 +12,26 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <time.h>
+#include <errno.h>
 #include <getopt.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 
 #include "chip8.h"
+#include "rewind.h"
+#include "trace.h"
+#include "rom.h"
+#include "shm.h"
+#include "input.h"
+#include "video.h"
+#include "debug.h"
+#include "gdb.h"
+#include "analysis.h"
+#include "beeper.h"
+#ifdef CHIP8_PROFILE
+#include <signal.h>
+#include "profile.h"
+#endif
 
 /* SDL constants */
 #define SDL_WIN_W 640
@@ -24,6 +39,17 @@
 #define OVERLAY_ALPHA 190
 #define OVERLAY_FONTSIZE 25
 
+/* Audio output, the rate may be changed by the device */
+#define AUDIO_RATE 44100
+#define AUDIO_SAMPLES 512
+
+/* Interval the measured speed in the overlay is averaged over */
+#define STATS_INTERVAL_NS 1000000000LL
+
+/* Rewind history: up to ten minutes of frames in 16 MiB of deltas */
+#define REWIND_FRAMES (60 * 60 * 10)
+#define REWIND_BYTES (16 << 20)
+
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
@@ -32,17 +58,66 @@ static struct emulator eml;
 static SDL_Window *window;
 static SDL_Renderer *renderer;
 static TTF_Font *ttf_sans;
-static SDL_Surface *ttf_eml_name;
-static SDL_Surface *ttf_rom_name;
-static SDL_Surface *ttf_clk_speed;
-static SDL_Texture *tex_eml_name;
-static SDL_Texture *tex_rom_name;
-static SDL_Texture *tex_clk_speed;
-static SDL_Rect r_eml;
-static SDL_Rect r_rom;
-static SDL_Rect r_clk;
+static SDL_Texture *tex_display;
 static SDL_Rect r_box;
 static bool overlay_enabled = false;
+static struct rewind_ring *rewind_ring;
+static bool vsync = false;
+static bool turbo = false;
+static char *trace_file;
+static bool rewinding = false;
+static char *shm_name;
+static bool shm_stepped = false;
+static struct shm_channel *shm;
+static char *record_file;
+static char *replay_file;
+static struct input_recorder *recorder;
+static struct input_replay *replay;
+static char *video_file;
+static struct video *video;
+static uint64_t video_frames = 0;       /* Frames shown, including rewound ones */
+static struct gdb_stub *gdb;
+static bool sound = true;
+static SDL_AudioDeviceID audio_dev;
+static struct beeper *beeper;
+
+/* How the display is brought into tex_display */
+enum render_mode {
+    RENDER_RECT,                        /* Fill rects into a target texture */
+    RENDER_STREAM                       /* Upload pixels to a streaming texture */
+};
+static enum render_mode render_mode = RENDER_RECT;
+
+/* A line of overlay text, rasterized again only when its text changes */
+struct overlay_line {
+    char text[128];                     /* Text the texture shows */
+    SDL_Texture *tex;
+    SDL_Rect r;                         /* Position on the window */
+};
+
+enum overlay_lines {
+    LINE_EML,                           /* Name and run state */
+    LINE_ROM,
+    LINE_CLK,
+    LINE_STATS,                         /* Measured speed */
+    OVERLAY_LINES
+};
+
+static struct overlay_line overlay[OVERLAY_LINES];
+
+/* Measured speed, updated every STATS_INTERVAL_NS */
+struct speed_stats {
+    int64_t start;                      /* Start of the interval */
+    uint64_t cycles;                    /* Instructions run in the interval */
+    int frames;                         /* Frames run in the interval */
+    int64_t busy_ns;                    /* Time spent running them */
+    bool valid;                         /* An interval was measured */
+    double hz;                          /* Instructions per second */
+    double fps;                         /* Frames per second */
+    double frame_ms;                    /* Mean time to run a frame */
+};
+
+static struct speed_stats stats;
 
 /* Map SDL_Keycode -> Chip8 Keypad */
 static uint8_t sdlk_to_c8k(SDL_Keycode key) {
@@ -59,110 +134,382 @@ static uint8_t sdlk_to_c8k(SDL_Keycode key) {
     }
 }
 
-/* Set a key on the keypad as pressed */
+/* Set a key on the keypad as pressed, replays take no keyboard input */
 static void keypad_pressed(struct emulator *eml, SDL_Keycode key) {
-    eml->keypad |= 1 << (sdlk_to_c8k(key));
-    if (eml->key_waiting) {
-        eml->last_key = sdlk_to_c8k(key);
-        eml->key_waiting = false;
+    if (replay) {
+        return;
+    }
+    emulator_key_down(eml, sdlk_to_c8k(key));
+    if (recorder) {
+        input_record_key(recorder, eml, sdlk_to_c8k(key), true);
     }
 }
 
 /* Set a key on the keypad as released */
 static void keypad_released(struct emulator *eml, SDL_Keycode key) {
-    eml->keypad ^= 1 << (sdlk_to_c8k(key));
+    if (replay) {
+        return;
+    }
+    emulator_key_up(eml, sdlk_to_c8k(key));
+    if (recorder) {
+        input_record_key(recorder, eml, sdlk_to_c8k(key), false);
+    }
+}
+
+/* Set the text of an overlay line, rebuilding its texture if it changed */
+static void overlay_set(struct overlay_line *l, const char *text) {
+    static SDL_Color fg = {255, 255, 255, 255};
+
+    if (l->tex && strcmp(l->text, text) == 0) {
+        return;
+    }
+    SDL_Surface *surface = TTF_RenderText_Blended(ttf_sans, text, fg);
+    if (!surface) {
+        return;
+    }
+    SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surface);
+    l->r.w = surface->w;
+    l->r.h = surface->h;
+    SDL_FreeSurface(surface);
+    if (!tex) {
+        return;
+    }
+    SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+    SDL_SetTextureAlphaMod(tex, OVERLAY_ALPHA);
+
+    SDL_DestroyTexture(l->tex);
+    l->tex = tex;
+    snprintf(l->text, sizeof l->text, "%s", text);
 }
 
 /* update the overlay textures */
 void update_overlay() {
-    static SDL_Color fg = {255, 255, 255, 255};
+    char text[128];
 
-    /* overlay text */
-    char eml_name[128] = {0};
-    char rom_name[128] = {0};
-    char clk_speed[128] = {0};
-
-    snprintf((char *) &eml_name, 128, "Chip8%s", eml.paused ? " (paused)" : "");
-    snprintf((char *) &rom_name, 128, "Rom: %s", eml.rom_file);
-    snprintf((char *) &clk_speed, 128, "Clock speed: %d Hz", eml.clock_speed);
-    eml_name[127] = '\0';
-    rom_name[127] = '\0';
-    clk_speed[127] = '\0';
-
-    ttf_eml_name = TTF_RenderText_Blended(ttf_sans, eml_name, fg);
-    ttf_rom_name = TTF_RenderText_Blended(ttf_sans, rom_name, fg);
-    ttf_clk_speed = TTF_RenderText_Blended(ttf_sans, clk_speed, fg);
-
-    tex_eml_name = SDL_CreateTextureFromSurface(renderer, ttf_eml_name);
-    tex_rom_name = SDL_CreateTextureFromSurface(renderer, ttf_rom_name);
-    tex_clk_speed = SDL_CreateTextureFromSurface(renderer, ttf_clk_speed);
-
-    r_eml.x = 10;
-    r_eml.y = 5;
-    r_eml.w = ttf_eml_name->w;
-    r_eml.h = ttf_eml_name->h;
-
-    r_rom.x = 10;
-    r_rom.y = r_eml.h + 5;
-    r_rom.w = ttf_rom_name->w;
-    r_rom.h = ttf_rom_name->h;
-
-    r_clk.x = 10;
-    r_clk.y = r_eml.h + r_rom.h + 5;
-    r_clk.w = ttf_clk_speed->w;
-    r_clk.h = ttf_clk_speed->h;
-
-    SDL_SetTextureBlendMode(tex_eml_name, SDL_BLENDMODE_BLEND);
-    SDL_SetTextureBlendMode(tex_rom_name, SDL_BLENDMODE_BLEND);
-    SDL_SetTextureBlendMode(tex_clk_speed, SDL_BLENDMODE_BLEND);
-
-    SDL_SetTextureAlphaMod(tex_eml_name, OVERLAY_ALPHA);
-    SDL_SetTextureAlphaMod(tex_rom_name, OVERLAY_ALPHA);
-    SDL_SetTextureAlphaMod(tex_clk_speed, OVERLAY_ALPHA);
-
-    /* overlay box */
-    int maxw = MAX(MAX(r_eml.w, r_rom.w), r_clk.w);
-    int sumh = r_eml.h + r_rom.h + r_clk.h;
+    snprintf(text, sizeof text, "Chip8%s%s", eml.paused ? " (paused)" : "",
+             turbo ? " (turbo)" : "");
+    overlay_set(&overlay[LINE_EML], text);
+    snprintf(text, sizeof text, "Rom: %s", eml.rom_file);
+    overlay_set(&overlay[LINE_ROM], text);
+    snprintf(text, sizeof text, "Clock speed: %d Hz", eml.clock_speed);
+    overlay_set(&overlay[LINE_CLK], text);
+    if (stats.valid) {
+        snprintf(text, sizeof text, "Speed: %.0f Hz, %.1f fps, %.2f ms/frame",
+                 stats.hz, stats.fps, stats.frame_ms);
+    } else {
+        snprintf(text, sizeof text, "Speed: -");
+    }
+    overlay_set(&overlay[LINE_STATS], text);
+
+    /* lines top to bottom, the box around them */
+    int y = 5;
+    int maxw = 0;
+    for (int i = 0; i < OVERLAY_LINES; i++) {
+        overlay[i].r.x = 10;
+        overlay[i].r.y = y;
+        y += overlay[i].r.h;
+        maxw = MAX(maxw, overlay[i].r.w);
+    }
     r_box.x = 0;
     r_box.y = 0;
     r_box.w = maxw + 20;
-    r_box.h = sumh + 10;
+    r_box.h = y + 5;
+}
+
+/* Pixel (x, y) of the display in its current mode */
+static bool display_pixel(int x, int y) {
+    if (eml.cpu.hires) {
+        uint64_t w = eml.cpu.display[2 * y + x / 64];
+        return (w >> (63 - x % 64)) & 1;
+    }
+    return (eml.cpu.display[y] >> (DISP_W - 1 - x)) & 1;
+}
+
+/*
+ * Render the dirty rows of the display into tex_display. Every changed row
+ * is cleared and its runs of lit pixels are filled, batched into one draw
+ * call each. Untouched rows keep their pixels from the previous frames.
+ */
+static void display_update_rect() {
+    static SDL_Rect clear[DISP_HI_H];
+    static SDL_Rect lit[DISP_HI_H * DISP_HI_W / 2];
+    int clear_n = 0;
+    int lit_n = 0;
+    int w = eml.cpu.hires ? DISP_HI_W : DISP_W;
+    int h = eml.cpu.hires ? DISP_HI_H : DISP_H;
+
+    for (int i = 0; i < h; i++) {
+        if (!(eml.dirty_rows & (1ULL << i))) {
+            continue;
+        }
+        clear[clear_n++] = (SDL_Rect) { 0, i, w, 1 };
+
+        int j = 0;
+        while (j < w) {
+            if (!display_pixel(j, i)) {
+                j++;
+                continue;
+            }
+            int start = j;
+            while (j < w && display_pixel(j, i)) {
+                j++;
+            }
+            lit[lit_n++] = (SDL_Rect) { start, i, j - start, 1 };
+        }
+    }
+    eml.dirty_rows = 0;
+
+    SDL_SetRenderTarget(renderer, tex_display);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderFillRects(renderer, clear, clear_n);
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_RenderFillRects(renderer, lit, lit_n);
+    SDL_SetRenderTarget(renderer, NULL);
+}
+
+/*
+ * Expand the dirty rows of the display to ARGB pixels and upload them to
+ * the streaming tex_display. The expansion is a branch-free mask per pixel
+ * that the compiler vectorizes; the rows from the first to the last dirty
+ * one go up in a single SDL_UpdateTexture.
+ */
+static void display_update_stream() {
+    static uint32_t pixels[DISP_HI_H][DISP_HI_W];
+    int words = eml.cpu.hires ? 2 : 1;
+    int h = eml.cpu.hires ? DISP_HI_H : DISP_H;
+    uint64_t dirty = eml.dirty_rows & (h == 64 ? ~0ULL : (1ULL << h) - 1);
+    eml.dirty_rows = 0;
+    if (!dirty) {
+        return;
+    }
+
+    int first = __builtin_ctzll(dirty);
+    int last = 63 - __builtin_clzll(dirty);
+    for (int i = first; i <= last; i++) {
+        for (int k = 0; k < words; k++) {
+            uint64_t row = eml.cpu.display[i * words + k];
+            for (int j = 0; j < 64; j++) {
+                uint32_t lit = -(uint32_t) ((row >> (63 - j)) & 1);
+                pixels[i][k * 64 + j] = 0xFF000000 | (lit & 0x00FFFFFF);
+            }
+        }
+    }
+
+    SDL_Rect r = { 0, first, words * 64, last - first + 1 };
+    SDL_UpdateTexture(tex_display, &r, pixels[first], sizeof pixels[0]);
 }
 
 void display_redraw() {
     int32_t win_width;
     int32_t win_height;
     SDL_GetWindowSize(window, &win_width, &win_height);
-    int32_t grid_w = win_width / DISP_W;
-    int32_t grid_h = win_height / DISP_H;
+    int32_t disp_w = eml.cpu.hires ? DISP_HI_W : DISP_W;
+    int32_t disp_h = eml.cpu.hires ? DISP_HI_H : DISP_H;
+    int32_t grid_w = win_width / disp_w;
+    int32_t grid_h = win_height / disp_h;
+
+    if (eml.dirty_rows && render_mode == RENDER_STREAM) {
+        display_update_stream();
+    } else if (eml.dirty_rows) {
+        display_update_rect();
+    }
 
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
     SDL_RenderClear(renderer);
 
-    for (int i = 0; i < DISP_H; i++) {
-        for (int j = 0; j < DISP_W; j++) {
-            if (eml.cpu.display[i*DISP_W + j] == 1)
-                SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-            else
-                SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-            SDL_Rect r = { j*grid_w, i*grid_h, grid_w, grid_h };
-            SDL_RenderFillRect(renderer, &r);
-        }
-    }
+    /* the current mode uses the top left of the texture */
+    SDL_Rect src = { 0, 0, disp_w, disp_h };
+    SDL_Rect r = { 0, 0, grid_w * disp_w, grid_h * disp_h };
+    SDL_RenderCopy(renderer, tex_display, &src, &r);
 
     if (overlay_enabled) {
         SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
         SDL_SetRenderDrawColor(renderer, 94, 94, 94, OVERLAY_ALPHA);
         SDL_RenderFillRect(renderer, &r_box);
 
-        SDL_RenderCopy(renderer, tex_eml_name, NULL, &r_eml);
-        SDL_RenderCopy(renderer, tex_rom_name, NULL, &r_rom);
-        SDL_RenderCopy(renderer, tex_clk_speed, NULL, &r_clk);
+        for (int i = 0; i < OVERLAY_LINES; i++) {
+            SDL_RenderCopy(renderer, overlay[i].tex, NULL, &overlay[i].r);
+        }
     }
 
     SDL_RenderPresent(renderer);
 }
 
+#ifdef CHIP8_PROFILE
+static volatile sig_atomic_t profile_requested = 0;
+static char *profile_file;
+
+static void profile_signal(int sig) {
+    (void) sig;
+    profile_requested = 1;
+}
+
+/* Print the profile tables, and the folded call stacks if requested */
+static void profile_write() {
+    profile_dump(eml.profile, stderr);
+    if (profile_file) {
+        FILE *f = fopen(profile_file, "w");
+        if (!f) {
+            fprintf(stderr, "Unable to write file %s\n", profile_file);
+            return;
+        }
+        profile_dump_folded(eml.profile, f);
+        fclose(f);
+    }
+}
+#endif
+
+/* Monotonic time in ns */
+static int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* End the stats interval if it is over, true when the numbers changed */
+static bool stats_update(int64_t now) {
+    int64_t dt = now - stats.start;
+    if (dt < STATS_INTERVAL_NS) {
+        return false;
+    }
+    stats.hz = stats.cycles * 1e9 / dt;
+    stats.fps = stats.frames * 1e9 / dt;
+    stats.frame_ms = stats.frames ? stats.busy_ns / 1e6 / stats.frames : 0;
+    stats.valid = true;
+
+    stats.start = now;
+    stats.cycles = 0;
+    stats.frames = 0;
+    stats.busy_ns = 0;
+    return true;
+}
+
+/* The debugger of eml, created on first use */
+static struct debugger *need_debugger() {
+    if (!eml.debug) {
+        eml.debug = debug_create();
+        if (!eml.debug) {
+            fprintf(stderr, "Unable to allocate the debugger\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return eml.debug;
+}
+
+/* Set a breakpoint from -b addr[:cond] */
+static bool add_break(const char *arg) {
+    char *end;
+    long addr = strtol(arg, &end, 0);
+    struct debug_cond cond;
+    bool has_cond = *end == ':';
+    if (end == arg || addr < 0 || addr >= MEM_SIZE || (*end && !has_cond) ||
+        (has_cond && !debug_parse_cond(end + 1, &cond))) {
+        fprintf(stderr, "Invalid breakpoint: %s\n", arg);
+        return false;
+    }
+    need_debugger();
+    if (!debug_break(&eml, addr, has_cond ? &cond : NULL)) {
+        fprintf(stderr, "Too many breakpoints (at most %d)\n", DEBUG_MAX_BRK);
+        return false;
+    }
+    return true;
+}
+
+/* Set a watchpoint from -w addr[,len][:r|w|rw] */
+static bool add_watch(const char *arg) {
+    char *end;
+    long addr = strtol(arg, &end, 0);
+    long len = 1;
+    int kinds = DEBUG_WATCH_WRITE;
+    if (end != arg && *end == ',') {
+        len = strtol(end + 1, &end, 0);
+    }
+    if (*end == ':') {
+        if (strcmp(end + 1, "r") == 0) {
+            kinds = DEBUG_WATCH_READ;
+        } else if (strcmp(end + 1, "w") == 0) {
+            kinds = DEBUG_WATCH_WRITE;
+        } else if (strcmp(end + 1, "rw") == 0) {
+            kinds = DEBUG_WATCH_READ | DEBUG_WATCH_WRITE;
+        } else {
+            end = (char *) arg;
+        }
+    } else if (*end) {
+        end = (char *) arg;
+    }
+    if (end == arg || addr < 0 || addr >= MEM_SIZE || len < 1 || len > MEM_SIZE) {
+        fprintf(stderr, "Invalid watchpoint: %s\n", arg);
+        return false;
+    }
+    need_debugger();
+    debug_watch(&eml, addr, len, kinds);
+    return true;
+}
+
+/* Print why the debugger stopped and the instruction at PC */
+static void debug_report() {
+    uint16_t pc = eml.cpu.PC;
+    uint16_t opcode = eml.cpu.memory[pc] << 8 | eml.cpu.memory[(pc + 1) % MEM_SIZE];
+    char text[32];
+    if (!rom_disasm(opcode, text, sizeof text)) {
+        snprintf(text, sizeof text, "0x%04X", opcode);
+    }
+    enum debug_reason reason = eml.debug ? eml.debug->reason : DEBUG_STOP_NONE;
+    uint16_t addr = eml.debug ? eml.debug->stop_addr : 0;
+    switch (reason) {
+    case DEBUG_STOP_BREAK:
+        fprintf(stdout, "Breakpoint at 0x%03X: %s\n", pc, text);
+        break;
+    case DEBUG_STOP_READ:
+        fprintf(stdout, "Watchpoint: read of 0x%03X at 0x%03X: %s\n", addr, pc, text);
+        break;
+    case DEBUG_STOP_WRITE:
+        fprintf(stdout, "Watchpoint: write of 0x%03X at 0x%03X: %s\n", addr, pc, text);
+        break;
+    case DEBUG_STOP_NONE:
+        fprintf(stdout, "Step to 0x%03X: %s\n", pc, text);
+        break;
+    }
+}
+
+/* Report a fault or breakpoint, return true when we should terminate */
+static bool check_status(enum eml_stat status) {
+    /* an attached debugger client gets to look at every stop but the exit */
+    if (gdb && gdb_attached(gdb) && status != EML_OK && status != EML_REDRAW) {
+        gdb_stopped(gdb, &eml, status);
+        return status == EML_EXIT;
+    }
+    switch (status) {
+    case EML_UNK_OPC:
+        fprintf(stderr, "Fault: Invalid opcode at PC=%u: 0x%04X\n",
+                eml.prev_PC, eml.opcode);
+        return true;
+    case EML_STACK_OVERFL:
+        fprintf(stderr, "Fault: Stack overflow at PC=%u\n", eml.prev_PC);
+        return true;
+    case EML_STACK_UNDERFL:
+        fprintf(stderr,
+                "Fault: Trying to pop from empty stack at PC=%u\n",
+                eml.cpu.PC);
+        return true;
+    case EML_EXIT:
+        fprintf(stdout, "Program exited\n");
+        return true;
+    case EML_BRK_REACHED:
+        /* pause at the stop, p continues and n steps */
+        debug_report();
+        emulator_dump(&eml);
+        eml.paused = true;
+        overlay_enabled = true;
+        update_overlay();
+        display_redraw();
+        return false;
+    default:
+        return false;
+    }
+}
+
 /* return true when we should terminate */
 static bool event_handler(SDL_Event *event) {
     switch (event->type) {
@@ -174,6 +521,11 @@ static bool event_handler(SDL_Event *event) {
             display_redraw();
         }
         break;
+    case SDL_RENDER_TARGETS_RESET:
+        /* the contents of tex_display are lost, render it from scratch */
+        eml.dirty_rows = ~0ULL;
+        display_redraw();
+        break;
     case SDL_QUIT:
         return true;
     case SDL_KEYDOWN:
@@ -198,12 +550,25 @@ static bool event_handler(SDL_Event *event) {
                 update_overlay();
                 display_redraw();
                 break;
+            case SDLK_BACKSPACE:
+                rewinding = true;
+                break;
+            case SDLK_t:
+                turbo = !turbo;
+                update_overlay();
+                display_redraw();
+                break;
             case SDLK_o:
                 overlay_enabled = !overlay_enabled;
+                update_overlay();
                 display_redraw();
                 break;
             case SDLK_p:
                 eml.paused = !eml.paused;
+                if (!eml.paused && eml.debug) {
+                    /* don't stop again at the breakpoint we're at */
+                    debug_resume(&eml);
+                }
                 if (eml.paused) {
                     overlay_enabled = true;
                 } else {
@@ -212,6 +577,18 @@ static bool event_handler(SDL_Event *event) {
                 update_overlay();
                 display_redraw();
                 break;
+            case SDLK_n:
+                /* single step while paused */
+                if (eml.paused && !(gdb && gdb_attached(gdb))) {
+                    enum eml_stat status = eml.debug ? debug_step(&eml)
+                                                     : emulator_run(&eml, 1);
+                    if (status != EML_OK && status != EML_REDRAW) {
+                        return check_status(status);
+                    }
+                    debug_report();
+                    display_redraw();
+                }
+                break;
         }
         break;
     case SDL_KEYUP:
@@ -222,6 +599,9 @@ static bool event_handler(SDL_Event *event) {
             case SDLK_y: case SDLK_x: case SDLK_c: case SDLK_v:
                 keypad_released(&eml, event->key.keysym.sym);
                 break;
+            case SDLK_BACKSPACE:
+                rewinding = false;
+                break;
         }
         break;
     }
@@ -232,6 +612,7 @@ static int event_filter(void *data, SDL_Event *event) {
     (void) data;
     switch (event->type) {
     case SDL_WINDOWEVENT: case SDL_QUIT: case SDL_KEYDOWN: case SDL_KEYUP:
+    case SDL_RENDER_TARGETS_RESET:
         return 1;
     }
     return 0;
@@ -252,7 +633,15 @@ static bool sdl_setup() {
 		return false;
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    /* render targets are only needed by the rect mode */
+    uint32_t flags = SDL_RENDERER_ACCELERATED;
+    if (vsync) {
+        flags |= SDL_RENDERER_PRESENTVSYNC;
+    }
+    if (render_mode == RENDER_RECT) {
+        flags |= SDL_RENDERER_TARGETTEXTURE;
+    }
+    renderer = SDL_CreateRenderer(window, -1, flags);
     if (!renderer) {
 		fprintf(stdout, "SDL_CreateRenderer error: %s\n", SDL_GetError());
         SDL_DestroyWindow(window);
@@ -260,6 +649,22 @@ static bool sdl_setup() {
         return false;
     }
 
+    /*
+     * The display is kept in a texture big enough for the 128x64 mode and
+     * scaled up when presented.
+     */
+    tex_display = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+            render_mode == RENDER_STREAM ? SDL_TEXTUREACCESS_STREAMING
+                                         : SDL_TEXTUREACCESS_TARGET,
+            DISP_HI_W, DISP_HI_H);
+    if (!tex_display) {
+		fprintf(stdout, "SDL_CreateTexture error: %s\n", SDL_GetError());
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+		SDL_Quit();
+        return false;
+    }
+
     /* SDL_ttf */
     TTF_Init();
     ttf_sans = TTF_OpenFont("Inconsolata-Bold.ttf", OVERLAY_FONTSIZE);
@@ -269,13 +674,53 @@ static bool sdl_setup() {
     return true;
 }
 
+static void audio_callback(void *data, Uint8 *stream, int len) {
+    (void) data;
+    beeper_render(beeper, (int16_t *) stream, len / sizeof(int16_t));
+}
+
+/* Open the audio device for the beeper, without it we run silently */
+static void audio_setup() {
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+        fprintf(stdout, "SDL audio error: %s\n", SDL_GetError());
+        return;
+    }
+    SDL_AudioSpec want, have;
+    SDL_zero(want);
+    want.freq = AUDIO_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = AUDIO_SAMPLES;
+    want.callback = audio_callback;
+    audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+                                    SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (!audio_dev) {
+        fprintf(stdout, "SDL_OpenAudioDevice error: %s\n", SDL_GetError());
+        return;
+    }
+    beeper = beeper_create(have.freq);
+    if (!beeper) {
+        fprintf(stderr, "Unable to allocate the beeper\n");
+        SDL_CloseAudioDevice(audio_dev);
+        return;
+    }
+    eml.beeper = beeper;
+    SDL_PauseAudioDevice(audio_dev, 0);
+}
+
+static void audio_cleanup() {
+    if (beeper) {
+        SDL_CloseAudioDevice(audio_dev);
+        eml.beeper = NULL;
+        beeper_destroy(beeper);
+    }
+}
+
 void sdl_cleanup() {
-    SDL_FreeSurface(ttf_eml_name);
-    SDL_FreeSurface(ttf_rom_name);
-    SDL_FreeSurface(ttf_clk_speed);
-    SDL_DestroyTexture(tex_eml_name);
-    SDL_DestroyTexture(tex_rom_name);
-    SDL_DestroyTexture(tex_clk_speed);
+    for (int i = 0; i < OVERLAY_LINES; i++) {
+        SDL_DestroyTexture(overlay[i].tex);
+    }
+    SDL_DestroyTexture(tex_display);
     TTF_Quit();
     SDL_Quit();
 }
@@ -285,16 +730,50 @@ static void prt_usage() {
         "Usage: chip8 [file]\n\n"
         "  -h           Print this message and exit\n"
         "  -c           Set the clock speed (in Hz, default 1080 Hz)\n"
-        "  -d           Enable debug output\n"
-        "  -b [addr]    Set breakpoint at addr\n";
+        "  -d [file]    Write an instruction trace to file (see chip8-trace)\n"
+        "  -e [engine]  Execution engine: interp, threaded (default)\n"
+        "  -q [quirks]  Quirks profile: default, vip, chip48, schip, or auto\n"
+        "               (guessed from the rom)\n"
+        "  -s [seed]    Random seed (default: from the current time)\n"
+        "  -g [mode]    Rendering: rect (default), stream (pixel upload)\n"
+        "  -T           Start in turbo mode (run as fast as possible)\n"
+        "  -V           Pace frames by the display's vsync (60 Hz displays)\n"
+        "  -a           No sound\n"
+        "  -b [addr]    Stop before the instruction at addr, addr:cond only\n"
+        "               while cond holds (e.g. 0x230:V3==5, 0x2A0:I>=0x300)\n"
+        "  -w [addr]    Stop before accesses through I of addr,len:kind\n"
+        "               (length default 1, kind r, w (default) or rw)\n"
+        "  -G [port]    Serve the GDB remote protocol on localhost:port\n"
+        "  -m [name]    Publish frames to and take keys from the shared\n"
+        "               memory segment /name (see shm.h)\n"
+        "  -M           With -m, only run the frames the controller steps\n"
+        "  -i [file]    Record the key presses to file\n"
+        "  -I [file]    Replay a recording of key presses (seed, clock\n"
+        "               speed and quirks come from it) and check the\n"
+        "               final state\n"
+        "  -r [file]    Record the display to file (see chip8-video)\n"
+#ifdef CHIP8_PROFILE
+        "  -P [file]    Write the profile as folded call stacks to file\n"
+        "               (the tables go to stderr on exit and on SIGUSR1)\n"
+#endif
+        ;
     fprintf(stdout, "%s", usage);
 }
 
 int main(int argc, char **argv) {
     emulator_init(&eml);
+    eml.engine = ENGINE_THREADED;
+    uint32_t seed = time(NULL);
+    bool quirks_auto = false;
+    int gdb_port = 0;
 
     int opt;
-    while ((opt = getopt(argc, argv, "hc:db:")) != -1) {
+#ifdef CHIP8_PROFILE
+    const char *opts = "hc:d:e:q:s:g:TVab:w:G:m:Mi:I:r:P:";
+#else
+    const char *opts = "hc:d:e:q:s:g:TVab:w:G:m:Mi:I:r:";
+#endif
+    while ((opt = getopt(argc, argv, opts)) != -1) {
         switch (opt) {
         case 'h':
             prt_usage();
@@ -304,11 +783,86 @@ int main(int argc, char **argv) {
             eml.clock_speed = atoi(optarg);
             break;
         case 'd':
-            eml.dbg_output = true;
+            trace_file = optarg;
+            break;
+        case 'e':
+            if (strcmp(optarg, "interp") == 0) {
+                eml.engine = ENGINE_INTERP;
+            } else if (strcmp(optarg, "threaded") == 0) {
+                eml.engine = ENGINE_THREADED;
+            } else {
+                fprintf(stderr, "Unknown engine: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            if (strcmp(optarg, "auto") == 0) {
+                quirks_auto = true;
+            } else if (emulator_quirks_parse(optarg) >= 0) {
+                eml.quirks = emulator_quirks_parse(optarg);
+            } else {
+                fprintf(stderr, "Unknown quirks profile: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            if (strcmp(optarg, "rect") == 0) {
+                render_mode = RENDER_RECT;
+            } else if (strcmp(optarg, "stream") == 0) {
+                render_mode = RENDER_STREAM;
+            } else {
+                fprintf(stderr, "Unknown render mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            turbo = true;
+            break;
+        case 'V':
+            vsync = true;
+            break;
+        case 'a':
+            sound = false;
             break;
+#ifdef CHIP8_PROFILE
+        case 'P':
+            profile_file = optarg;
+            break;
+#endif
         case 'b':
-            eml.brk_point = atoi(optarg);
-            eml.brk_point_set = true;
+            if (!add_break(optarg)) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            if (!add_watch(optarg)) {
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'G':
+            gdb_port = atoi(optarg);
+            if (gdb_port <= 0 || gdb_port > 65535) {
+                fprintf(stderr, "Invalid port: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            shm_name = optarg;
+            break;
+        case 'M':
+            shm_stepped = true;
+            break;
+        case 'i':
+            record_file = optarg;
+            break;
+        case 'I':
+            replay_file = optarg;
+            break;
+        case 'r':
+            video_file = optarg;
             break;
         default:
             prt_usage();
@@ -317,6 +871,11 @@ int main(int argc, char **argv) {
     }
 
 
+    if (shm_stepped && !shm_name) {
+        fprintf(stderr, "-M needs a shared memory segment (-m)\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (optind >= argc) {
         prt_usage();
         fprintf(stderr, "\nError: Expected file name argument\n");
@@ -325,101 +884,285 @@ int main(int argc, char **argv) {
     eml.rom_file = argv[optind];
     fprintf(stdout, "Loading file: %s\n", eml.rom_file);
 
-    if (eml.brk_point_set) {
-        fprintf(stdout, "Breakpoint: %d\n", eml.brk_point);
+    if (replay_file) {
+        replay = input_replay_open(replay_file);
+        if (!replay) {
+            return 1;
+        }
+        seed = replay->hdr.seed;
+        input_replay_setup(replay, &eml);
+        quirks_auto = false;
+        fprintf(stdout, "Replaying: %s (%u events)\n", replay_file,
+                replay->hdr.events);
+    }
+
+    if (eml.debug) {
+        fprintf(stdout, "Breakpoints: %d, watched bytes: %d\n",
+                eml.debug->n_brk, eml.debug->watched);
     }
 
     fprintf(stdout, "Clock speed: %d Hz\n", eml.clock_speed);
 
-    sdl_setup();
+    /* printed so a run can be reproduced with -s */
+    emulator_seed(&eml, seed);
+    fprintf(stdout, "Seed: %u\n", seed);
+
+    if (!sdl_setup()) {
+        return 1;
+    }
+    if (sound) {
+        audio_setup();
+    }
     update_overlay();
     display_redraw();
 
     /* load a program */
-    if (!emulator_load_program(&eml, eml.rom_file)) {
+    struct rom_image rom;
+    if (!rom_image_load(&rom, eml.rom_file)) {
+        return 1;
+    }
+    if (quirks_auto) {
+        eml.quirks = rom_quirks(&rom);
+    }
+    fprintf(stdout, "Quirks: %s\n", emulator_quirks(eml.quirks)->name);
+    emulator_load_image(&eml, &rom);
+    if (replay && replay->hdr.rom_hash != rom.hash) {
+        fprintf(stderr, "Warning: recorded with another rom (%s)\n",
+                replay->hdr.rom_file);
+    }
+    if (record_file) {
+        recorder = input_record_start(&eml, &rom, seed);
+        if (!recorder) {
+            fprintf(stderr, "Unable to allocate the input recording\n");
+            return 1;
+        }
+    }
+    rom_image_unload(&rom);
+#ifdef CHIP8_PROFILE
+    eml.profile = profile_create(eml.cpu.PC);
+    if (!eml.profile) {
+        fprintf(stderr, "Unable to allocate the profile\n");
+        return 1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = profile_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+#endif
+    if (trace_file) {
+        eml.trace = trace_open(trace_file);
+        if (!eml.trace) {
+            return 1;
+        }
+    }
+    if (shm_name) {
+        shm = shm_create(shm_name, shm_stepped);
+        if (!shm) {
+            return 1;
+        }
+        fprintf(stdout, "Shared memory: /%s%s\n", shm_name,
+                shm_stepped ? " (stepped)" : "");
+    }
+    if (gdb_port) {
+        need_debugger();
+        gdb = gdb_open(gdb_port);
+        if (!gdb) {
+            return 1;
+        }
+        fprintf(stdout, "GDB stub: localhost:%d\n", gdb_port);
+    }
+    if (video_file) {
+        video = video_open(video_file);
+        if (!video) {
+            return 1;
+        }
+        video_frame(video, &eml, 0);
+    }
+    rewind_ring = rewind_ring_create(REWIND_BYTES, REWIND_FRAMES);
+    if (!rewind_ring) {
+        fprintf(stderr, "Unable to allocate the rewind buffer\n");
         return 1;
     }
 
     /*
-     * The main loop is run at 60 Hz, but the emulator runs much faster.
-     * Every iteration, a number of cycles are run such that the desired
-     * clock speed is reached *on average*.
+     * The main loop runs one emulated frame per 60 Hz tick. A frame runs
+     * the cycles of 1/60 s at the clock speed and decrements the timers,
+     * see emulator_frame. Input is polled once at the start of a tick.
+     *
+     * Ticks are paced by absolute deadlines derived from a start time, so
+     * late wakeups don't accumulate. With vsync the display's refresh
+     * paces the loop instead and every tick is presented.
+     *
+     * Every frame is pushed to the rewind history. While backspace is
+     * held, each tick steps one frame back instead.
+     *
+     * With a shared memory channel, every frame is published and the
+     * controller's keys are applied before each frame. In step mode the
+     * controller paces the loop: frames run back to back as long as it
+     * allows them, waiting for it at most one tick.
+     *
+     * A display recording numbers its frames as they were shown: run and
+     * rewound frames both advance it.
+     *
+     * Frames run at normal speed are recorded for the beeper, whose audio
+     * thread plays them back behind the loop. Turbo frames stay silent.
      *
-     * The counters are decreased at the defined rate of 60 Hz.
+     * A GDB client is served every tick. While one is attached, frames
+     * only run after it continued, until the next stop.
      */
     SDL_Event event;
-    struct timespec t_start = {0, 0};
-    struct timespec t_end = {0, 0};
-    struct timespec t_delta = {0, 0};
+    int64_t t_start = clock_ns();
+    int64_t frame = 0;
+    stats.start = t_start;
     bool terminate = false;
+    int exit_code = 0;
     while (!terminate) {
-        clock_gettime(CLOCK_MONOTONIC_RAW, &t_start);
+        /* handle input events */
+        while (SDL_PollEvent(&event)) {
+            terminate |= event_handler(&event);
+        }
+#ifdef CHIP8_PROFILE
+        if (profile_requested) {
+            profile_requested = 0;
+            profile_write();
+        }
+#endif
 
-        /* num of cycles per main loop iteration */
-        int cycle_n = eml.clock_speed / 60;
+        bool debug_run = true;
+        if (gdb) {
+            debug_run = gdb_poll(gdb, &eml);
+            terminate |= gdb->kill;
+        }
 
         bool redraw = false;
-        bool fault = false;
-        for (int i = 0; i < cycle_n && !fault; i++) {
-            /* handle input events */
-            while (SDL_PollEvent(&event)) {
-                terminate = event_handler(&event);
+        if (rewinding) {
+            redraw = rewind_ring_pop(rewind_ring, &eml);
+            if (recorder) {
+                input_record_rewind(recorder, &eml);
             }
-
-            if (eml.paused) {
-                break;
+            if (replay) {
+                input_replay_seek(replay, &eml);
             }
-
-            /* run a Chip8 cycle */
-            switch(emulator_cycle(&eml)) {
-            case EML_REDRAW:
-                redraw = true;
-                break;
-            case EML_UNK_OPC:
-                fprintf(stderr, "Fault: Invalid opcode at PC=%u: 0x%04X\n",
-                        eml.prev_PC, eml.opcode);
-                fault = true;
-                terminate = true;
-                break;
-            case EML_STACK_OVERFL:
-                fprintf(stderr, "Fault: Stack overflow at PC=%u\n", eml.prev_PC);
-                fault = true;
-                terminate = true;
-                break;
-            case EML_STACK_UNDERFL:
-                fprintf(stderr,
-                        "Fault: Trying to pop from empty stack at PC=%u\n",
-                        eml.cpu.PC);
-                fault = true;
-                terminate = true;
-                break;
-            case EML_BRK_REACHED:
-                fprintf(stdout, "Breakpoint reached\n");
-                emulator_dump(&eml);
-                fault = true;
+            if (shm) {
+                shm_publish(shm, &eml, EML_OK);
+            }
+            if (video) {
+                video_frame(video, &eml, ++video_frames);
+            }
+        } else if (!eml.paused && debug_run &&
+                   (!shm || shm_step_ready(shm, _60HZ))) {
+            /*
+             * Run the Chip8 cycles of this frame. In turbo mode, frames
+             * are run back to back until the next display tick is due.
+             */
+            int64_t t_run = clock_ns();
+            int64_t tick_end = t_run + 1000000000LL / 60;
+            uint64_t cycles = eml.cycles;
+            enum eml_stat status;
+            int n = 0;
+            bool fast = turbo || shm_stepped;
+            bool audible = beeper && !fast;
+            do {
+                if (shm) {
+                    shm_poll_keys(shm, &eml);
+                }
+                if (audible) {
+                    beeper_begin(beeper, &eml);
+                }
+                status = replay ? input_replay_frame(replay, &eml)
+                                : emulator_frame(&eml);
+                if (audible) {
+                    beeper_end(beeper, &eml);
+                }
+                redraw |= status == EML_REDRAW;
+                stats.frames++;
+                rewind_ring_push(rewind_ring, &eml);
+                if (shm) {
+                    shm_publish(shm, &eml, status);
+                }
+                if (video) {
+                    video_frame(video, &eml, ++video_frames);
+                }
+            } while (fast && (status == EML_OK || status == EML_REDRAW) &&
+                     (!shm || shm_step_ready(shm, 0)) &&
+                     (!replay || !input_replay_done(replay, &eml)) &&
+                     (++n % 64 || clock_ns() < tick_end));
+            stats.busy_ns += clock_ns() - t_run;
+            stats.cycles += eml.cycles - cycles;
+            terminate |= check_status(status);
+            if (replay && input_replay_done(replay, &eml)) {
+                bool match = emulator_hash(&eml) == replay->hdr.final_hash;
+                fprintf(stdout, "Replay finished, final state %s\n",
+                        match ? "matches" : "differs");
+                exit_code = match ? 0 : 1;
                 terminate = true;
-                break;
-            default:
-                break;
             }
         }
 
-        if (redraw) {
+        /* the stats line is the only overlay text that changes by itself */
+        bool stats_changed = stats_update(clock_ns()) && overlay_enabled;
+        if (stats_changed) {
+            update_overlay();
+        }
+
+        if (vsync) {
+            /* presenting blocks until the next refresh */
             display_redraw();
+            continue;
         }
 
-        /* sleep if we have time left */
-        clock_gettime(CLOCK_MONOTONIC_RAW, &t_end);
-        t_delta.tv_nsec = t_end.tv_nsec - t_start.tv_nsec;
-        if (t_delta.tv_nsec < _60HZ) {
-            t_delta.tv_nsec = _60HZ - t_delta.tv_nsec;
-            nanosleep(&t_delta, NULL);
+        /* only present when the frame shows a different picture */
+        if ((redraw && emulator_frame_changed(&eml)) || stats_changed) {
+            display_redraw();
         }
 
-        emulator_timer_dec(&eml);
+        /* turbo frames took the whole tick, no need to wait */
+        if ((turbo || shm_stepped) && !eml.paused && debug_run && !rewinding) {
+            t_start = clock_ns();
+            frame = 0;
+            continue;
+        }
+
+        /* sleep until the next tick, start over if we fell far behind */
+        frame++;
+        int64_t deadline = t_start + frame * 1000000000LL / 60;
+        int64_t now = clock_ns();
+        if (now - deadline > 1000000000LL / 4) {
+            t_start = now;
+            frame = 0;
+            continue;
+        }
+        struct timespec ts = { deadline / 1000000000LL, deadline % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
     }
 
+#ifdef CHIP8_PROFILE
+    profile_write();
+    profile_destroy(eml.profile);
+#endif
+    if (eml.trace) {
+        trace_close(eml.trace);
+    }
+    if (shm) {
+        shm_destroy(shm);
+    }
+    if (video) {
+        video_close(video);
+    }
+    if (recorder && !input_record_finish(recorder, &eml, record_file)) {
+        exit_code = 1;
+    }
+    if (replay) {
+        input_replay_close(replay);
+    }
+    if (gdb) {
+        gdb_close(gdb);
+    }
+    debug_destroy(eml.debug);
+    rewind_ring_destroy(rewind_ring);
+    audio_cleanup();
     sdl_cleanup();
-    return 0;
+    return exit_code;
 }
 
@@ -0,0 +1,204 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Execution profile. Every executed instruction is counted per handler,
+ * per address and per call stack. The call stack is the chain of CALL
+ * targets, tracked from the changes of the stack pointer; it is looked up
+ * in the stack table only when it changes.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+
+/* Rows of the address table */
+#define PROFILE_TOP_PCS 20
+
+/* Empty slot in the stack table */
+#define STACK_FREE UINT16_MAX
+
+uint64_t profile_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint32_t stack_hash(const struct profile_stack *s) {
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (int d = 0; d <= s->depth; d++) {
+        h = (h ^ s->callee[d]) * 16777619u;
+    }
+    return h;
+}
+
+static bool stack_equal(const struct profile_stack *a,
+                        const struct profile_stack *b) {
+    return a->depth == b->depth &&
+           !memcmp(a->callee, b->callee, (a->depth + 1) * sizeof a->callee[0]);
+}
+
+/* Slot of a call stack in the table, added if new. -1 if the table is full */
+static int stack_slot(struct profile *p, const struct profile_stack *s) {
+    uint32_t i = stack_hash(s) % PROFILE_STACKS;
+    for (;;) {
+        struct profile_stack *e = &p->stacks[i];
+        if (e->depth == STACK_FREE) {
+            /* keep one slot free so lookups terminate */
+            if (p->stack_n == PROFILE_STACKS - 1) {
+                return -1;
+            }
+            *e = *s;
+            e->count = 0;
+            e->ticks = 0;
+            p->stack_n++;
+            return i;
+        }
+        if (stack_equal(e, s)) {
+            return i;
+        }
+        i = (i + 1) % PROFILE_STACKS;
+    }
+}
+
+/* New profile of a program that starts at entry */
+struct profile *profile_create(uint16_t entry) {
+    struct profile *p = calloc(1, sizeof *p);
+    if (!p) {
+        return NULL;
+    }
+    for (int i = 0; i < PROFILE_STACKS; i++) {
+        p->stacks[i].depth = STACK_FREE;
+    }
+    p->cur.callee[0] = entry;
+    p->cur_slot = stack_slot(p, &p->cur);
+    return p;
+}
+
+void profile_destroy(struct profile *p) {
+    free(p);
+}
+
+/* Count an instruction that was just executed and took ticks */
+void profile_instr(struct profile *p, const struct emulator *eml,
+                   const struct chip8_instr *in, uint64_t ticks) {
+    p->op_count[in->op]++;
+    p->op_ticks[in->op] += ticks;
+    p->pc_count[eml->prev_PC]++;
+    if ((in->opcode >> 12) == 0xD) {
+        p->drw_height[in->kk & 0xF]++;
+    }
+
+    /* the instruction belongs to the stack it ran in, even CALL and RET */
+    if (p->cur_slot >= 0) {
+        p->stacks[p->cur_slot].count++;
+        p->stacks[p->cur_slot].ticks += ticks;
+    } else {
+        p->other_count++;
+    }
+
+    uint8_t sp = eml->cpu.SP;
+    if (sp != p->cur.depth) {
+        /* a CALL entered PC, frames skipped by a restore are unknown (0) */
+        for (int d = p->cur.depth + 1; d < sp; d++) {
+            p->cur.callee[d] = 0;
+        }
+        if (sp > p->cur.depth) {
+            p->cur.callee[sp] = eml->cpu.PC;
+        }
+        p->cur.depth = sp;
+        p->cur_slot = stack_slot(p, &p->cur);
+    }
+}
+
+/* Counts cmp_desc sorts by, per thread so profiles can be dumped concurrently */
+static __thread const uint64_t *sort_base;
+
+/* Sort indices by descending count */
+static int cmp_desc(const void *a, const void *b) {
+    uint64_t x = sort_base[*(const int *) a];
+    uint64_t y = sort_base[*(const int *) b];
+    return (x < y) - (x > y);
+}
+
+static void sort_by_count(int *idx, int n, const uint64_t *count) {
+    for (int i = 0; i < n; i++) {
+        idx[i] = i;
+    }
+    sort_base = count;
+    qsort(idx, n, sizeof *idx, cmp_desc);
+}
+
+/* Print the profile as tables */
+void profile_dump(const struct profile *p, FILE *f) {
+    uint64_t total = 0;
+    for (int i = 0; i < 256; i++) {
+        total += p->op_count[i];
+    }
+    if (!total) {
+        fprintf(f, "Profile: no instructions executed\n");
+        return;
+    }
+
+    int idx[MEM_SIZE];
+    fprintf(f, "%-16s %14s %7s %16s %9s\n",
+            "instruction", "count", "%", "ticks", "ticks/op");
+    sort_by_count(idx, 256, p->op_count);
+    for (int i = 0; i < 256 && p->op_count[idx[i]]; i++) {
+        int op = idx[i];
+        fprintf(f, "%-16s %14llu %7.2f %16llu %9.1f\n",
+                emulator_op_name(op), (unsigned long long) p->op_count[op],
+                100.0 * p->op_count[op] / total,
+                (unsigned long long) p->op_ticks[op],
+                (double) p->op_ticks[op] / p->op_count[op]);
+    }
+
+    fprintf(f, "\n%-16s %14s %7s\n", "address", "count", "%");
+    sort_by_count(idx, MEM_SIZE, p->pc_count);
+    for (int i = 0; i < PROFILE_TOP_PCS && p->pc_count[idx[i]]; i++) {
+        fprintf(f, "0x%03X            %14llu %7.2f\n", idx[i],
+                (unsigned long long) p->pc_count[idx[i]],
+                100.0 * p->pc_count[idx[i]] / total);
+    }
+
+    fprintf(f, "\n%-16s %14s\n", "sprite height", "DRW count");
+    for (int n = 0; n < 16; n++) {
+        if (p->drw_height[n]) {
+            fprintf(f, "%-16d %14llu\n", n, (unsigned long long) p->drw_height[n]);
+        }
+    }
+}
+
+/*
+ * Print the call stacks in the folded format of flamegraph.pl: frames
+ * separated by ';', then the instruction count.
+ */
+void profile_dump_folded(const struct profile *p, FILE *f) {
+    for (int i = 0; i < PROFILE_STACKS; i++) {
+        const struct profile_stack *s = &p->stacks[i];
+        if (s->depth == STACK_FREE || !s->count) {
+            continue;
+        }
+        for (int d = 0; d <= s->depth; d++) {
+            fprintf(f, "%s0x%03X", d ? ";" : "", s->callee[d]);
+        }
+        fprintf(f, " %llu\n", (unsigned long long) s->count);
+    }
+    if (p->other_count) {
+        fprintf(f, "[other] %llu\n", (unsigned long long) p->other_count);
+    }
+}
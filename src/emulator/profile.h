@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+/* Distinct call stacks that are told apart, the rest is lumped together */
+#define PROFILE_STACKS 4096
+
+/* Counts of one call stack, callee[0] is the entry point */
+struct profile_stack {
+    uint16_t depth;                     /* Number of calls on the stack */
+    uint16_t callee[STACK_SIZE + 1];    /* Entry address of each frame */
+    uint64_t count;                     /* Instructions executed */
+    uint64_t ticks;                     /* Host ticks spent */
+};
+
+/*
+ * Execution profile, filled in by emulator_cycle in builds with
+ * CHIP8_PROFILE when attached to emulator.profile. Ticks are TSC cycles
+ * on x86 and nanoseconds elsewhere.
+ */
+struct profile {
+    uint64_t op_count[256];             /* Executions per instruction handler */
+    uint64_t op_ticks[256];             /* Ticks per instruction handler */
+    uint64_t pc_count[MEM_SIZE];        /* Executions per address */
+    uint64_t drw_height[16];            /* DRW executions per sprite height */
+    struct profile_stack cur;           /* Call stack being executed */
+    int cur_slot;                       /* Slot of cur in stacks, -1: none */
+    int stack_n;                        /* Used slots in stacks */
+    uint64_t other_count;               /* Instructions of stacks not kept */
+    struct profile_stack stacks[PROFILE_STACKS];
+};
+
+/* Profile functions */
+struct profile *profile_create(uint16_t entry);
+void profile_destroy(struct profile *p);
+uint64_t profile_ticks(void);
+void profile_instr(struct profile *p, const struct emulator *eml,
+                   const struct chip8_instr *in, uint64_t ticks);
+void profile_dump(const struct profile *p, FILE *f);
+void profile_dump_folded(const struct profile *p, FILE *f);
+
+#endif
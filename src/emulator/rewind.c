@@ -0,0 +1,215 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Rewind history. The ring keeps the state at the last push as a full
+ * snapshot; every push stores the XOR of that state and the new one for
+ * the memory blocks and display words that changed, plus the registers.
+ * XORing the newest delta back into the kept state steps one frame back.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rewind.h"
+
+/* The part of a snapshot before display and memory: keys and registers */
+#define REGS_OFF offsetof(struct emulator_snapshot, keypad)
+#define REGS_LEN (offsetof(struct emulator_snapshot, cpu) + \
+                  offsetof(struct chip8, display) - REGS_OFF)
+
+/* Start of a delta, followed by the registers, memory blocks and rows */
+struct delta_hdr {
+    uint64_t mem_mask;                  /* Memory blocks in the delta */
+    uint64_t word_mask[DISP_WORDS / 64]; /* Display words in the delta */
+    uint32_t len;                       /* Bytes including this header */
+};
+
+/* Largest possible delta, everything changed */
+#define DELTA_MAX (sizeof(struct delta_hdr) + REGS_LEN + MEM_SIZE + \
+                   DISP_WORDS * sizeof(uint64_t) + 8)
+
+struct rewind_ring {
+    uint8_t *buf;                       /* Packed deltas */
+    size_t size;                        /* Size of buf */
+    size_t pos;                         /* Where the next delta goes */
+    size_t *offs;                       /* Delta offsets, oldest at first */
+    int frames;                         /* Capacity of offs */
+    int first;                          /* Oldest delta */
+    int count;                          /* Number of stored deltas */
+    bool primed;                        /* prev holds a state */
+    struct emulator_snapshot prev;      /* State at the last push */
+};
+
+static void xor_bytes(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                      size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = a[i] ^ b[i];
+    }
+}
+
+struct rewind_ring *rewind_ring_create(size_t bytes, int frames) {
+    struct rewind_ring *rw = calloc(1, sizeof *rw);
+    if (!rw) {
+        return NULL;
+    }
+    rw->size = bytes < DELTA_MAX ? DELTA_MAX : bytes;
+    rw->frames = frames < 1 ? 1 : frames;
+    rw->buf = malloc(rw->size);
+    rw->offs = malloc(rw->frames * sizeof *rw->offs);
+    if (!rw->buf || !rw->offs) {
+        rewind_ring_destroy(rw);
+        return NULL;
+    }
+    return rw;
+}
+
+void rewind_ring_destroy(struct rewind_ring *rw) {
+    if (rw) {
+        free(rw->buf);
+        free(rw->offs);
+        free(rw);
+    }
+}
+
+static void drop_oldest(struct rewind_ring *rw) {
+    rw->first = (rw->first + 1) % rw->frames;
+    rw->count--;
+}
+
+/*
+ * Make room for a delta of len bytes at the write position, dropping the
+ * oldest deltas it would overwrite. Deltas never wrap around the end of
+ * the buffer; the space left there is skipped.
+ */
+static uint8_t *ring_reserve(struct rewind_ring *rw, size_t len) {
+    if (rw->pos + len > rw->size) {
+        while (rw->count && rw->offs[rw->first] >= rw->pos) {
+            drop_oldest(rw);
+        }
+        rw->pos = 0;
+    }
+    while (rw->count && rw->offs[rw->first] >= rw->pos &&
+           rw->offs[rw->first] < rw->pos + len) {
+        drop_oldest(rw);
+    }
+    if (rw->count == rw->frames) {
+        drop_oldest(rw);
+    }
+
+    rw->offs[(rw->first + rw->count++) % rw->frames] = rw->pos;
+    uint8_t *p = rw->buf + rw->pos;
+    rw->pos += len;
+    return p;
+}
+
+/* Record the current state of eml as the newest frame */
+void rewind_ring_push(struct rewind_ring *rw, struct emulator *eml) {
+    struct emulator_snapshot *prev = &rw->prev;
+    if (!rw->primed) {
+        emulator_snapshot(eml, prev);
+        rw->primed = true;
+        return;
+    }
+
+    /* if prev is still the base of eml, only written blocks can differ */
+    uint64_t blocks = ~0ULL;
+    if (prev->id != 0 && prev->id == eml->snap_id) {
+        blocks = eml->mem_dirty;
+    }
+
+    struct delta_hdr hdr;
+    memset(&hdr, 0, sizeof hdr);
+    for (; blocks; blocks &= blocks - 1) {
+        int b = __builtin_ctzll(blocks);
+        if (memcmp(&prev->cpu.memory[b * MEM_BLOCK],
+                   &eml->cpu.memory[b * MEM_BLOCK], MEM_BLOCK)) {
+            hdr.mem_mask |= 1ULL << b;
+        }
+    }
+    /* in the 64x32 mode, the words after its rows are all 0 */
+    int n = prev->cpu.hires || eml->cpu.hires ? DISP_WORDS : DISP_H;
+    size_t words = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t changed = prev->cpu.display[i] != eml->cpu.display[i];
+        hdr.word_mask[i / 64] |= changed << (i % 64);
+        words += changed;
+    }
+    size_t len = sizeof hdr + REGS_LEN
+                 + __builtin_popcountll(hdr.mem_mask) * MEM_BLOCK
+                 + words * sizeof(uint64_t);
+    hdr.len = (len + 7) & ~(size_t) 7;
+
+    uint8_t *p = ring_reserve(rw, hdr.len);
+    memcpy(p, &hdr, sizeof hdr);
+    uint8_t *regs = p + sizeof hdr;
+    p = regs + REGS_LEN;
+    for (uint64_t m = hdr.mem_mask; m; m &= m - 1) {
+        int b = __builtin_ctzll(m);
+        xor_bytes(p, &prev->cpu.memory[b * MEM_BLOCK],
+                  &eml->cpu.memory[b * MEM_BLOCK], MEM_BLOCK);
+        p += MEM_BLOCK;
+    }
+    for (int k = 0; k < DISP_WORDS / 64; k++) {
+        for (uint64_t m = hdr.word_mask[k]; m; m &= m - 1) {
+            int i = k * 64 + __builtin_ctzll(m);
+            uint64_t word = prev->cpu.display[i] ^ eml->cpu.display[i];
+            memcpy(p, &word, sizeof word);
+            p += sizeof word;
+        }
+    }
+
+    /* the registers are XORed once prev holds the new state */
+    const uint8_t *prev_regs = (const uint8_t *) prev + REGS_OFF;
+    memcpy(regs, prev_regs, REGS_LEN);
+    emulator_snapshot(eml, prev);
+    xor_bytes(regs, regs, prev_regs, REGS_LEN);
+}
+
+/*
+ * Step eml back to the state of the previous push. Returns false if there
+ * is no older state.
+ */
+bool rewind_ring_pop(struct rewind_ring *rw, struct emulator *eml) {
+    if (!rw->count) {
+        return false;
+    }
+    size_t off = rw->offs[(rw->first + rw->count - 1) % rw->frames];
+    const uint8_t *p = rw->buf + off;
+    struct emulator_snapshot *prev = &rw->prev;
+
+    struct delta_hdr hdr;
+    memcpy(&hdr, p, sizeof hdr);
+    p += sizeof hdr;
+    uint8_t *prev_regs = (uint8_t *) prev + REGS_OFF;
+    xor_bytes(prev_regs, prev_regs, p, REGS_LEN);
+    p += REGS_LEN;
+    for (uint64_t m = hdr.mem_mask; m; m &= m - 1) {
+        uint8_t *block = &prev->cpu.memory[__builtin_ctzll(m) * MEM_BLOCK];
+        xor_bytes(block, block, p, MEM_BLOCK);
+        p += MEM_BLOCK;
+    }
+    for (int k = 0; k < DISP_WORDS / 64; k++) {
+        for (uint64_t m = hdr.word_mask[k]; m; m &= m - 1) {
+            uint64_t word;
+            memcpy(&word, p, sizeof word);
+            prev->cpu.display[k * 64 + __builtin_ctzll(m)] ^= word;
+            p += sizeof word;
+        }
+    }
+    rw->count--;
+    rw->pos = off;
+
+    /* prev changed under its id, no emulator may treat it as its base */
+    prev->id = 0;
+    emulator_restore(eml, prev);
+    return true;
+}
+
+/* Number of frames that can be stepped back */
+int rewind_ring_frames(const struct rewind_ring *rw) {
+    return rw->count;
+}
@@ -0,0 +1,29 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __REWIND_H
+#define __REWIND_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/*
+ * History of emulator states, one entry per pushed frame. Entries are XOR
+ * deltas to the following state, packed into a byte ring; when the ring is
+ * full the oldest frames are dropped.
+ */
+struct rewind_ring;
+
+/* Rewind functions */
+struct rewind_ring *rewind_ring_create(size_t bytes, int frames);
+void rewind_ring_destroy(struct rewind_ring *rw);
+void rewind_ring_push(struct rewind_ring *rw, struct emulator *eml);
+bool rewind_ring_pop(struct rewind_ring *rw, struct emulator *eml);
+int rewind_ring_frames(const struct rewind_ring *rw);
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#include <stdlib.h>
+
+#include "ring.h"
+
+/* Set up an empty ring, cap is rounded up to a power of two */
+bool spsc_ring_init(struct spsc_ring *r, size_t elem_size, size_t cap) {
+    size_t c = 1;
+    while (c < cap) {
+        c <<= 1;
+    }
+    r->buf = malloc(c * elem_size);
+    r->elem_size = elem_size;
+    r->cap = c;
+    r->head = 0;
+    r->tail = 0;
+    return r->buf != NULL;
+}
+
+void spsc_ring_free(struct spsc_ring *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
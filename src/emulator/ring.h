@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __RING_H
+#define __RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * Lock-free ring of fixed-size elements for one producer and one consumer
+ * thread. head and tail count elements and only ever grow, the producer
+ * owns tail and the consumer owns head. The functions are inline, they
+ * sit on hot paths like the per-instruction trace.
+ */
+struct spsc_ring {
+    uint8_t *buf;                       /* cap elements of elem_size bytes */
+    size_t elem_size;                   /* Size of one element */
+    size_t cap;                         /* Capacity, a power of two */
+    size_t head;                        /* Next element to consume */
+    size_t tail;                        /* Next element to produce */
+};
+
+/* Ring functions */
+bool spsc_ring_init(struct spsc_ring *r, size_t elem_size, size_t cap);
+void spsc_ring_free(struct spsc_ring *r);
+
+/* Producer: append an element, false if the ring is full */
+static inline bool spsc_ring_push(struct spsc_ring *r, const void *elem) {
+    size_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->cap) {
+        return false;
+    }
+    memcpy(r->buf + (tail & (r->cap - 1)) * r->elem_size, elem, r->elem_size);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Consumer: take an element, false if the ring is empty */
+static inline bool spsc_ring_pop(struct spsc_ring *r, void *elem) {
+    size_t head = r->head;
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    memcpy(elem, r->buf + (head & (r->cap - 1)) * r->elem_size, r->elem_size);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Consumer: the elements that can be read in place, up to the end of the
+ * buffer. Returns their number, release them with spsc_ring_consume.
+ */
+static inline size_t spsc_ring_peek(struct spsc_ring *r, const void **elems) {
+    size_t head = r->head;
+    size_t n = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head;
+    size_t to_end = r->cap - (head & (r->cap - 1));
+    *elems = r->buf + (head & (r->cap - 1)) * r->elem_size;
+    return n < to_end ? n : to_end;
+}
+
+static inline void spsc_ring_consume(struct spsc_ring *r, size_t n) {
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_RELEASE);
+}
+
+/* Either side: number of elements in the ring */
+static inline size_t spsc_ring_count(struct spsc_ring *r) {
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+#endif
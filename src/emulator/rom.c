@@ -0,0 +1,310 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Rom images and rom directories. Files are mapped read-only and hashed
+ * once; emulators copy from the mapping. A directory can carry an index
+ * of its roms so they can be listed without opening every file.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rom.h"
+
+uint64_t rom_hash(const uint8_t *data, size_t size) {
+    uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Guess the quirks profile of a program: SCHIP if an instruction the
+ * analysis found reachable is one only SCHIP has. Sprites and other data
+ * aren't looked at.
+ */
+const char *rom_detect_quirks(const uint8_t *memory, const struct rom_analysis *a) {
+    for (int i = 0; i + 1 < MEM_SIZE; i++) {
+        if (!(a->mem[i] & AN_INSTR)) {
+            continue;
+        }
+        uint16_t opc = memory[i] << 8 | memory[i + 1];
+        uint8_t kk = opc & 0xFF;
+        if ((opc & 0xFFF0) == 0x00C0 || (opc >= 0x00FB && opc <= 0x00FF)) {
+            return "schip";
+        }
+        if ((opc & 0xF000) == 0xF000 && (kk == 0x30 || kk == 0x75 || kk == 0x85)) {
+            return "schip";
+        }
+    }
+    return "chip8";
+}
+
+/* Quirks profile for the guessed one of a rom */
+enum eml_quirks rom_quirks(const struct rom_image *rom) {
+    int q = emulator_quirks_parse(rom->quirks);
+    return q < 0 ? QUIRKS_DEFAULT : (enum eml_quirks) q;
+}
+
+/* Map a rom file, false (with a message) if it can't be used */
+bool rom_image_load(struct rom_image *rom, const char *path) {
+    memset(rom, 0, sizeof *rom);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to read file %s\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Unable to read file %s\n", path);
+        close(fd);
+        return false;
+    }
+    if (st.st_size > ROM_MAX_SIZE) {
+        fprintf(stderr,
+                "Unable to load program %s: Too large (%lld, max: %db)\n",
+                path, (long long) st.st_size, ROM_MAX_SIZE);
+        close(fd);
+        return false;
+    }
+
+    rom->size = st.st_size;
+    if (rom->size) {
+        void *m = mmap(NULL, rom->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            fprintf(stderr, "Unable to map file %s\n", path);
+            close(fd);
+            return false;
+        }
+        rom->data = m;
+    }
+    close(fd);
+
+    rom->path = strdup(path);
+    emulator_template(&rom->init, rom->data, rom->size);
+    rom->hash = rom_hash(rom->data, rom->size);
+    rom_analyze(&rom->analysis, rom->init.cpu.memory);
+    rom->quirks = rom_detect_quirks(rom->init.cpu.memory, &rom->analysis);
+    return true;
+}
+
+void rom_image_unload(struct rom_image *rom) {
+    if (rom->data) {
+        munmap((void *) rom->data, rom->size);
+    }
+    free(rom->path);
+    memset(rom, 0, sizeof *rom);
+}
+
+/* Image of a file, mapped on first use. NULL if it can't be loaded */
+const struct rom_image *rom_pool_get(struct rom_pool *pool, const char *path) {
+    for (int i = 0; i < pool->n; i++) {
+        if (strcmp(pool->roms[i]->path, path) == 0) {
+            return pool->roms[i];
+        }
+    }
+    if (pool->n == pool->cap) {
+        int cap = pool->cap ? pool->cap * 2 : 16;
+        struct rom_image **roms = realloc(pool->roms, cap * sizeof *roms);
+        if (!roms) {
+            return NULL;
+        }
+        pool->roms = roms;
+        pool->cap = cap;
+    }
+    struct rom_image *rom = malloc(sizeof *rom);
+    if (!rom || !rom_image_load(rom, path)) {
+        free(rom);
+        return NULL;
+    }
+    pool->roms[pool->n++] = rom;
+    return rom;
+}
+
+void rom_pool_free(struct rom_pool *pool) {
+    for (int i = 0; i < pool->n; i++) {
+        rom_image_unload(pool->roms[i]);
+        free(pool->roms[i]);
+    }
+    free(pool->roms);
+    memset(pool, 0, sizeof *pool);
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    return strcmp(((const struct rom_index_entry *) a)->name,
+                  ((const struct rom_index_entry *) b)->name);
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Whether the file of an index entry is still the one that was indexed:
+ * same size and modification time.
+ */
+static bool entry_current(const char *dir, const struct rom_index_entry *e) {
+    char path[4096 + sizeof e->name];
+    struct stat st;
+    snprintf(path, sizeof path, "%s/%s", dir, e->name);
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+           (size_t) st.st_size == e->size && mtime_ns(&st) == e->mtime_ns;
+}
+
+/*
+ * Read the index file of dir, NULL if it is missing, malformed, of another
+ * format version or any of its files changed.
+ */
+static struct rom_index_entry *index_read(const char *dir, const char *file,
+                                          int *n) {
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        return NULL;
+    }
+    struct rom_index_entry *entries = NULL;
+    int cap = 0;
+    *n = 0;
+    char line[512];
+    if (!fgets(line, sizeof line, f) ||
+        strncmp(line, ROM_INDEX_HEADER "\n", sizeof ROM_INDEX_HEADER) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    while (fgets(line, sizeof line, f)) {
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct rom_index_entry *e = realloc(entries, cap * sizeof *e);
+            if (!e) {
+                break;
+            }
+            entries = e;
+        }
+        struct rom_index_entry *e = &entries[*n];
+        unsigned long long hash;
+        unsigned long size;
+        long long mtime;
+        int name_at;
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%16llx %lu %lld %15s %n", &hash, &size, &mtime,
+                   e->quirks, &name_at) != 4 || !line[name_at]) {
+            free(entries);
+            fclose(f);
+            return NULL;
+        }
+        e->hash = hash;
+        e->size = size;
+        e->mtime_ns = mtime;
+        snprintf(e->name, sizeof e->name, "%s", line + name_at);
+        if (!entry_current(dir, e)) {
+            free(entries);
+            fclose(f);
+            return NULL;
+        }
+        (*n)++;
+    }
+    fclose(f);
+    return entries;
+}
+
+/* Hash every rom of a directory and write the index, NULL on failure */
+static struct rom_index_entry *index_build(const char *dir, const char *file,
+                                           int *n) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Unable to open directory %s\n", dir);
+        return NULL;
+    }
+    struct rom_index_entry *entries = NULL;
+    int cap = 0;
+    *n = 0;
+    struct dirent *de;
+    char path[4096];
+    while ((de = readdir(d))) {
+        /* hidden files, like the index itself, are not roms */
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof entries->name) {
+            continue;
+        }
+        snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+        struct stat st;
+        struct rom_image rom;
+        if (stat(path, &st) != 0 || !rom_image_load(&rom, path)) {
+            continue;
+        }
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct rom_index_entry *e = realloc(entries, cap * sizeof *e);
+            if (!e) {
+                rom_image_unload(&rom);
+                break;
+            }
+            entries = e;
+        }
+        struct rom_index_entry *e = &entries[(*n)++];
+        snprintf(e->name, sizeof e->name, "%s", de->d_name);
+        e->hash = rom.hash;
+        e->size = rom.size;
+        e->mtime_ns = mtime_ns(&st);
+        snprintf(e->quirks, sizeof e->quirks, "%s", rom.quirks);
+        rom_image_unload(&rom);
+    }
+    closedir(d);
+    qsort(entries, *n, sizeof *entries, cmp_entry);
+
+    /* written to a temporary file first, readers never see a partial index */
+    char tmp[sizeof("/.tmp") + 4096];
+    snprintf(tmp, sizeof tmp, "%s.tmp", file);
+    FILE *f = fopen(tmp, "w");
+    if (f) {
+        fprintf(f, "%s\n", ROM_INDEX_HEADER);
+        for (int i = 0; i < *n; i++) {
+            fprintf(f, "%016llx %lu %lld %s %s\n",
+                    (unsigned long long) entries[i].hash,
+                    (unsigned long) entries[i].size,
+                    (long long) entries[i].mtime_ns, entries[i].quirks,
+                    entries[i].name);
+        }
+        if (fclose(f) != 0 || rename(tmp, file) != 0) {
+            unlink(tmp);
+        } else {
+            /* the rename touched the directory, keep the index newer */
+            utimensat(AT_FDCWD, file, NULL, 0);
+        }
+    }
+    return entries;
+}
+
+/*
+ * The roms of a directory, sorted by name. The index file is used while
+ * it is newer than the directory (files were added, removed or renamed
+ * since otherwise) and every file still has the size and modification
+ * time it was indexed with; checkouts don't keep mtimes, so the directory
+ * alone can't be trusted. Otherwise it is rebuilt.
+ */
+struct rom_index_entry *rom_index_load(const char *dir, int *n) {
+    char file[4096];
+    snprintf(file, sizeof file, "%s/%s", dir, ROM_INDEX_FILE);
+
+    struct stat st_dir;
+    struct stat st_index;
+    if (stat(dir, &st_dir) == 0 && stat(file, &st_index) == 0 &&
+        st_index.st_mtime >= st_dir.st_mtime) {
+        struct rom_index_entry *entries = index_read(dir, file, n);
+        if (entries) {
+            return entries;
+        }
+    }
+    return index_build(dir, file, n);
+}
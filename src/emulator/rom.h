@@ -0,0 +1,67 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __ROM_H
+#define __ROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+#include "analysis.h"
+
+/* Largest program that fits above the reserved memory */
+#define ROM_MAX_SIZE (MEM_SIZE - RESERVED_MEM)
+
+/* Index file of a rom directory, and the first line of its format */
+#define ROM_INDEX_FILE ".index"
+#define ROM_INDEX_HEADER "# chip8 rom index 2"
+
+/*
+ * Immutable rom contents, mapped read-only from the file, and the machine
+ * state right after loading them. Any number of emulators can be loaded
+ * from, and reset to, one image.
+ */
+struct rom_image {
+    struct emulator_snapshot init;      /* State after loading the rom */
+    char *path;                         /* File the image was mapped from */
+    const uint8_t *data;                /* Contents, NULL if empty */
+    size_t size;                        /* Size in bytes */
+    uint64_t hash;                      /* FNV-1a of the contents */
+    const char *quirks;                 /* Guessed profile: chip8 or schip */
+    struct rom_analysis analysis;       /* Code and data of the program */
+};
+
+/* Images of a set of files, each file is mapped once */
+struct rom_pool {
+    struct rom_image **roms;            /* Images, never move once loaded */
+    int n;
+    int cap;
+};
+
+/* Entry of a rom index */
+struct rom_index_entry {
+    char name[256];                     /* File name within the directory */
+    uint64_t hash;
+    size_t size;
+    int64_t mtime_ns;                   /* Modification time of the file */
+    char quirks[16];
+};
+
+/* Rom functions */
+bool rom_image_load(struct rom_image *rom, const char *path);
+void rom_image_unload(struct rom_image *rom);
+uint64_t rom_hash(const uint8_t *data, size_t size);
+const char *rom_detect_quirks(const uint8_t *memory, const struct rom_analysis *a);
+enum eml_quirks rom_quirks(const struct rom_image *rom);
+
+const struct rom_image *rom_pool_get(struct rom_pool *pool, const char *path);
+void rom_pool_free(struct rom_pool *pool);
+
+struct rom_index_entry *rom_index_load(const char *dir, int *n);
+
+#endif
@@ -0,0 +1,260 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Frame channel: frames and keys exchanged with another process through
+ * shared memory. The emulator copies a frame into the segment once per
+ * 60 Hz frame, controllers read it in place and are woken by a futex, so
+ * neither side makes a system call per pixel, key or poll.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "shm.h"
+
+/* Sleep interval while waiting without futexes */
+#define SHM_POLL_NS 100000
+
+/*
+ * Sleep while *word is val, at most timeout_ns (< 0: no limit). Wakeups
+ * can be spurious, callers check the word again.
+ */
+static void word_wait(const uint32_t *word, uint32_t val, int64_t timeout_ns) {
+#ifdef __linux__
+    struct timespec ts = { timeout_ns / 1000000000LL,
+                           timeout_ns % 1000000000LL };
+    /* not FUTEX_PRIVATE, the word is shared between processes */
+    syscall(SYS_futex, (uint32_t *) word, FUTEX_WAIT, val,
+            timeout_ns < 0 ? NULL : &ts, NULL, 0);
+#else
+    int64_t ns = timeout_ns < 0 || timeout_ns > SHM_POLL_NS ? SHM_POLL_NS
+                                                             : timeout_ns;
+    struct timespec ts = { 0, ns };
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) == val) {
+        nanosleep(&ts, NULL);
+    }
+#endif
+}
+
+static void word_wake(uint32_t *word) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, 1 << 30, NULL, NULL, 0);
+#else
+    (void) word;
+#endif
+}
+
+static int64_t clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Create the segment /name (replacing a stale one), NULL on failure */
+struct shm_channel *shm_create(const char *name, bool step_mode) {
+    char path[256];
+    snprintf(path, sizeof path, "/%s", name[0] == '/' ? name + 1 : name);
+    struct shm_channel *c = calloc(1, sizeof *c);
+    if (!c) {
+        return NULL;
+    }
+    shm_unlink(path);
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof *c->f) != 0) {
+        fprintf(stderr, "Unable to create shared memory %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+            shm_unlink(path);
+        }
+        free(c);
+        return NULL;
+    }
+    void *m = mmap(NULL, sizeof *c->f, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "Unable to map shared memory %s\n", path);
+        shm_unlink(path);
+        free(c);
+        return NULL;
+    }
+    c->f = m;
+    c->name = strdup(path);
+    c->f->size = sizeof *c->f;
+    c->f->step_mode = step_mode;
+    /* the magic goes last, a controller attaching early sees no channel */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(c->f->magic, SHM_MAGIC, sizeof c->f->magic);
+    return c;
+}
+
+void shm_destroy(struct shm_channel *c) {
+    munmap(c->f, sizeof *c->f);
+    shm_unlink(c->name);
+    free(c->name);
+    free(c);
+}
+
+/*
+ * Publish the display after a frame and wake waiting controllers. An
+ * unchanged display (by its hash) is not copied again.
+ */
+void shm_publish(struct shm_channel *c, const struct emulator *eml,
+                 enum eml_stat status) {
+    struct shm_frame *f = c->f;
+    uint32_t seq = f->seq;
+    __atomic_store_n(&f->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    f->status = status;
+    f->instr_count = eml->instr_count;
+    uint64_t hash = emulator_display_hash(eml);
+    if (!c->published || hash != f->display_hash) {
+        f->hires = eml->cpu.hires;
+        f->display_hash = hash;
+        memcpy(f->display, eml->cpu.display, sizeof f->display);
+        c->published = true;
+    }
+    __atomic_store_n(&f->frame, f->frame + 1, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&f->seq, seq + 2, __ATOMIC_RELEASE);
+    word_wake(&f->frame);
+}
+
+/* Apply the keys the controller changed since the last poll */
+void shm_poll_keys(struct shm_channel *c, struct emulator *eml) {
+    uint16_t keypad = __atomic_load_n(&c->f->keypad, __ATOMIC_ACQUIRE);
+    uint16_t changed = keypad ^ c->keypad;
+    while (changed) {
+        int k = __builtin_ctz(changed);
+        changed &= changed - 1;
+        if (keypad >> k & 1) {
+            emulator_key_down(eml, k);
+        } else {
+            emulator_key_up(eml, k);
+        }
+    }
+    c->keypad = keypad;
+}
+
+/*
+ * Whether the next frame may run: always outside of step mode, else once
+ * the controller stepped past the published frames. Waits up to
+ * timeout_ns for a step.
+ */
+bool shm_step_ready(struct shm_channel *c, int64_t timeout_ns) {
+    struct shm_frame *f = c->f;
+    if (!f->step_mode) {
+        return true;
+    }
+    int64_t deadline = clock_ns() + timeout_ns;
+    for (;;) {
+        uint32_t step = __atomic_load_n(&f->step, __ATOMIC_ACQUIRE);
+        if ((int32_t) (step - f->frame) > 0) {
+            return true;
+        }
+        int64_t left = deadline - clock_ns();
+        if (left <= 0) {
+            return false;
+        }
+        word_wait(&f->step, step, left);
+    }
+}
+
+/* Map the segment of a running emulator, NULL (with a message) on failure */
+struct shm_frame *shm_attach(const char *name) {
+    char path[256];
+    snprintf(path, sizeof path, "/%s", name[0] == '/' ? name + 1 : name);
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open shared memory %s\n", path);
+        return NULL;
+    }
+    void *m = mmap(NULL, sizeof(struct shm_frame), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "Unable to map shared memory %s\n", path);
+        return NULL;
+    }
+    struct shm_frame *f = m;
+    if (memcmp(f->magic, SHM_MAGIC, sizeof f->magic) != 0 ||
+        f->size != sizeof *f) {
+        fprintf(stderr, "Shared memory %s is no frame channel\n", path);
+        munmap(m, sizeof *f);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return f;
+}
+
+void shm_detach(struct shm_frame *f) {
+    munmap(f, sizeof *f);
+}
+
+/*
+ * Copy a consistent frame (DISP_WORDS words) out of the segment and
+ * return its number. Readers that want no copy can do the same seq checks
+ * around their own reads of f->display.
+ */
+uint32_t shm_read(const struct shm_frame *f, uint64_t *display, bool *hires) {
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        uint32_t frame = __atomic_load_n(&f->frame, __ATOMIC_RELAXED);
+        memcpy(display, f->display, sizeof f->display);
+        *hires = f->hires;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&f->seq, __ATOMIC_RELAXED) == seq) {
+            return frame;
+        }
+    }
+}
+
+/*
+ * Wait until a frame after seen is published, at most timeout_ns (< 0: no
+ * limit). Returns the current frame number.
+ */
+uint32_t shm_wait_frame(const struct shm_frame *f, uint32_t seen,
+                        int64_t timeout_ns) {
+    int64_t deadline = clock_ns() + timeout_ns;
+    for (;;) {
+        uint32_t frame = __atomic_load_n(&f->frame, __ATOMIC_ACQUIRE);
+        if (frame != seen) {
+            return frame;
+        }
+        int64_t left = timeout_ns < 0 ? -1 : deadline - clock_ns();
+        if (timeout_ns >= 0 && left <= 0) {
+            return frame;
+        }
+        word_wait(&f->frame, frame, left);
+    }
+}
+
+/* Set the held keys, the emulator applies them before its next frame */
+void shm_set_keys(struct shm_frame *f, uint16_t keypad) {
+    __atomic_store_n(&f->keypad, keypad, __ATOMIC_RELEASE);
+}
+
+/* Allow the emulator to run that many more frames in step mode */
+void shm_step(struct shm_frame *f, uint32_t frames) {
+    __atomic_add_fetch(&f->step, frames, __ATOMIC_RELEASE);
+    word_wake(&f->step);
+}
@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __SHM_H
+#define __SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "chip8.h"
+
+/* Identifies a frame channel segment and its layout */
+#define SHM_MAGIC "C8SHM001"
+
+/*
+ * Contents of a frame channel, a POSIX shared memory segment that an
+ * emulator publishes its frames to and takes its keys from.
+ *
+ * seq is a seqlock around the frame fields: odd while the emulator writes
+ * them. frame and step are futex words, the controller sleeps on frame and
+ * the emulator, in step mode, on step. The controller part is on its own
+ * cache line, keys don't bounce the display's lines.
+ */
+struct shm_frame {
+    char magic[8];                      /* SHM_MAGIC */
+    uint32_t size;                      /* sizeof(struct shm_frame) */
+    uint32_t step_mode;                 /* Emulator runs only stepped frames */
+
+    /* written by the emulator */
+    uint32_t seq __attribute__((aligned(CACHE_LINE)));
+    uint32_t frame;                     /* Frames published */
+    uint32_t status;                    /* enum eml_stat of the last frame */
+    uint32_t hires;                     /* display is 128x64, else 64x32 */
+    uint64_t instr_count;               /* Instructions executed */
+    uint64_t display_hash;              /* emulator_display_hash of display */
+    uint64_t display[DISP_WORDS];       /* Rows as in struct chip8 */
+
+    /* written by the controller */
+    uint32_t keypad __attribute__((aligned(CACHE_LINE))); /* Bit k: key k held */
+    uint32_t step;                      /* Frames allowed in step mode */
+};
+
+/* Emulator side of a channel */
+struct shm_channel {
+    struct shm_frame *f;                /* The mapped segment */
+    char *name;                         /* Segment name, unlinked on destroy */
+    uint16_t keypad;                    /* Keys as last applied */
+    bool published;                     /* The segment holds a frame */
+};
+
+/* Emulator functions */
+struct shm_channel *shm_create(const char *name, bool step_mode);
+void shm_destroy(struct shm_channel *c);
+void shm_publish(struct shm_channel *c, const struct emulator *eml,
+                 enum eml_stat status);
+void shm_poll_keys(struct shm_channel *c, struct emulator *eml);
+bool shm_step_ready(struct shm_channel *c, int64_t timeout_ns);
+
+/* Controller functions */
+struct shm_frame *shm_attach(const char *name);
+void shm_detach(struct shm_frame *f);
+uint32_t shm_read(const struct shm_frame *f, uint64_t *display, bool *hires);
+uint32_t shm_wait_frame(const struct shm_frame *f, uint32_t seen,
+                        int64_t timeout_ns);
+void shm_set_keys(struct shm_frame *f, uint16_t keypad);
+void shm_step(struct shm_frame *f, uint32_t frames);
+
+#endif
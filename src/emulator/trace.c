@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Binary instruction trace. Records are fixed-size and written in large
+ * chunks by a writer thread, so tracing costs the emulator a copy into the
+ * ring per instruction instead of formatted console output.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "trace.h"
+
+/* Records buffered between the emulator and the writer (8 MiB) */
+#define TRACE_RING_RECS (1 << 18)
+
+/* Writer poll interval when the ring is empty */
+#define TRACE_POLL_NS 200000
+
+static void *trace_writer(void *arg) {
+    struct trace *t = arg;
+    struct timespec poll = { 0, TRACE_POLL_NS };
+    for (;;) {
+        const void *recs;
+        size_t n = spsc_ring_peek(&t->ring, &recs);
+        if (n) {
+            fwrite(recs, sizeof(struct trace_rec), n, t->f);
+            spsc_ring_consume(&t->ring, n);
+        } else if (__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        } else {
+            nanosleep(&poll, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Create a trace file and start its writer, NULL on failure */
+struct trace *trace_open(const char *path) {
+    struct trace *t = calloc(1, sizeof *t);
+    if (!t) {
+        return NULL;
+    }
+    if (!spsc_ring_init(&t->ring, sizeof(struct trace_rec), TRACE_RING_RECS)) {
+        free(t);
+        return NULL;
+    }
+    t->f = fopen(path, "wb");
+    if (!t->f) {
+        fprintf(stderr, "Unable to write file %s\n", path);
+        spsc_ring_free(&t->ring);
+        free(t);
+        return NULL;
+    }
+
+    uint32_t hdr[2] = { sizeof(struct trace_rec), 0 };
+    fwrite(TRACE_MAGIC, 8, 1, t->f);
+    fwrite(hdr, sizeof hdr, 1, t->f);
+
+    if (pthread_create(&t->writer, NULL, trace_writer, t)) {
+        fprintf(stderr, "Unable to start trace writer thread\n");
+        fclose(t->f);
+        spsc_ring_free(&t->ring);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/* Write out the remaining records and close the file */
+void trace_close(struct trace *t) {
+    __atomic_store_n(&t->stop, true, __ATOMIC_RELEASE);
+    pthread_join(t->writer, NULL);
+    fclose(t->f);
+    if (t->stalls) {
+        fprintf(stderr, "Trace: emulator yielded to the writer %llu times\n",
+                (unsigned long long) t->stalls);
+    }
+    spsc_ring_free(&t->ring);
+    free(t);
+}
+
+/* Record the instruction emulator_cycle just executed */
+void trace_instr(struct trace *t, const struct emulator *eml) {
+    const struct chip8 *cpu = &eml->cpu;
+    struct trace_rec rec;
+    rec.pc = eml->prev_PC;
+    rec.opcode = eml->opcode;
+    rec.I = cpu->I;
+    rec.vmask = 0;
+    for (int i = 0; i < 16; i++) {
+        rec.vmask |= (cpu->V[i] != t->V[i]) << i;
+    }
+    rec.SP = cpu->SP;
+    rec.DT = cpu->DT;
+    rec.ST = cpu->ST;
+    rec.reserved = 0;
+    memcpy(rec.V, cpu->V, sizeof rec.V);
+    memcpy(t->V, cpu->V, sizeof t->V);
+
+    /* never drop records, wait for the writer instead */
+    while (!spsc_ring_push(&t->ring, &rec)) {
+        t->stalls++;
+        sched_yield();
+    }
+}
@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "chip8.h"
+#include "ring.h"
+
+/*
+ * Trace file: TRACE_MAGIC, the record size as uint32_t, 4 reserved bytes,
+ * then one record per executed instruction. All fields are in host byte
+ * order.
+ */
+#define TRACE_MAGIC "C8TRACE1"
+
+/* State after one instruction */
+struct trace_rec {
+    uint16_t pc;                        /* Address of the instruction */
+    uint16_t opcode;                    /* Executed opcode */
+    uint16_t I;                         /* Address register */
+    uint16_t vmask;                     /* V registers the instruction changed */
+    uint8_t SP;                         /* Stack pointer */
+    uint8_t DT;                         /* Delay timer */
+    uint8_t ST;                         /* Sound timer */
+    uint8_t reserved;
+    uint8_t V[16];                      /* V0 to VF */
+};
+
+/*
+ * Trace writer. The emulator thread appends records to the ring, a
+ * background thread drains it into the file.
+ */
+struct trace {
+    struct spsc_ring ring;              /* Records not written yet */
+    FILE *f;                            /* Trace file */
+    pthread_t writer;                   /* Drains ring into f */
+    bool stop;                          /* Writer exits once ring is empty */
+    uint8_t V[16];                      /* V registers of the last record */
+    uint64_t stalls;                    /* Yields while the ring was full */
+};
+
+/* Trace functions */
+struct trace *trace_open(const char *path);
+void trace_close(struct trace *t);
+void trace_instr(struct trace *t, const struct emulator *eml);
+
+#endif
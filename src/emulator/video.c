@@ -0,0 +1,245 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Lossless display recording. Only frames whose display hash changed are
+ * queued, and the writer stores each as runs of its XOR with the previous
+ * one, so a mostly static game costs a few bytes per change.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#include "video.h"
+
+/* Frames buffered between the emulator and the writer (1 MiB) */
+#define VIDEO_RING_RECS 1024
+
+/* Writer poll interval when the ring is empty */
+#define VIDEO_POLL_NS 1000000
+
+/* stdio buffer of the file */
+#define VIDEO_IO_BUF (1 << 20)
+
+/* Zero bytes that end a literal run */
+#define VIDEO_ZERO_RUN 3
+
+static void put_varint(FILE *f, uint64_t v) {
+    do {
+        fputc((v & 0x7F) | (v > 0x7F) << 7, f);
+        v >>= 7;
+    } while (v);
+}
+
+static bool get_varint(FILE *f, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = fgetc(f);
+        if (c == EOF) {
+            return false;
+        }
+        *v |= (uint64_t) (c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Encode a frame as runs of its XOR with the previous one */
+static void write_rec(struct video *v, const struct video_rec *rec) {
+    uint8_t cur[VIDEO_BYTES(1)];
+    int n = VIDEO_BYTES(rec->hires);
+    for (int i = 0; i < n / 8; i++) {
+        for (int k = 0; k < 8; k++) {
+            cur[8 * i + k] = rec->display[i] >> (56 - 8 * k);
+        }
+    }
+    if (rec->hires != v->prev_hires) {
+        memset(v->prev, 0, sizeof v->prev);
+        v->prev_hires = rec->hires;
+    }
+    uint8_t d[VIDEO_BYTES(1)];
+    for (int i = 0; i < n; i++) {
+        d[i] = cur[i] ^ v->prev[i];
+    }
+    memcpy(v->prev, cur, n);
+
+    put_varint(v->f, rec->frame - v->prev_frame);
+    fputc(rec->hires, v->f);
+    v->prev_frame = rec->frame;
+
+    int i = 0;
+    while (i < n) {
+        int zeros = 0;
+        while (i + zeros < n && !d[i + zeros]) {
+            zeros++;
+        }
+        /* literals run until VIDEO_ZERO_RUN zeros in a row or the end */
+        int start = i + zeros;
+        int end = start;
+        int run = 0;
+        while (end < n && run < VIDEO_ZERO_RUN) {
+            run = d[end] ? 0 : run + 1;
+            end++;
+        }
+        if (run == VIDEO_ZERO_RUN || (end == n && run)) {
+            end -= run;
+        }
+        put_varint(v->f, zeros);
+        put_varint(v->f, end - start);
+        fwrite(d + start, 1, end - start, v->f);
+        i = end;
+    }
+}
+
+static void *video_writer(void *arg) {
+    struct video *v = arg;
+    struct timespec poll = { 0, VIDEO_POLL_NS };
+    for (;;) {
+        const void *recs;
+        size_t n = spsc_ring_peek(&v->ring, &recs);
+        if (n) {
+            for (size_t i = 0; i < n; i++) {
+                write_rec(v, (const struct video_rec *) recs + i);
+            }
+            spsc_ring_consume(&v->ring, n);
+        } else if (__atomic_load_n(&v->stop, __ATOMIC_ACQUIRE)) {
+            break;
+        } else {
+            nanosleep(&poll, NULL);
+        }
+    }
+    return NULL;
+}
+
+/* Create a video file and start its writer, NULL on failure */
+struct video *video_open(const char *path) {
+    struct video *v = calloc(1, sizeof *v);
+    if (!v) {
+        return NULL;
+    }
+    if (!spsc_ring_init(&v->ring, sizeof(struct video_rec), VIDEO_RING_RECS)) {
+        free(v);
+        return NULL;
+    }
+    v->f = fopen(path, "wb");
+    if (!v->f) {
+        fprintf(stderr, "Unable to write file %s\n", path);
+        spsc_ring_free(&v->ring);
+        free(v);
+        return NULL;
+    }
+    setvbuf(v->f, NULL, _IOFBF, VIDEO_IO_BUF);
+    fwrite(VIDEO_MAGIC, 8, 1, v->f);
+
+    if (pthread_create(&v->writer, NULL, video_writer, v)) {
+        fprintf(stderr, "Unable to start video writer thread\n");
+        fclose(v->f);
+        spsc_ring_free(&v->ring);
+        free(v);
+        return NULL;
+    }
+    return v;
+}
+
+/* Write out the remaining frames and close the file */
+void video_close(struct video *v) {
+    __atomic_store_n(&v->stop, true, __ATOMIC_RELEASE);
+    pthread_join(v->writer, NULL);
+    fclose(v->f);
+    if (v->stalls) {
+        fprintf(stderr, "Video: emulator yielded to the writer %llu times\n",
+                (unsigned long long) v->stalls);
+    }
+    spsc_ring_free(&v->ring);
+    free(v);
+}
+
+/* Queue the display as frame number frame, if it changed */
+void video_frame(struct video *v, const struct emulator *eml, uint64_t frame) {
+    uint64_t hash = emulator_display_hash(eml);
+    if (v->started && hash == v->hash) {
+        return;
+    }
+    v->started = true;
+    v->hash = hash;
+
+    struct video_rec rec;
+    rec.frame = frame;
+    rec.hires = eml->cpu.hires;
+    memcpy(rec.display, eml->cpu.display, sizeof rec.display);
+
+    /* never drop frames, wait for the writer instead */
+    while (!spsc_ring_push(&v->ring, &rec)) {
+        v->stalls++;
+        sched_yield();
+    }
+}
+
+/* Open a video file for reading, false (with a message) on failure */
+bool video_reader_open(struct video_reader *r, const char *path) {
+    memset(r, 0, sizeof *r);
+    r->f = fopen(path, "rb");
+    if (!r->f) {
+        fprintf(stderr, "Unable to read file %s\n", path);
+        return false;
+    }
+    char magic[8];
+    if (fread(magic, sizeof magic, 1, r->f) != 1 ||
+        memcmp(magic, VIDEO_MAGIC, sizeof magic) != 0) {
+        fprintf(stderr, "Not a video file: %s\n", path);
+        fclose(r->f);
+        return false;
+    }
+    return true;
+}
+
+void video_reader_close(struct video_reader *r) {
+    fclose(r->f);
+}
+
+/* Decode the next record: 1 if there is one, 0 at the end, -1 if corrupt */
+int video_read(struct video_reader *r) {
+    uint64_t delta;
+    if (!get_varint(r->f, &delta)) {
+        return 0;
+    }
+    int flags = fgetc(r->f);
+    if (flags == EOF) {
+        return -1;
+    }
+    bool hires = flags & 1;
+    if (hires != r->hires) {
+        memset(r->pixels, 0, sizeof r->pixels);
+        r->hires = hires;
+    }
+    r->frame += delta;
+
+    uint64_t n = VIDEO_BYTES(hires);
+    uint64_t i = 0;
+    while (i < n) {
+        uint64_t zeros, lits;
+        /* compared separately, the sum of corrupt counts may wrap */
+        if (!get_varint(r->f, &zeros) || !get_varint(r->f, &lits) ||
+            zeros > n - i || lits > n - i - zeros || zeros + lits == 0) {
+            return -1;
+        }
+        i += zeros;
+        for (uint64_t k = 0; k < lits; k++, i++) {
+            int c = fgetc(r->f);
+            if (c == EOF) {
+                return -1;
+            }
+            r->pixels[i] ^= c;
+        }
+    }
+    return 1;
+}
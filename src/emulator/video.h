@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+#ifndef __VIDEO_H
+#define __VIDEO_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "chip8.h"
+#include "ring.h"
+
+/*
+ * Video file: VIDEO_MAGIC, then one record per frame in which the display
+ * changed:
+ *
+ *   varint  Frames since the previous record (the first: since frame 0)
+ *   byte    Flags, bit 0: 128x64 mode
+ *   runs    The frame's bytes XOR the previous frame's, as pairs of
+ *           varints (zero bytes, literal bytes) each followed by the
+ *           literal bytes, until all bytes of the frame are covered
+ *
+ * A frame is its rows top to bottom, 8 pixels per byte with the leftmost
+ * in the MSB: 256 bytes at 64x32, 1024 at 128x64. Before the first record
+ * and after a mode change the previous frame is blank. Varints are
+ * LEB128.
+ */
+#define VIDEO_MAGIC "C8VIDEO1"
+
+/* Size of a frame in bytes, by mode */
+#define VIDEO_BYTES(hires) ((hires) ? DISP_HI_W / 8 * DISP_HI_H : DISP_W / 8 * DISP_H)
+
+/* Display handed from the emulator to the writer */
+struct video_rec {
+    uint64_t frame;                     /* Frame number */
+    uint64_t display[DISP_WORDS];       /* As in struct chip8 */
+    bool hires;
+};
+
+/*
+ * Video writer. The emulator thread queues the changed frames, a
+ * background thread encodes them and writes the file.
+ */
+struct video {
+    struct spsc_ring ring;              /* Frames not written yet */
+    FILE *f;                            /* Video file */
+    pthread_t writer;                   /* Drains ring into f */
+    bool stop;                          /* Writer exits once ring is empty */
+    bool started;                       /* A frame was queued */
+    uint64_t hash;                      /* Display hash of the last one */
+    uint64_t stalls;                    /* Yields while the ring was full */
+
+    /* owned by the writer */
+    uint8_t prev[VIDEO_BYTES(1)];       /* Last written frame */
+    bool prev_hires;
+    uint64_t prev_frame;
+};
+
+/* Reads a video file record by record */
+struct video_reader {
+    FILE *f;
+    uint8_t pixels[VIDEO_BYTES(1)];     /* Current frame, packed */
+    bool hires;
+    uint64_t frame;                     /* Its frame number */
+};
+
+/* Writer functions */
+struct video *video_open(const char *path);
+void video_close(struct video *v);
+void video_frame(struct video *v, const struct emulator *eml, uint64_t frame);
+
+/* Reader functions */
+bool video_reader_open(struct video_reader *r, const char *path);
+void video_reader_close(struct video_reader *r);
+int video_read(struct video_reader *r);
+
+#endif
@@ -0,0 +1,599 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Python binding: chip8.VecEnv runs N instances of one rom and steps them
+ * all in one call. Actions, frames, rewards and done flags are exchanged
+ * through caller-provided buffers (NumPy arrays, bytearrays, ...), so a
+ * step allocates nothing, and the GIL is released while the instances
+ * run.
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chip8.h"
+#include "rom.h"
+#include "arena.h"
+
+/* A RAM byte whose change is paid out as reward */
+struct reward_term {
+    uint16_t addr;                      /* Address in the chip8 memory */
+    float weight;                       /* Reward per unit of increase */
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct rom_image rom;               /* Image all instances run */
+    struct arena arena;                 /* Holds emls */
+    struct emulator *emls;              /* The instances */
+    uint8_t *stopped;                   /* Per instance: faulted or exited */
+    struct reward_term *terms;
+    uint8_t *before;                    /* Reward bytes before a step */
+    int n;                              /* Number of instances */
+    int n_terms;
+    int frame_skip;                     /* Frames per step */
+    bool busy;                          /* A step runs without the GIL */
+} VecEnvObject;
+
+/* Byte i of the table: its 8 bits as 8 bytes of 0 or 1, MSB first */
+static uint64_t pixel_lut[256];
+
+static void pixel_lut_init() {
+    for (int i = 0; i < 256; i++) {
+        uint8_t b[8];
+        for (int k = 0; k < 8; k++) {
+            b[k] = (i >> (7 - k)) & 1;
+        }
+        memcpy(&pixel_lut[i], b, 8);
+    }
+}
+
+/* Expand the 64 pixels of a row word into bytes */
+static void put_row(uint8_t *out, uint64_t w) {
+    for (int k = 0; k < 8; k++) {
+        memcpy(out + 8 * k, &pixel_lut[(w >> (56 - 8 * k)) & 0xFF], 8);
+    }
+}
+
+/* 32 bits from 64, each the OR of a pair of adjacent bits */
+static uint64_t fold(uint64_t w) {
+    w = (w | w >> 1) & 0x5555555555555555ULL;
+    w = (w | w >> 1) & 0x3333333333333333ULL;
+    w = (w | w >> 2) & 0x0F0F0F0F0F0F0F0FULL;
+    w = (w | w >> 4) & 0x00FF00FF00FF00FFULL;
+    w = (w | w >> 8) & 0x0000FFFF0000FFFFULL;
+    w = (w | w >> 16) & 0x00000000FFFFFFFFULL;
+    return w;
+}
+
+/* 64 bits from the low 32, each bit doubled */
+static uint64_t spread(uint64_t w) {
+    w &= 0xFFFFFFFFULL;
+    w = (w | w << 16) & 0x0000FFFF0000FFFFULL;
+    w = (w | w << 8) & 0x00FF00FF00FF00FFULL;
+    w = (w | w << 4) & 0x0F0F0F0F0F0F0F0FULL;
+    w = (w | w << 2) & 0x3333333333333333ULL;
+    w = (w | w << 1) & 0x5555555555555555ULL;
+    return w | w << 1;
+}
+
+/*
+ * Write the display as one byte per pixel. A 64x32 frame of a 128x64
+ * display ORs 2x2 pixels, a 128x64 frame of a 64x32 display doubles them.
+ */
+static void put_frame(uint8_t *out, const struct chip8 *cpu, bool big) {
+    const uint64_t *d = cpu->display;
+    if (!big) {
+        for (int r = 0; r < DISP_H; r++, out += DISP_W) {
+            if (cpu->hires) {
+                uint64_t left = d[4 * r] | d[4 * r + 2];
+                uint64_t right = d[4 * r + 1] | d[4 * r + 3];
+                put_row(out, fold(left) << 32 | fold(right));
+            } else {
+                put_row(out, d[r]);
+            }
+        }
+        return;
+    }
+    for (int r = 0; r < DISP_HI_H; r++, out += DISP_HI_W) {
+        if (cpu->hires) {
+            put_row(out, d[2 * r]);
+            put_row(out + 64, d[2 * r + 1]);
+        } else {
+            put_row(out, spread(d[r / 2] >> 32));
+            put_row(out + 64, spread(d[r / 2]));
+        }
+    }
+}
+
+/* Hold the keys of a bitmap, key events make Fx0A see new presses */
+static void set_keys(struct emulator *eml, uint16_t keypad) {
+    uint16_t changed = keypad ^ eml->keypad;
+    while (changed) {
+        int k = __builtin_ctz(changed);
+        changed &= changed - 1;
+        if (keypad >> k & 1) {
+            emulator_key_down(eml, k);
+        } else {
+            emulator_key_up(eml, k);
+        }
+    }
+}
+
+/* Whether a buffer holds elements of the struct module format code c */
+static bool format_is(const Py_buffer *v, char c) {
+    const char *f = v->format ? v->format : "B";
+    if (*f == '@' || *f == '=' || *f == '<') {
+        f++;
+    }
+    return f[0] == c && f[1] == '\0';
+}
+
+/*
+ * Get a C-contiguous buffer of n elements (any number if n < 0), false
+ * with an exception set
+ */
+static bool get_buffer(PyObject *obj, Py_buffer *v, bool writable,
+                       Py_ssize_t n, const char *name) {
+    int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+    if (PyObject_GetBuffer(obj, v, writable ? flags | PyBUF_WRITABLE : flags)) {
+        return false;
+    }
+    if (v->itemsize == 0 || (n >= 0 && v->len / v->itemsize != n)) {
+        PyErr_Format(PyExc_ValueError, "%s: expected %zd elements, got %zd",
+                     name, n, v->itemsize ? v->len / v->itemsize : 0);
+        PyBuffer_Release(v);
+        return false;
+    }
+    return true;
+}
+
+static void VecEnv_dealloc(VecEnvObject *self) {
+    arena_free(&self->arena);
+    rom_image_unload(&self->rom);
+    PyMem_Free(self->stopped);
+    PyMem_Free(self->terms);
+    PyMem_Free(self->before);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int VecEnv_init(VecEnvObject *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = { "rom", "n", "frame_skip", "seed", "quirks",
+                              "engine", "clock_speed", "reward", NULL };
+    const char *path;
+    int n;
+    int frame_skip = 1;
+    unsigned int seed = 1;
+    const char *quirks = "auto";
+    const char *engine = "threaded";
+    int clock_speed = 1080;
+    PyObject *reward = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "si|iIssiO", kwlist, &path,
+                                     &n, &frame_skip, &seed, &quirks, &engine,
+                                     &clock_speed, &reward)) {
+        return -1;
+    }
+    if (self->emls) {
+        PyErr_SetString(PyExc_RuntimeError, "VecEnv is already initialized");
+        return -1;
+    }
+    if (n <= 0 || frame_skip <= 0 || clock_speed <= 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "n, frame_skip and clock_speed must be positive");
+        return -1;
+    }
+    /* a seed of 0 means 1 to the generator, it would repeat an instance */
+    if ((uint32_t) (seed + n - 1) < seed || seed == 0) {
+        PyErr_SetString(PyExc_ValueError, "seed + i must not be 0 or wrap");
+        return -1;
+    }
+    int q = strcmp(quirks, "auto") == 0 ? -1 : emulator_quirks_parse(quirks);
+    if (q < 0 && strcmp(quirks, "auto") != 0) {
+        PyErr_Format(PyExc_ValueError, "Unknown quirks profile: %s", quirks);
+        return -1;
+    }
+    enum eml_engine eng;
+    if (strcmp(engine, "interp") == 0) {
+        eng = ENGINE_INTERP;
+    } else if (strcmp(engine, "threaded") == 0) {
+        eng = ENGINE_THREADED;
+    } else {
+        PyErr_Format(PyExc_ValueError, "Unknown engine: %s", engine);
+        return -1;
+    }
+
+    /* reward: sequence of (address, weight) */
+    if (reward) {
+        PyObject *seq = PySequence_Fast(reward, "reward must be a sequence");
+        if (!seq) {
+            return -1;
+        }
+        Py_ssize_t k = PySequence_Fast_GET_SIZE(seq);
+        self->terms = PyMem_Calloc(k ? k : 1, sizeof *self->terms);
+        self->before = PyMem_Calloc(k ? k : 1, sizeof *self->before);
+        for (Py_ssize_t i = 0; i < k && self->terms && self->before; i++) {
+            unsigned int addr;
+            float weight;
+            if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "If",
+                                  &addr, &weight)) {
+                Py_DECREF(seq);
+                return -1;
+            }
+            if (addr >= MEM_SIZE) {
+                PyErr_Format(PyExc_ValueError, "Reward address 0x%X is out "
+                             "of memory", addr);
+                Py_DECREF(seq);
+                return -1;
+            }
+            self->terms[i].addr = addr;
+            self->terms[i].weight = weight;
+        }
+        self->n_terms = k;
+        Py_DECREF(seq);
+        if (!self->terms || !self->before) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    if (!rom_image_load(&self->rom, path)) {
+        PyErr_Format(PyExc_OSError, "Unable to load rom %s", path);
+        return -1;
+    }
+    self->stopped = PyMem_Calloc(n, 1);
+    size_t size = (size_t) n * sizeof(struct emulator) + CACHE_LINE;
+    if (!self->stopped || !arena_init(&self->arena, size) ||
+        !(self->emls = arena_alloc_emulators(&self->arena, n))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->n = n;
+    self->frame_skip = frame_skip;
+    for (int i = 0; i < n; i++) {
+        struct emulator *eml = &self->emls[i];
+        emulator_init(eml);
+        eml->engine = eng;
+        eml->clock_speed = clock_speed;
+        eml->quirks = q < 0 ? rom_quirks(&self->rom) : (enum eml_quirks) q;
+        emulator_seed(eml, seed + i);
+        emulator_load_image(eml, &self->rom);
+    }
+    return 0;
+}
+
+static bool check_idle(VecEnvObject *self) {
+    if (!self->emls) {
+        PyErr_SetString(PyExc_RuntimeError, "VecEnv is not initialized");
+        return false;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "VecEnv is stepping in another "
+                        "thread");
+        return false;
+    }
+    return true;
+}
+
+/* Run the frames of one step of instance i, returns its reward */
+static float step_one(VecEnvObject *self, int i, uint16_t keypad) {
+    struct emulator *eml = &self->emls[i];
+    if (self->stopped[i]) {
+        return 0;
+    }
+    uint8_t *before = self->before;
+    for (int t = 0; t < self->n_terms; t++) {
+        before[t] = eml->cpu.memory[self->terms[t].addr];
+    }
+    set_keys(eml, keypad);
+    for (int f = 0; f < self->frame_skip; f++) {
+        enum eml_stat status = emulator_frame(eml);
+        if (status != EML_OK && status != EML_REDRAW) {
+            self->stopped[i] = status;
+            break;
+        }
+    }
+    float reward = 0;
+    for (int t = 0; t < self->n_terms; t++) {
+        int diff = eml->cpu.memory[self->terms[t].addr] - before[t];
+        reward += self->terms[t].weight * diff;
+    }
+    return reward;
+}
+
+PyDoc_STRVAR(step_doc,
+"step(actions, frames, rewards, dones=None) -> int\n\n"
+"Hold the keys of actions and run frame_skip frames on every instance.\n"
+"actions: n uint8 key numbers (16 or more: no key) or n uint16 keypad\n"
+"bitmaps. frames: uint8 of shape (n, 32, 64) or (n, 64, 128), filled\n"
+"with the displays (0 or 1 per pixel). rewards: n float32, the weighted\n"
+"increase of the reward bytes. dones: n bytes, 1 for stopped instances.\n"
+"Stopped instances keep their last frame until reset. Returns the number\n"
+"of stopped instances.");
+
+static PyObject *VecEnv_step(VecEnvObject *self, PyObject *args,
+                             PyObject *kwds) {
+    static char *kwlist[] = { "actions", "frames", "rewards", "dones", NULL };
+    PyObject *o_actions, *o_frames, *o_rewards, *o_dones = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO|O", kwlist, &o_actions,
+                                     &o_frames, &o_rewards, &o_dones) ||
+        !check_idle(self)) {
+        return NULL;
+    }
+    int n = self->n;
+    Py_buffer actions, frames, rewards, dones;
+    if (!get_buffer(o_actions, &actions, false, n, "actions")) {
+        return NULL;
+    }
+    bool bitmaps = format_is(&actions, 'H');
+    if (!bitmaps && !format_is(&actions, 'B')) {
+        PyErr_SetString(PyExc_TypeError, "actions must be uint8 or uint16");
+        PyBuffer_Release(&actions);
+        return NULL;
+    }
+    if (!get_buffer(o_frames, &frames, true, -1, "frames")) {
+        PyBuffer_Release(&actions);
+        return NULL;
+    }
+    const Py_ssize_t *shape = frames.shape;
+    bool big = frames.ndim == 3 && shape[1] == DISP_HI_H &&
+               shape[2] == DISP_HI_W;
+    bool small = frames.ndim == 3 && shape[1] == DISP_H && shape[2] == DISP_W;
+    if (!format_is(&frames, 'B')) {
+        PyErr_SetString(PyExc_TypeError, "frames must be uint8");
+        PyBuffer_Release(&frames);
+        PyBuffer_Release(&actions);
+        return NULL;
+    }
+    if ((!big && !small) || shape[0] != n) {
+        PyErr_Format(PyExc_ValueError, "frames: expected shape (%d, 32, 64) "
+                     "or (%d, 64, 128)", n, n);
+        PyBuffer_Release(&frames);
+        PyBuffer_Release(&actions);
+        return NULL;
+    }
+    if (!get_buffer(o_rewards, &rewards, true, n, "rewards")) {
+        PyBuffer_Release(&frames);
+        PyBuffer_Release(&actions);
+        return NULL;
+    }
+    if (!format_is(&rewards, 'f')) {
+        PyErr_SetString(PyExc_TypeError, "rewards must be float32");
+        PyBuffer_Release(&rewards);
+        PyBuffer_Release(&frames);
+        PyBuffer_Release(&actions);
+        return NULL;
+    }
+    bool with_dones = o_dones != Py_None;
+    if (with_dones) {
+        bool ok = get_buffer(o_dones, &dones, true, n, "dones");
+        if (ok && dones.itemsize != 1) {
+            PyErr_SetString(PyExc_TypeError, "dones must be 1 byte each");
+            PyBuffer_Release(&dones);
+            ok = false;
+        }
+        if (!ok) {
+            PyBuffer_Release(&rewards);
+            PyBuffer_Release(&frames);
+            PyBuffer_Release(&actions);
+            return NULL;
+        }
+    }
+
+    self->busy = true;
+    int n_stopped = 0;
+    Py_BEGIN_ALLOW_THREADS
+    size_t frame_size = big ? DISP_HI_W * DISP_HI_H : DISP_W * DISP_H;
+    for (int i = 0; i < n; i++) {
+        uint16_t keypad;
+        if (bitmaps) {
+            keypad = ((const uint16_t *) actions.buf)[i];
+        } else {
+            uint8_t key = ((const uint8_t *) actions.buf)[i];
+            keypad = key < 16 ? 1 << key : 0;
+        }
+        ((float *) rewards.buf)[i] = step_one(self, i, keypad);
+        put_frame((uint8_t *) frames.buf + i * frame_size, &self->emls[i].cpu,
+                  big);
+        if (with_dones) {
+            ((uint8_t *) dones.buf)[i] = self->stopped[i] != 0;
+        }
+        n_stopped += self->stopped[i] != 0;
+    }
+    Py_END_ALLOW_THREADS
+    self->busy = false;
+
+    if (with_dones) {
+        PyBuffer_Release(&dones);
+    }
+    PyBuffer_Release(&rewards);
+    PyBuffer_Release(&frames);
+    PyBuffer_Release(&actions);
+    return PyLong_FromLong(n_stopped);
+}
+
+/* Index argument of the per-instance methods, -1 with an exception set */
+static int instance(VecEnvObject *self, int i) {
+    if (i < 0 || i >= self->n) {
+        PyErr_SetString(PyExc_IndexError, "instance index out of range");
+        return -1;
+    }
+    return i;
+}
+
+PyDoc_STRVAR(reset_doc,
+"reset(i=None)\n\n"
+"Put instance i, or all instances, back to the state after loading the\n"
+"rom. Random generators keep running, resets don't repeat episodes.");
+
+static PyObject *VecEnv_reset(VecEnvObject *self, PyObject *args) {
+    int i = -1;
+    if (!PyArg_ParseTuple(args, "|i", &i) || !check_idle(self)) {
+        return NULL;
+    }
+    int first = 0, last = self->n;
+    if (i != -1) {
+        if (instance(self, i) < 0) {
+            return NULL;
+        }
+        first = i;
+        last = i + 1;
+    }
+    for (int k = first; k < last; k++) {
+        emulator_reset(&self->emls[k], &self->rom);
+        self->stopped[k] = 0;
+    }
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(status_doc,
+"status(i) -> str\n\n"
+"Why instance i stopped (as printed by chip8-batch), \"ok\" if it runs.");
+
+static PyObject *VecEnv_status(VecEnvObject *self, PyObject *args) {
+    int i;
+    if (!PyArg_ParseTuple(args, "i", &i) || !check_idle(self) ||
+        instance(self, i) < 0) {
+        return NULL;
+    }
+    return PyUnicode_FromString(emulator_stat_str(self->stopped[i]));
+}
+
+PyDoc_STRVAR(hash_doc,
+"hash(i) -> int\n\n"
+"State hash of instance i, the one chip8-batch prints.");
+
+static PyObject *VecEnv_hash(VecEnvObject *self, PyObject *args) {
+    int i;
+    if (!PyArg_ParseTuple(args, "i", &i) || !check_idle(self) ||
+        instance(self, i) < 0) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(emulator_hash(&self->emls[i]));
+}
+
+PyDoc_STRVAR(display_hash_doc,
+"display_hash(i) -> int\n\n"
+"Fingerprint of the display of instance i, equal for equal pictures.");
+
+static PyObject *VecEnv_display_hash(VecEnvObject *self, PyObject *args) {
+    int i;
+    if (!PyArg_ParseTuple(args, "i", &i) || !check_idle(self) ||
+        instance(self, i) < 0) {
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(emulator_display_hash(&self->emls[i]));
+}
+
+PyDoc_STRVAR(peek_doc,
+"peek(i, addr, n=1) -> bytes\n\n"
+"n bytes of the memory of instance i, starting at addr.");
+
+static PyObject *VecEnv_peek(VecEnvObject *self, PyObject *args) {
+    int i;
+    unsigned int addr;
+    unsigned int len = 1;
+    if (!PyArg_ParseTuple(args, "iI|I", &i, &addr, &len) ||
+        !check_idle(self) || instance(self, i) < 0) {
+        return NULL;
+    }
+    if (addr > MEM_SIZE || len > MEM_SIZE - addr) {
+        PyErr_SetString(PyExc_ValueError, "range is out of memory");
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize(
+        (const char *) self->emls[i].cpu.memory + addr, len);
+}
+
+static PyObject *VecEnv_get_n(VecEnvObject *self, void *closure) {
+    (void) closure;
+    return PyLong_FromLong(self->n);
+}
+
+static PyObject *VecEnv_get_frame_skip(VecEnvObject *self, void *closure) {
+    (void) closure;
+    return PyLong_FromLong(self->frame_skip);
+}
+
+static PyObject *VecEnv_get_quirks(VecEnvObject *self, void *closure) {
+    (void) closure;
+    if (!self->emls) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(emulator_quirks(self->emls[0].quirks)->name);
+}
+
+static PyMethodDef VecEnv_methods[] = {
+    { "step", (PyCFunction) (void (*)(void)) VecEnv_step,
+      METH_VARARGS | METH_KEYWORDS, step_doc },
+    { "reset", (PyCFunction) VecEnv_reset, METH_VARARGS, reset_doc },
+    { "status", (PyCFunction) VecEnv_status, METH_VARARGS, status_doc },
+    { "hash", (PyCFunction) VecEnv_hash, METH_VARARGS, hash_doc },
+    { "display_hash", (PyCFunction) VecEnv_display_hash, METH_VARARGS,
+      display_hash_doc },
+    { "peek", (PyCFunction) VecEnv_peek, METH_VARARGS, peek_doc },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef VecEnv_getset[] = {
+    { "n", (getter) VecEnv_get_n, NULL, "Number of instances", NULL },
+    { "frame_skip", (getter) VecEnv_get_frame_skip, NULL, "Frames per step",
+      NULL },
+    { "quirks", (getter) VecEnv_get_quirks, NULL, "Quirks profile", NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+PyDoc_STRVAR(VecEnv_doc,
+"VecEnv(rom, n, frame_skip=1, seed=1, quirks='auto', engine='threaded',\n"
+"       clock_speed=1080, reward=())\n\n"
+"n instances of a rom, stepped together. Instance i is seeded with\n"
+"seed + i, which must not reach 0 (seeds 0 and 1 are the same). reward\n"
+"is a sequence of (address, weight) pairs: a step pays weight times the\n"
+"change of each byte. Steps release the GIL; to use several cores, step\n"
+"one VecEnv per thread.");
+
+static PyTypeObject VecEnvType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "chip8.VecEnv",
+    .tp_doc = VecEnv_doc,
+    .tp_basicsize = sizeof(VecEnvObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) VecEnv_init,
+    .tp_dealloc = (destructor) VecEnv_dealloc,
+    .tp_methods = VecEnv_methods,
+    .tp_getset = VecEnv_getset,
+};
+
+static struct PyModuleDef chip8_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "chip8",
+    .m_doc = "Batched Chip8 emulation",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_chip8(void) {
+    pixel_lut_init();
+    if (PyType_Ready(&VecEnvType) < 0) {
+        return NULL;
+    }
+    PyObject *m = PyModule_Create(&chip8_module);
+    if (!m) {
+        return NULL;
+    }
+    Py_INCREF(&VecEnvType);
+    if (PyModule_AddObject(m, "VecEnv", (PyObject *) &VecEnvType) < 0) {
+        Py_DECREF(&VecEnvType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    PyModule_AddIntConstant(m, "DISP_W", DISP_W);
+    PyModule_AddIntConstant(m, "DISP_H", DISP_H);
+    return m;
+}
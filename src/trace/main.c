@@ -0,0 +1,84 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Trace decoder. Prints a binary trace written by chip8-eml -d as text,
+ * one line per instruction in the format of the old debug output.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+static void prt_usage() {
+    static const char *usage =
+        "Usage: chip8-trace [options] [file]\n\n"
+        "  -h           Print this message and exit\n"
+        "  -v           Also print I, the timers and the changed registers\n";
+    fprintf(stdout, "%s", usage);
+}
+
+int main(int argc, char **argv) {
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hv")) != -1) {
+        switch (opt) {
+        case 'h':
+            prt_usage();
+            exit(EXIT_SUCCESS);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            prt_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        prt_usage();
+        fprintf(stderr, "\nError: Expected file name argument\n");
+        exit(EXIT_FAILURE);
+    }
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) {
+        fprintf(stderr, "Unable to read file %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    char magic[8];
+    uint32_t hdr[2];
+    if (fread(magic, sizeof magic, 1, f) != 1 || fread(hdr, sizeof hdr, 1, f) != 1 ||
+        memcmp(magic, TRACE_MAGIC, sizeof magic) != 0 ||
+        hdr[0] != sizeof(struct trace_rec)) {
+        fprintf(stderr, "Not a trace file: %s\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct trace_rec rec;
+    while (fread(&rec, sizeof rec, 1, f) == 1) {
+        fprintf(stdout, "PC=%04u, SP=%02u, opcode=0x%04X", rec.pc, rec.SP,
+                rec.opcode);
+        if (verbose) {
+            fprintf(stdout, ", I=0x%03X, DT=%u, ST=%u", rec.I, rec.DT, rec.ST);
+            for (int i = 0; i < 16; i++) {
+                if (rec.vmask & (1 << i)) {
+                    fprintf(stdout, ", V%X=0x%02X", i, rec.V[i]);
+                }
+            }
+        }
+        fputc('\n', stdout);
+    }
+    fclose(f);
+    return 0;
+}
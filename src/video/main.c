@@ -0,0 +1,292 @@
+/**
+ * Copyright (c) 2018, Lukas Tobler
+ * GNU General Public License v3.0
+ * (see LICENSE or https://www.gnu.org/licenses/gpl-3.0.txt)
+ */
+
+/*
+ * Video converter. Turns a display recording written by chip8-eml -r into
+ * a y4m stream at 60 fps (for ffmpeg and most encoders) or a sequence of
+ * PNG images.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "video.h"
+
+/* Largest stored deflate block */
+#define DEFLATE_BLOCK 65535
+
+enum format {
+    FORMAT_Y4M,
+    FORMAT_PNG
+};
+
+static int scale = 4;                   /* Output pixels per 128x64 pixel */
+static uint8_t *image;                  /* Rendered frame, 8 bit gray */
+static int width;
+static int height;
+
+/* Render the current frame, 64x32 frames at twice the scale */
+static void render(const struct video_reader *r, int w, int h) {
+    int cols = r->hires ? DISP_HI_W : DISP_W;
+    int rows = r->hires ? DISP_HI_H : DISP_H;
+    int sx = w / cols;
+    int sy = h / rows;
+    for (int y = 0; y < h; y++) {
+        const uint8_t *row = r->pixels + y / sy * (cols / 8);
+        for (int x = 0; x < w; x++) {
+            int px = x / sx;
+            image[y * w + x] = row[px / 8] >> (7 - px % 8) & 1 ? 0xFF : 0x00;
+        }
+    }
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *p, size_t n) {
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xEDB88320 ^ c >> 1 : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) {
+        crc = table[(crc ^ p[i]) & 0xFF] ^ crc >> 8;
+    }
+    return ~crc;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static bool write_chunk(FILE *f, const char *type, const uint8_t *data, uint32_t n) {
+    uint8_t hdr[8];
+    put_be32(hdr, n);
+    memcpy(hdr + 4, type, 4);
+    uint8_t crc[4];
+    put_be32(crc, crc32(crc32(0, hdr + 4, 4), data, n));
+    return fwrite(hdr, sizeof hdr, 1, f) == 1 &&
+           (n == 0 || fwrite(data, n, 1, f) == 1) &&
+           fwrite(crc, sizeof crc, 1, f) == 1;
+}
+
+/*
+ * Write image as a grayscale PNG. The pixel data is stored in deflate
+ * blocks without compression, which needs no zlib; encoders and image
+ * tools read it like any other PNG.
+ */
+static bool write_png(const char *path) {
+    size_t raw_len = (size_t) height * (width + 1);
+    size_t blocks = (raw_len + DEFLATE_BLOCK - 1) / DEFLATE_BLOCK;
+    size_t z_len = 2 + blocks * 5 + raw_len + 4;
+    uint8_t *z = malloc(z_len);
+    if (!z) {
+        return false;
+    }
+
+    /* zlib stream: header, stored blocks of the filtered rows, adler32 */
+    uint8_t *p = z;
+    *p++ = 0x78;
+    *p++ = 0x01;
+    uint32_t a = 1, b = 0;
+    size_t left = 0;
+    size_t done = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = -1; x < width; x++) {
+            if (!left) {
+                left = raw_len - done < DEFLATE_BLOCK ? raw_len - done : DEFLATE_BLOCK;
+                *p++ = raw_len - done == left;
+                p[0] = left;
+                p[1] = left >> 8;
+                p[2] = ~left;
+                p[3] = ~left >> 8;
+                p += 4;
+            }
+            uint8_t c = x < 0 ? 0 : image[y * width + x];
+            *p++ = c;
+            a = (a + c) % 65521;
+            b = (b + a) % 65521;
+            left--;
+            done++;
+        }
+    }
+    put_be32(p, b << 16 | a);
+
+    uint8_t ihdr[13];
+    put_be32(ihdr, width);
+    put_be32(ihdr + 4, height);
+    ihdr[8] = 8;                        /* Bit depth */
+    ihdr[9] = 0;                        /* Grayscale */
+    ihdr[10] = ihdr[11] = ihdr[12] = 0; /* Deflate, adaptive filters, no interlace */
+
+    bool ok = false;
+    FILE *f = fopen(path, "wb");
+    if (f) {
+        ok = fwrite("\x89PNG\r\n\x1A\n", 8, 1, f) == 1 &&
+             write_chunk(f, "IHDR", ihdr, sizeof ihdr) &&
+             write_chunk(f, "IDAT", z, z_len) &&
+             write_chunk(f, "IEND", NULL, 0);
+        ok &= fclose(f) == 0;
+    }
+    free(z);
+    if (!ok) {
+        fprintf(stderr, "Unable to write file %s\n", path);
+    }
+    return ok;
+}
+
+static bool write_y4m_frame(FILE *f) {
+    return fwrite("FRAME\n", 6, 1, f) == 1 &&
+           fwrite(image, (size_t) width * height, 1, f) == 1;
+}
+
+static void prt_usage() {
+    static const char *usage =
+        "Usage: chip8-video [options] [file]\n\n"
+        "  -h           Print this message and exit\n"
+        "  -f [format]  Output format: y4m (default), png\n"
+        "  -o [out]     y4m: output file (default: stdout)\n"
+        "               png: file name prefix, frame n is written to\n"
+        "               out-n.png (default: frame)\n"
+        "  -s [scale]   Output pixels per 128x64 pixel (default 4)\n"
+        "  -a           png: write every frame, not only those that\n"
+        "               changed (y4m always has all of them)\n";
+    fprintf(stdout, "%s", usage);
+}
+
+int main(int argc, char **argv) {
+    enum format format = FORMAT_Y4M;
+    const char *out = NULL;
+    bool all_frames = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "hf:o:s:a")) != -1) {
+        switch (opt) {
+        case 'h':
+            prt_usage();
+            exit(EXIT_SUCCESS);
+            break;
+        case 'f':
+            if (strcmp(optarg, "y4m") == 0) {
+                format = FORMAT_Y4M;
+            } else if (strcmp(optarg, "png") == 0) {
+                format = FORMAT_PNG;
+            } else {
+                fprintf(stderr, "Unknown format: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            out = optarg;
+            break;
+        case 's':
+            scale = atoi(optarg);
+            if (scale < 1 || scale > 64) {
+                fprintf(stderr, "Scale must be between 1 and 64\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            all_frames = true;
+            break;
+        default:
+            prt_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        prt_usage();
+        fprintf(stderr, "\nError: Expected file name argument\n");
+        exit(EXIT_FAILURE);
+    }
+    struct video_reader r;
+    if (!video_reader_open(&r, argv[optind])) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* one picture size for the whole video, 64x32 frames are doubled */
+    width = DISP_HI_W * scale;
+    height = DISP_HI_H * scale;
+    image = malloc((size_t) width * height);
+    if (!image) {
+        fprintf(stderr, "Unable to allocate the image\n");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE *f = stdout;
+    if (format == FORMAT_Y4M) {
+        if (out && !(f = fopen(out, "wb"))) {
+            fprintf(stderr, "Unable to write file %s\n", out);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(f, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 Cmono\n", width, height);
+    }
+    if (!out) {
+        out = "frame";
+    }
+
+    /*
+     * A record holds from its frame until the next one. Each is written
+     * when the next is read, which tells how many frames it lasts; the
+     * last one is written once.
+     */
+    int status;
+    bool ok = true;
+    bool have = false;
+    uint64_t shown = 0;
+    char path[4096];
+    do {
+        uint64_t prev = r.frame;
+        struct video_reader next = r;
+        status = video_read(&next);
+        if (status < 0) {
+            fprintf(stderr, "Truncated or corrupt video file: %s\n", argv[optind]);
+            ok = false;
+        }
+        if (have) {
+            uint64_t until = status > 0 ? next.frame : prev + 1;
+            for (; shown < until && ok; shown++) {
+                if (format == FORMAT_Y4M) {
+                    ok = write_y4m_frame(f);
+                } else if (shown == prev || all_frames) {
+                    snprintf(path, sizeof path, "%s-%06llu.png", out,
+                             (unsigned long long) shown);
+                    ok = write_png(path);
+                }
+            }
+        }
+        if (status > 0) {
+            r = next;
+            render(&r, width, height);
+            /* the video starts at the first record */
+            if (!have) {
+                shown = r.frame;
+                have = true;
+            }
+        }
+    } while (status > 0 && ok);
+
+    if (format == FORMAT_Y4M && fflush(f) != 0) {
+        ok = false;
+    }
+    if (f != stdout) {
+        fclose(f);
+    }
+    video_reader_close(&r);
+    free(image);
+    return ok ? 0 : 1;
+}